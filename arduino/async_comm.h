@@ -2,12 +2,39 @@
 #define _ASYNC_COMMUNICATION_H
 
 #include <stdint.h>
+#include <string.h>
 
 #include "protocol.h"
+#include "frame_parser.h"
+#include "crc16.h"
+#include "message_schema.h"
+#include "fragment.h"
+#include "subscription.h"
 
 #define MAX_RCV_BUFFER_SIZE 64
 #define MAX_SND_BUFFER_SIZE 64
 
+#ifndef PROTOCOL_FRAME_TYPE_DATA
+#define PROTOCOL_FRAME_TYPE_DATA 1
+#endif
+#ifndef PROTOCOL_FRAME_TYPE_DATA_LIST
+#define PROTOCOL_FRAME_TYPE_DATA_LIST 3
+#endif
+
+// largest chunk of a message sent by sendMessage(): deviceId, FragmentHeader
+// and chunk have to fit in the send buffer
+#define MESSAGE_CHUNK_SIZE (MAX_SND_BUFFER_SIZE - 1 - FragmentHeader::size)
+
+#define MESSAGE_ACK_NONE 0
+#define MESSAGE_ACK_PENDING 1
+#define MESSAGE_ACK_ACKED 2
+#define MESSAGE_ACK_NACKED 3
+
+// deviceIds the PC may be subscribed to at the same time
+#ifndef MAX_SUBSCRIPTIONS
+#define MAX_SUBSCRIPTIONS 8
+#endif
+
 class AsyncCommunication
 {
 private:
@@ -16,15 +43,235 @@ private:
     uint8_t lastFrameId;
     uint8_t rcvBufferSize;
     uint8_t sndBufferSize;
+    FrameParser rcvParser;
+
+    // a DATA_LIST frame [frameId, DATA_LIST, entries...] is handed out one entry
+    // [deviceId, 1 + num params, params...] at a time, each one looking like a
+    // DATA frame to read(). listEntry is the offset of the current entry, 0 when
+    // the received frame isn't a list.
+    uint8_t listEntry;
+    uint8_t listFrameSize;
+    bool listAcked;
+
+    // message received as FRAGMENT frames, written to the buffer given to
+    // setMessageBuffer(). Fragments are expected in order, rcvMessageNext is the
+    // seq of the next one: after a gap the PC resends the message from the start.
+    // It stays at the fragment count once the message is complete.
+    uint8_t *rcvMessage;
+    uint32_t rcvMessageCapacity;
+    uint32_t rcvMessageSize;
+    uint16_t rcvMessageNext;
+    uint8_t rcvMessageId;
+    uint8_t rcvMessageDevice;
+    bool rcvMessageReady;
+
+    // last message sent with sendMessage(), waiting for the PC to ack its last fragment
+    uint8_t sndMessageId;
+    uint8_t sndMessageFrameId;
+    uint8_t sndMessageAck;
+    uint8_t sndFrameId;
+
+    typedef struct
+    {
+        bool active;
+        uint8_t deviceId;
+        uint16_t period_ms;
+        unsigned long nextDue;
+        unsigned long leaseEnd;
+    } Subscription;
+
+    Subscription subscriptions[MAX_SUBSCRIPTIONS];
+
+    // samples published since the last flushPublished(), as DATA_LIST entries
+    // [deviceId, 1 + size, values...]
+    char pubBuffer[MAX_SND_BUFFER_SIZE];
+    uint8_t pubSize;
+
+    // millis() comparisons that survive the wrap around
+    static bool reached(unsigned long now, unsigned long when)
+    {
+        return (long)(now - when) >= 0;
+    }
 
-    char serialRead()
+    // the next multiple of period after now, so that deviceIds subscribed with
+    // the same period fall due together and share a DATA_LIST frame
+    static unsigned long nextTick(unsigned long now, uint16_t period)
     {
-        waitBus();
-        return busRead();
+        return now - now % period + period;
+    }
+
+    // applies the SUBSCRIBE frame in rcvBuffer and acks it. When every slot is
+    // taken it is left unanswered: a NACK would only have the PC resend it.
+    void receiveSubscribe()
+    {
+        if (rcvBufferSize < 3 + SubscribeRequest::size)
+            return;
+
+        uint16_t period, lease;
+        SubscribeRequest::decode((const uint8_t *)&rcvBuffer[3], period, lease);
+        uint8_t deviceId = rcvBuffer[2];
+        unsigned long now = busMillis();
+
+        Subscription *sub = 0;
+        for (uint8_t i = 0; i < MAX_SUBSCRIPTIONS; i++)
+        {
+            if (subscriptions[i].active && reached(now, subscriptions[i].leaseEnd))
+                subscriptions[i].active = false;
+            if (subscriptions[i].active && subscriptions[i].deviceId == deviceId)
+                sub = &subscriptions[i];
+            else if (sub == 0 && !subscriptions[i].active && period > 0)
+                sub = &subscriptions[i];
+        }
+
+        if (period == 0)
+        {
+            if (sub != 0)
+                sub->active = false;
+            sendAck(rcvBuffer[0], MSG_ACK);
+            return;
+        }
+        if (sub == 0)
+            return;
+
+        if (period < SUBSCRIPTION_MIN_PERIOD_ms)
+            period = SUBSCRIPTION_MIN_PERIOD_ms;
+        if (!sub->active || sub->deviceId != deviceId || sub->period_ms != period)
+        {
+            sub->deviceId = deviceId;
+            sub->nextDue = nextTick(now, period);
+        }
+        sub->active = true;
+        sub->period_ms = period;
+        sub->leaseEnd = now + lease;
+        sendAck(rcvBuffer[0], MSG_ACK);
+    }
+
+    void sendAck(uint8_t frameId, char ack)
+    {
+        sendFrame(frameId, PROTOCOL_FRAME_TYPE_ACK, &ack, 1);
+    }
+
+    // stores the chunk of the FRAGMENT frame in rcvBuffer, acks or nacks the
+    // message on its last fragment
+    void receiveFragment()
+    {
+        if (rcvBufferSize < FRAGMENT_FRAME_HEADER_SIZE)
+            return;
+
+        uint8_t msgId;
+        uint16_t seq, count;
+        uint32_t size;
+        FragmentHeader::decode((const uint8_t *)&rcvBuffer[3], msgId, seq, count, size);
+        uint8_t deviceId = rcvBuffer[2];
+        if (!fragmentHeaderValid(size, count) || seq >= count || rcvBufferSize - FRAGMENT_FRAME_HEADER_SIZE != fragmentSize(size, count, seq))
+            return;
+
+        if (msgId != rcvMessageId || deviceId != rcvMessageDevice || size != rcvMessageSize)
+        {
+            // no room for it: left unanswered, the PC times out
+            if (rcvMessage == 0 || rcvMessageReady || size > rcvMessageCapacity)
+                return;
+            rcvMessageId = msgId;
+            rcvMessageDevice = deviceId;
+            rcvMessageSize = size;
+            rcvMessageNext = 0;
+        }
+        bool complete = rcvMessageNext == count;
+        if (seq == rcvMessageNext)
+        {
+            memcpy(rcvMessage + (uint32_t)seq * fragmentChunkSize(size, count), &rcvBuffer[FRAGMENT_FRAME_HEADER_SIZE], rcvBufferSize - FRAGMENT_FRAME_HEADER_SIZE);
+            rcvMessageNext++;
+        }
+
+        if (seq != count - 1)
+            return;
+        if (rcvMessageNext == count)
+        {
+            // a copy of a message already received only needs the ACK again
+            if (!complete)
+                rcvMessageReady = true;
+            sendAck(rcvBuffer[0], MSG_ACK);
+        }
+        else
+            sendAck(rcvBuffer[0], MSG_ERR);
+    }
+
+    // points listEntry at the entry starting at pos, returns false when there is none
+    bool selectListEntry(uint8_t pos)
+    {
+        if (pos + 1 >= listFrameSize)
+            return false;
+
+        uint8_t entrySize = rcvBuffer[pos + 1];
+        if (entrySize < 1 || pos + 1 + entrySize > listFrameSize)
+            return false;
+
+        listEntry = pos;
+        // frameId, frameType, deviceId, params
+        rcvBufferSize = 2 + entrySize;
+        return true;
+    }
+
+    void busWriteEscaped(uint8_t val)
+    {
+        if (frameNeedsEscape(val))
+        {
+            busWrite(MSG_ESC);
+            val ^= MSG_ESC_XOR;
+        }
+        busWrite(val);
+    }
+
+    // returns false, leaving the frame unsent, when the bus hasn't room for it
+    bool sendFrame(uint8_t frameId, uint8_t msgType, const char *body, uint8_t size)
+    {
+        uint16_t crc = crc16Update(crc16Update(CRC16_INIT, frameId), msgType);
+        for (int i = 0; i < size; i++)
+            crc = crc16Update(crc, body[i]);
+
+        // delimiters, frameId, msgType, body and crc, each escaped byte taking two
+        unsigned int wireSize = 4 + size + FRAME_CRC_SIZE;
+        wireSize += frameNeedsEscape(frameId) + frameNeedsEscape(msgType);
+        wireSize += frameNeedsEscape(crc & 0xff) + frameNeedsEscape(crc >> 8);
+        for (int i = 0; i < size; i++)
+            wireSize += frameNeedsEscape(body[i]);
+
+        if (busBufferAvailableWrite() < wireSize)
+            return false;
+
+        busWrite(MSG_START);
+        busWriteEscaped(frameId);
+        busWriteEscaped(msgType);
+
+        for (int i = 0; i < size; i++)
+            busWriteEscaped(body[i]);
+
+        busWriteEscaped(crc & 0xff);
+        busWriteEscaped(crc >> 8);
+        busWrite(MSG_END);
+
+        busFlush();
+        return true;
+    }
+
+    // a frame that fails its CRC is NACKed right away so the PC resends it
+    // without waiting for its ACK timeout. Its frameId may be the damaged part,
+    // the PC ignores NACKs for frames it isn't waiting on.
+    bool checkCrc()
+    {
+        uint8_t size = rcvParser.frameSize();
+        if (size > FRAME_CRC_SIZE)
+        {
+            uint16_t crc = crc16((const uint8_t *)rcvBuffer, size - FRAME_CRC_SIZE);
+            if ((uint8_t)rcvBuffer[size - 2] == (crc & 0xff) && (uint8_t)rcvBuffer[size - 1] == (crc >> 8))
+                return true;
+        }
+
+        sendAck(rcvBuffer[0], MSG_ERR);
+        return false;
     }
 
 protected:
-    virtual void waitBus() = 0;
     virtual void busInitialize() = 0;
     virtual unsigned int busBufferAvailableRead() = 0;
     virtual char busRead() = 0;
@@ -32,10 +279,14 @@ protected:
     virtual unsigned int busBufferAvailableWrite() = 0;
     virtual void busFlush() = 0;
     virtual bool busReady() = 0;
+    // milliseconds since start, may wrap (Arduino millis())
+    virtual unsigned long busMillis() = 0;
 
 public:
-    AsyncCommunication()
+    AsyncCommunication() : rcvParser((uint8_t *)rcvBuffer, MAX_RCV_BUFFER_SIZE)
     {
+        rcvMessage = 0;
+        rcvMessageCapacity = 0;
     }
 
     void initialize() 
@@ -43,19 +294,62 @@ public:
         busInitialize();
         rcvBufferSize = 0;
         sndBufferSize = 0;
+        listEntry = 0;
+        rcvParser.reset();
+        rcvMessageReady = false;
+        rcvMessageSize = 0;
+        rcvMessageNext = 0;
+        rcvMessageId = 0;
+        rcvMessageDevice = 0;
+        sndMessageId = 0;
+        sndMessageAck = MESSAGE_ACK_NONE;
+        sndFrameId = 0;
+        for (uint8_t i = 0; i < MAX_SUBSCRIPTIONS; i++)
+            subscriptions[i].active = false;
+        pubSize = 0;
     }
 
     char read(uint8_t pos) 
     {
-        return rcvBuffer[pos];
+        if (listEntry == 0)
+            return rcvBuffer[pos];
+
+        switch (pos)
+        {
+        case 0:
+            return lastFrameId;
+        case 1:
+            return PROTOCOL_FRAME_TYPE_DATA;
+        case 2:
+            return rcvBuffer[listEntry];
+        default:
+            // skip the entry size byte
+            return rcvBuffer[listEntry + pos - 1];
+        }
     }
 
     uint16_t readInt16(uint8_t pos)
     {
-        uint16p p;
-        p.bval[0] = read(pos);
-        p.bval[1] = read(pos+1);
-        return p.val;
+        uint16_t val = 0;
+        readMessage<MessageSchema<uint16_t> >(pos, val);
+        return val;
+    }
+
+    // decodes the Schema message (message_schema.h) starting at pos of the
+    // received data. Returns false, leaving values untouched, when the data is
+    // too short for it.
+    template <typename Schema, typename... Fields>
+    bool readMessage(uint8_t pos, Fields &...values)
+    {
+        if (pos + Schema::size > rcvBufferSize)
+            return false;
+
+        // read() and not rcvBuffer: pos may be in a DATA_LIST entry
+        uint8_t buf[Schema::size > 0 ? Schema::size : 1];
+        for (uint8_t i = 0; i < Schema::size; i++)
+            buf[i] = read(pos + i);
+        Schema::decode(buf, values...);
+        return true;
     }
 
     bool hasDataToSend() 
@@ -63,23 +357,36 @@ public:
         return sndBufferSize > 0;
     }
 
+    // bytes past MAX_SND_BUFFER_SIZE are dropped, larger data goes with sendMessage()
     void write(char val) 
     {
+        if (sndBufferSize >= MAX_SND_BUFFER_SIZE)
+            return;
         sndBuffer[sndBufferSize++] = val;
     }
 
     void writeF(float val) 
     {
-        unsigned char const *p = reinterpret_cast<unsigned char const *>(&val);
-        for (int i = 0; i < sizeof(float); i++)
-            sndBuffer[sndBufferSize++] = p[i];
+        writeMessage<MessageSchema<float> >(val);
     }
 
+    // always 4 bytes on the wire, the PC reads it as an int32_t
     void writeL(long val) 
     {
-        unsigned char const *p = reinterpret_cast<unsigned char const *>(&val);
-        for (int i = 0; i < sizeof(long); i++)
-            sndBuffer[sndBufferSize++] = p[i];
+        writeMessage<MessageSchema<int32_t> >(val);
+    }
+
+    // appends a message laid out by Schema (message_schema.h) to the data to
+    // send. Returns false, leaving it unchanged, when there isn't room left.
+    template <typename Schema, typename... Args>
+    bool writeMessage(Args... values)
+    {
+        static_assert(Schema::size <= MAX_SND_BUFFER_SIZE, "message larger than the send buffer");
+        if (sndBufferSize + Schema::size > MAX_SND_BUFFER_SIZE)
+            return false;
+        Schema::encode((uint8_t *)&sndBuffer[sndBufferSize], values...);
+        sndBufferSize += Schema::size;
+        return true;
     }
 
     void receiveData() 
@@ -87,39 +394,59 @@ public:
         if (rcvBufferSize > 0)
             return;
 
-        if (busBufferAvailableRead() == 0)
-            return;
-
-        rcvBufferSize = 0;
-        char ch;
-
-        bool valid = false;
-        while (!valid && busBufferAvailableRead() > 0)
+        // never waits for the bus: only the bytes it already holds are read, a
+        // frame split across calls is kept by rcvParser until its MSG_END shows
+        // up. The frame is handed out right then, the bytes after it stay in the
+        // bus buffer for the next call. Cheap enough to call on every loop().
+        unsigned int available = busBufferAvailableRead();
+        while (available > 0)
         {
-            if (serialRead() == MSG_START)
-                valid = true;
+            available--;
+            if (rcvParser.push(busRead()) == FRAME_PARSER_COMPLETE)
+            {
+                if (!checkCrc())
+                    continue;
+
+                rcvBufferSize = rcvParser.frameSize() - FRAME_CRC_SIZE;
+                lastFrameId = rcvBuffer[0];
+                listEntry = 0;
+
+                // fragments and the ACK of our message are handled here, the
+                // sketch only sees the complete message (hasMessage())
+                if (rcvBufferSize > 1 && rcvBuffer[1] == PROTOCOL_FRAME_TYPE_FRAGMENT)
+                {
+                    receiveFragment();
+                    rcvBufferSize = 0;
+                    continue;
+                }
+                if (rcvBufferSize > 1 && rcvBuffer[1] == PROTOCOL_FRAME_TYPE_SUBSCRIBE)
+                {
+                    receiveSubscribe();
+                    rcvBufferSize = 0;
+                    continue;
+                }
+                if (rcvBufferSize > 2 && rcvBuffer[1] == PROTOCOL_FRAME_TYPE_ACK && sndMessageAck == MESSAGE_ACK_PENDING && (uint8_t)rcvBuffer[0] == sndMessageFrameId)
+                {
+                    sndMessageAck = rcvBuffer[2] == MSG_ACK ? MESSAGE_ACK_ACKED : MESSAGE_ACK_NACKED;
+                    rcvBufferSize = 0;
+                    continue;
+                }
+
+                if (rcvBufferSize > 1 && rcvBuffer[1] == PROTOCOL_FRAME_TYPE_DATA_LIST)
+                {
+                    listFrameSize = rcvBufferSize;
+                    listAcked = false;
+                    if (!selectListEntry(2))
+                    {
+                        // empty or malformed list, nothing to hand out
+                        listEntry = 0;
+                        rcvBufferSize = 0;
+                        continue;
+                    }
+                }
+                return;
+            }
         }
-
-        if (!valid)
-        {
-            rcvBufferSize = 0;
-            return;
-        }
-
-        valid = false;
-        while (!valid && busBufferAvailableRead() > 0 && rcvBufferSize < MAX_RCV_BUFFER_SIZE)
-        {
-            ch = serialRead();
-            if (ch == MSG_END)
-                valid = true;
-            else
-                rcvBuffer[rcvBufferSize++] = ch;
-        }
-
-        if (!valid)
-            rcvBufferSize = 0;
-
-        lastFrameId = rcvBuffer[0];
     }
 
     void sendData(uint8_t frameId, uint8_t msgType) 
@@ -127,21 +454,8 @@ public:
         if (sndBufferSize == 0)
             return;
 
-        if (busBufferAvailableWrite() < sndBufferSize)
-            return;
-
-        busWrite(MSG_START);
-        busWrite(frameId);
-        busWrite(msgType);
-
-        for (int i = 0; i < sndBufferSize; i++)
-            busWrite(sndBuffer[i]);
-
-        busWrite(MSG_END);
-
-        sndBufferSize = 0;
-
-        busFlush();
+        if (sendFrame(frameId, msgType, sndBuffer, sndBufferSize))
+            sndBufferSize = 0;
     }
 
     bool hasData() 
@@ -149,18 +463,167 @@ public:
         return rcvBufferSize > 0;
     }
 
+    // a DATA_LIST frame is acked once, for all its entries
     void ack() 
     {
+        if (listEntry > 0 && listAcked)
+            return;
+        listAcked = true;
         write(MSG_ACK);
         sendData(lastFrameId, PROTOCOL_FRAME_TYPE_ACK);
     }
 
     void nack() 
     {
+        if (listEntry > 0 && listAcked)
+            return;
+        listAcked = true;
         write(MSG_ERR);
         sendData(lastFrameId, PROTOCOL_FRAME_TYPE_ACK);
     }
 
+    // where messages sent by the PC with SerialLink::sendMessage() are put
+    // together. Messages larger than capacity are ignored.
+    void setMessageBuffer(uint8_t *buffer, uint32_t capacity)
+    {
+        rcvMessage = buffer;
+        rcvMessageCapacity = capacity;
+        rcvMessageReady = false;
+    }
+
+    // a complete message is in the message buffer. Further messages are left
+    // unacked, the PC resending them, until clearMessage().
+    bool hasMessage()
+    {
+        return rcvMessageReady;
+    }
+
+    uint32_t messageSize()
+    {
+        return rcvMessageSize;
+    }
+
+    uint8_t messageDeviceId()
+    {
+        return rcvMessageDevice;
+    }
+
+    void clearMessage()
+    {
+        rcvMessageReady = false;
+    }
+
+    // sends size bytes as one message of FRAGMENT frames, reassembled by the PC
+    // and handed to its handlers at once. The PC acks the message as a whole,
+    // see messageAck(). resend repeats the previous message, which must be the
+    // same data, so the PC keeps the fragments it already has. Returns false
+    // when the bus couldn't take a fragment.
+    bool sendMessage(uint8_t deviceId, const uint8_t *data, uint32_t size, bool resend = false)
+    {
+        if (size > (uint32_t)MESSAGE_CHUNK_SIZE * 0xffff)
+            return false;
+        uint16_t count = fragmentCount(size, MESSAGE_CHUNK_SIZE);
+        uint32_t chunk = fragmentChunkSize(size, count);
+        if (!resend)
+            sndMessageId++;
+
+        char body[MAX_SND_BUFFER_SIZE];
+        body[0] = deviceId;
+        for (uint16_t seq = 0; seq < count; seq++)
+        {
+            uint32_t n = fragmentSize(size, count, seq);
+            FragmentHeader::encode((uint8_t *)&body[1], sndMessageId, seq, count, size);
+            memcpy(&body[1 + FragmentHeader::size], data + (uint32_t)seq * chunk, n);
+
+            if (++sndFrameId == 0)
+                sndFrameId = 1;
+            // wait for the bus to drain once before giving up
+            if (!sendFrame(sndFrameId, PROTOCOL_FRAME_TYPE_FRAGMENT, body, 1 + FragmentHeader::size + n))
+            {
+                busFlush();
+                if (!sendFrame(sndFrameId, PROTOCOL_FRAME_TYPE_FRAGMENT, body, 1 + FragmentHeader::size + n))
+                {
+                    sndMessageAck = MESSAGE_ACK_NONE;
+                    return false;
+                }
+            }
+        }
+        sndMessageFrameId = sndFrameId;
+        sndMessageAck = MESSAGE_ACK_PENDING;
+        return true;
+    }
+
+    // MESSAGE_ACK_PENDING until the PC answered the last sendMessage(), then
+    // MESSAGE_ACK_ACKED or MESSAGE_ACK_NACKED (resend it)
+    uint8_t messageAck()
+    {
+        return sndMessageAck;
+    }
+
+    // true when the PC is subscribed to deviceId and its next sample is due, which
+    // it then is to publish(). Samples are never closer than the subscription
+    // period: one that is late doesn't make the next one come earlier.
+    bool subscriptionDue(uint8_t deviceId)
+    {
+        unsigned long now = busMillis();
+        for (uint8_t i = 0; i < MAX_SUBSCRIPTIONS; i++)
+        {
+            Subscription &sub = subscriptions[i];
+            if (!sub.active || sub.deviceId != deviceId)
+                continue;
+            if (reached(now, sub.leaseEnd))
+            {
+                // not renewed, the PC is gone
+                sub.active = false;
+                return false;
+            }
+            if (!reached(now, sub.nextDue))
+                return false;
+            sub.nextDue += sub.period_ms;
+            if (reached(now, sub.nextDue))
+                sub.nextDue = nextTick(now, sub.period_ms);
+            return true;
+        }
+        return false;
+    }
+
+    // queues a sample of deviceId, sent with the other samples of this round by
+    // flushPublished(). Returns false when it can never fit in a frame.
+    bool publish(uint8_t deviceId, const char *values, uint8_t size)
+    {
+        if (2 + size > MAX_SND_BUFFER_SIZE)
+            return false;
+        if (pubSize + 2 + size > MAX_SND_BUFFER_SIZE)
+            flushPublished();
+
+        pubBuffer[pubSize++] = deviceId;
+        pubBuffer[pubSize++] = 1 + size;
+        memcpy(&pubBuffer[pubSize], values, size);
+        pubSize += size;
+        return true;
+    }
+
+    template <typename Schema, typename... Args>
+    bool publish(uint8_t deviceId, Args... values)
+    {
+        static_assert(2 + Schema::size <= MAX_SND_BUFFER_SIZE, "sample larger than the send buffer");
+        char sample[Schema::size > 0 ? Schema::size : 1];
+        Schema::encode((uint8_t *)sample, values...);
+        return publish(deviceId, sample, Schema::size);
+    }
+
+    // sends the published samples as one DATA_LIST frame
+    void flushPublished()
+    {
+        if (pubSize == 0)
+            return;
+        if (++sndFrameId == 0)
+            sndFrameId = 1;
+        // a sample the bus has no room for is stale by the next round anyway
+        sendFrame(sndFrameId, PROTOCOL_FRAME_TYPE_DATA_LIST, pubBuffer, pubSize);
+        pubSize = 0;
+    }
+
     bool isReady() 
     {
         return busReady();
@@ -173,10 +636,17 @@ public:
 
         sndBufferSize = 0;
         rcvBufferSize = 0;
+        listEntry = 0;
+        rcvParser.reset();
     }
 
+    // done with the received frame, or with the current entry of a DATA_LIST
+    // frame, in which case the next entry becomes the received data
     void clearReceiveBuffer() 
     {
+        if (listEntry > 0 && selectListEntry(listEntry + 1 + rcvBuffer[listEntry + 1]))
+            return;
+        listEntry = 0;
         rcvBufferSize = 0;
     }
 };
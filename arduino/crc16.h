@@ -0,0 +1,31 @@
+#ifndef _CRC16_H
+#define _CRC16_H
+
+#include <stdint.h>
+
+// CRC-16/CCITT-FALSE (poly 0x1021, init 0xFFFF) with a 16 entry table, small
+// enough for the AVR. The PC side computes the same CRC with a faster table
+// (pc/crc16_slice.h).
+
+#define CRC16_INIT 0xFFFF
+
+static const uint16_t crc16NibbleTable[16] = {
+    0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50a5, 0x60c6, 0x70e7,
+    0x8108, 0x9129, 0xa14a, 0xb16b, 0xc18c, 0xd1ad, 0xe1ce, 0xf1ef};
+
+static inline uint16_t crc16Update(uint16_t crc, uint8_t val)
+{
+    crc = (crc << 4) ^ crc16NibbleTable[(crc >> 12) ^ (val >> 4)];
+    crc = (crc << 4) ^ crc16NibbleTable[(crc >> 12) ^ (val & 0x0f)];
+    return crc;
+}
+
+static inline uint16_t crc16(const uint8_t *data, unsigned int size)
+{
+    uint16_t crc = CRC16_INIT;
+    for (unsigned int i = 0; i < size; i++)
+        crc = crc16Update(crc, data[i]);
+    return crc;
+}
+
+#endif
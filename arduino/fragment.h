@@ -0,0 +1,64 @@
+#ifndef _FRAGMENT_H
+#define _FRAGMENT_H
+
+#include <stdint.h>
+
+#include "message_schema.h"
+
+// Messages larger than a frame are split in FRAGMENT frames
+//
+//     [frameId, FRAGMENT, deviceId, msgId, seq, count, total, chunk...]
+//
+// seq and count are uint16_t, total (the message size) an uint32_t, all little
+// endian (FragmentHeader). Every chunk but the last holds fragmentChunkSize()
+// bytes, so a fragment lands at seq * chunk size whatever the order it arrives
+// in. Shared by the arduino headers and the PC side, plain C++ only.
+//
+// The whole message is acked once: the receiver answers the last fragment
+// (seq == count - 1) with an ACK carrying its frameId when every fragment
+// arrived, with a NACK otherwise. The sender then resends the message with the
+// same msgId, fragments already received are simply written again.
+
+#ifndef PROTOCOL_FRAME_TYPE_FRAGMENT
+#define PROTOCOL_FRAME_TYPE_FRAGMENT 4
+#endif
+
+// msgId, seq, count, total
+typedef MessageSchema<uint8_t, uint16_t, uint16_t, uint32_t> FragmentHeader;
+
+// frameId, frame type, deviceId and FragmentHeader ahead of the chunk
+#define FRAGMENT_FRAME_HEADER_SIZE (3 + FragmentHeader::size)
+
+// fragments needed to send size bytes with chunks of at most maxChunk bytes
+static inline uint16_t fragmentCount(uint32_t size, uint32_t maxChunk)
+{
+    if (size == 0)
+        return 1;
+    return (size + maxChunk - 1) / maxChunk;
+}
+
+// size of every chunk but the last one
+static inline uint32_t fragmentChunkSize(uint32_t size, uint16_t count)
+{
+    return (size + count - 1) / count;
+}
+
+// whether count fragments can carry size bytes, none of them empty
+static inline bool fragmentHeaderValid(uint32_t size, uint16_t count)
+{
+    if (count == 0)
+        return false;
+    if (size == 0)
+        return count == 1;
+    return (uint32_t)(count - 1) * fragmentChunkSize(size, count) < size;
+}
+
+// bytes carried by fragment seq of a valid header
+static inline uint32_t fragmentSize(uint32_t size, uint16_t count, uint16_t seq)
+{
+    uint32_t chunk = fragmentChunkSize(size, count);
+    uint32_t offset = (uint32_t)seq * chunk;
+    return size - offset < chunk ? size - offset : chunk;
+}
+
+#endif
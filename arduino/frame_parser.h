@@ -0,0 +1,162 @@
+#ifndef _FRAME_PARSER_H
+#define _FRAME_PARSER_H
+
+#include <stdint.h>
+
+// shared by the arduino headers and the PC side (pc/serial_comm_pi.h), so it
+// must stay plain C++ with no STL or heap usage.
+
+#ifndef MSG_START
+#define MSG_START 32
+#endif
+#ifndef MSG_END
+#define MSG_END 31
+#endif
+#ifndef MSG_ESC
+#define MSG_ESC 30
+#endif
+
+// a body byte equal to MSG_START, MSG_END or MSG_ESC goes on the wire as
+// MSG_ESC followed by the byte xor MSG_ESC_XOR, so the delimiters only ever
+// show up around a frame
+#define MSG_ESC_XOR 0x20
+
+// every frame body ends with the CRC-16 of the bytes before it, low byte first
+// (arduino/crc16.h, pc/crc16_slice.h). It is escaped like the rest of the body.
+#define FRAME_CRC_SIZE 2
+
+// largest possible wire size of a frame whose body is n bytes, CRC excluded
+#define FRAME_ENCODED_MAX_SIZE(n) (2 * ((n) + FRAME_CRC_SIZE) + 2)
+
+#define FRAME_PARSER_NONE 0
+#define FRAME_PARSER_COMPLETE 1
+#define FRAME_PARSER_INVALID 2
+
+#define FRAME_PARSER_STATE_WAIT_START 0
+#define FRAME_PARSER_STATE_IN_FRAME 1
+#define FRAME_PARSER_STATE_ESCAPE 2
+
+static inline bool frameNeedsEscape(uint8_t ch)
+{
+    return ch == MSG_START || ch == MSG_END || ch == MSG_ESC;
+}
+
+static inline unsigned int frameEncodeByte(uint8_t ch, uint8_t *out)
+{
+    if (!frameNeedsEscape(ch))
+    {
+        out[0] = ch;
+        return 1;
+    }
+    out[0] = MSG_ESC;
+    out[1] = ch ^ MSG_ESC_XOR;
+    return 2;
+}
+
+// writes MSG_START, the escaped body and crc and MSG_END to out, which must have
+// room for FRAME_ENCODED_MAX_SIZE(size) bytes. Returns the number of bytes written.
+static inline unsigned int frameEncode(const uint8_t *body, unsigned int size, uint16_t crc, uint8_t *out)
+{
+    unsigned int n = 0;
+    out[n++] = MSG_START;
+    for (unsigned int i = 0; i < size; i++)
+        n += frameEncodeByte(body[i], &out[n]);
+    n += frameEncodeByte(crc & 0xff, &out[n]);
+    n += frameEncodeByte(crc >> 8, &out[n]);
+    out[n++] = MSG_END;
+    return n;
+}
+
+// Resumable MSG_START ... MSG_END frame parser. Bytes are pushed one at a time
+// as they become available, a frame that is split over several reads is kept
+// between calls and reported as soon as its MSG_END arrives. Escaped bytes are
+// decoded on the way, the frame body is written to the buffer given to the
+// constructor.
+class FrameParser
+{
+private:
+    uint8_t *buffer;
+    unsigned int capacity;
+    unsigned int size;
+    uint8_t state;
+
+public:
+    FrameParser(uint8_t *buffer, unsigned int capacity)
+    {
+        this->buffer = buffer;
+        this->capacity = capacity;
+        reset();
+    }
+
+    void reset()
+    {
+        size = 0;
+        state = FRAME_PARSER_STATE_WAIT_START;
+    }
+
+    // returns FRAME_PARSER_COMPLETE when ch closes a frame (its body is then
+    // buffer[0 .. frameSize()-1]), FRAME_PARSER_INVALID when a frame had to be
+    // dropped because it doesn't fit the buffer, FRAME_PARSER_NONE otherwise.
+    // The caller must consume the complete frame before pushing more bytes.
+    uint8_t push(uint8_t ch)
+    {
+        if (state == FRAME_PARSER_STATE_WAIT_START)
+        {
+            if (ch == MSG_START)
+            {
+                size = 0;
+                state = FRAME_PARSER_STATE_IN_FRAME;
+            }
+            return FRAME_PARSER_NONE;
+        }
+
+        // a delimiter can't be part of a body: MSG_START means the previous frame
+        // was cut short, start over with the new one
+        if (ch == MSG_START)
+        {
+            size = 0;
+            state = FRAME_PARSER_STATE_IN_FRAME;
+            return FRAME_PARSER_NONE;
+        }
+
+        if (ch == MSG_END)
+        {
+            bool complete = state == FRAME_PARSER_STATE_IN_FRAME && size > 0;
+            state = FRAME_PARSER_STATE_WAIT_START;
+            // an empty frame carries no frameId/frameType, nothing to deliver
+            return complete ? FRAME_PARSER_COMPLETE : FRAME_PARSER_NONE;
+        }
+
+        if (state == FRAME_PARSER_STATE_ESCAPE)
+        {
+            ch ^= MSG_ESC_XOR;
+            state = FRAME_PARSER_STATE_IN_FRAME;
+        }
+        else if (ch == MSG_ESC)
+        {
+            state = FRAME_PARSER_STATE_ESCAPE;
+            return FRAME_PARSER_NONE;
+        }
+
+        if (size >= capacity)
+        {
+            reset();
+            return FRAME_PARSER_INVALID;
+        }
+
+        buffer[size++] = ch;
+        return FRAME_PARSER_NONE;
+    }
+
+    unsigned int frameSize()
+    {
+        return size;
+    }
+
+    bool inFrame()
+    {
+        return state != FRAME_PARSER_STATE_WAIT_START;
+    }
+};
+
+#endif
@@ -0,0 +1,183 @@
+#ifndef _MESSAGE_SCHEMA_H
+#define _MESSAGE_SCHEMA_H
+
+#include <stdint.h>
+#include <string.h>
+
+// Typed message layouts shared by the arduino headers and the PC side, so both
+// ends encode a message the same way. Like frame_parser.h it must stay plain
+// C++11 with no STL: avr-gcc has no standard library.
+//
+// A schema lists the fields of a message in wire order:
+//
+//     typedef MessageSchema<uint8_t, uint16_t, float> MotorCommand;
+//     uint8_t buf[MotorCommand::size];
+//     MotorCommand::encode(buf, mode, speed, angle);
+//     MotorCommand::decode(buf, mode, speed, angle);
+//
+// Every field is fixed width and little endian whatever the host. Only the
+// types with a WireField below may be used, any other one stops the build at
+// the static_assert of the primary template: double, long long, and long on
+// the PC where it isn't int32_t. int can't be rejected that way, the compiler
+// doesn't tell it from the fixed-width type it is an alias of: int32_t on the
+// PC and int16_t on the AVR, so a schema written with int builds on both ends
+// with a different layout. Always spell out the width.
+
+template <typename T>
+struct WireField
+{
+    static_assert(sizeof(T) == 0, "message fields must be fixed width: uint8_t, int8_t, char, bool, uint16_t, int16_t, uint32_t, int32_t or float");
+    static constexpr unsigned int size = 0;
+};
+
+template <>
+struct WireField<uint8_t>
+{
+    static constexpr unsigned int size = 1;
+    static void encode(uint8_t *out, uint8_t val) { out[0] = val; }
+    static uint8_t decode(const uint8_t *in) { return in[0]; }
+};
+
+template <>
+struct WireField<int8_t>
+{
+    static constexpr unsigned int size = 1;
+    static void encode(uint8_t *out, int8_t val) { out[0] = (uint8_t)val; }
+    static int8_t decode(const uint8_t *in) { return (int8_t)in[0]; }
+};
+
+// plain char is signed on the AVR and on x86 but unsigned on ARM: it goes on
+// the wire as a raw byte
+template <>
+struct WireField<char>
+{
+    static constexpr unsigned int size = 1;
+    static void encode(uint8_t *out, char val) { out[0] = (uint8_t)val; }
+    static char decode(const uint8_t *in) { return (char)in[0]; }
+};
+
+template <>
+struct WireField<bool>
+{
+    static constexpr unsigned int size = 1;
+    static void encode(uint8_t *out, bool val) { out[0] = val ? 1 : 0; }
+    static bool decode(const uint8_t *in) { return in[0] != 0; }
+};
+
+template <>
+struct WireField<uint16_t>
+{
+    static constexpr unsigned int size = 2;
+    static void encode(uint8_t *out, uint16_t val)
+    {
+        out[0] = val & 0xff;
+        out[1] = val >> 8;
+    }
+    static uint16_t decode(const uint8_t *in) { return (uint16_t)in[0] | ((uint16_t)in[1] << 8); }
+};
+
+template <>
+struct WireField<int16_t>
+{
+    static constexpr unsigned int size = 2;
+    static void encode(uint8_t *out, int16_t val) { WireField<uint16_t>::encode(out, (uint16_t)val); }
+    static int16_t decode(const uint8_t *in) { return (int16_t)WireField<uint16_t>::decode(in); }
+};
+
+template <>
+struct WireField<uint32_t>
+{
+    static constexpr unsigned int size = 4;
+    static void encode(uint8_t *out, uint32_t val)
+    {
+        out[0] = val & 0xff;
+        out[1] = (val >> 8) & 0xff;
+        out[2] = (val >> 16) & 0xff;
+        out[3] = val >> 24;
+    }
+    static uint32_t decode(const uint8_t *in)
+    {
+        return (uint32_t)in[0] | ((uint32_t)in[1] << 8) | ((uint32_t)in[2] << 16) | ((uint32_t)in[3] << 24);
+    }
+};
+
+template <>
+struct WireField<int32_t>
+{
+    static constexpr unsigned int size = 4;
+    static void encode(uint8_t *out, int32_t val) { WireField<uint32_t>::encode(out, (uint32_t)val); }
+    static int32_t decode(const uint8_t *in) { return (int32_t)WireField<uint32_t>::decode(in); }
+};
+
+// IEEE 754 single precision on both ends
+template <>
+struct WireField<float>
+{
+    static_assert(sizeof(float) == 4, "float must be 32 bits");
+    static constexpr unsigned int size = 4;
+    static void encode(uint8_t *out, float val)
+    {
+        uint32_t bits;
+        memcpy(&bits, &val, sizeof(bits));
+        WireField<uint32_t>::encode(out, bits);
+    }
+    static float decode(const uint8_t *in)
+    {
+        uint32_t bits = WireField<uint32_t>::decode(in);
+        float val;
+        memcpy(&val, &bits, sizeof(val));
+        return val;
+    }
+};
+
+template <typename... Fields>
+struct WireCodec;
+
+template <>
+struct WireCodec<>
+{
+    static constexpr unsigned int size = 0;
+    static void encode(uint8_t *) {}
+    static void decode(const uint8_t *) {}
+};
+
+template <typename Field, typename... Rest>
+struct WireCodec<Field, Rest...>
+{
+    static constexpr unsigned int size = WireField<Field>::size + WireCodec<Rest...>::size;
+
+    static void encode(uint8_t *out, Field val, Rest... rest)
+    {
+        WireField<Field>::encode(out, val);
+        WireCodec<Rest...>::encode(out + WireField<Field>::size, rest...);
+    }
+
+    static void decode(const uint8_t *in, Field &val, Rest &...rest)
+    {
+        val = WireField<Field>::decode(in);
+        WireCodec<Rest...>::decode(in + WireField<Field>::size, rest...);
+    }
+};
+
+template <typename... Fields>
+struct MessageSchema
+{
+    // encoded size in bytes, usable for array bounds and static_assert
+    static constexpr unsigned int size = WireCodec<Fields...>::size;
+    static constexpr unsigned int fieldCount = sizeof...(Fields);
+
+    // writes the fields to out, which must have room for size bytes. Returns size.
+    static unsigned int encode(uint8_t *out, Fields... values)
+    {
+        WireCodec<Fields...>::encode(out, values...);
+        return size;
+    }
+
+    // reads size bytes from in into the fields
+    static void decode(const uint8_t *in, Fields &...values)
+    {
+        WireCodec<Fields...>::decode(in, values...);
+    }
+};
+
+#endif
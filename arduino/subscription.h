@@ -0,0 +1,34 @@
+#ifndef _SUBSCRIPTION_H
+#define _SUBSCRIPTION_H
+
+#include <stdint.h>
+
+#include "message_schema.h"
+
+// Streaming subscriptions: instead of polling a deviceId, the PC subscribes to
+// it once and the device pushes its samples every period_ms
+//
+//     [frameId, SUBSCRIBE, deviceId, period_ms, lease_ms]
+//
+// both uint16_t little endian (SubscribeRequest), acked like a request. A
+// period of 0 cancels the subscription. The device stops on its own lease_ms
+// after the last SUBSCRIBE, the PC renews it well before that, so a PC that
+// went away doesn't leave the device streaming to nobody. Samples go out as
+// DATA_LIST frames, several devices due at the same time sharing one frame.
+// Shared by the arduino headers and the PC side, plain C++ only.
+
+#ifndef PROTOCOL_FRAME_TYPE_SUBSCRIBE
+#define PROTOCOL_FRAME_TYPE_SUBSCRIBE 5
+#endif
+
+// period_ms, lease_ms
+typedef MessageSchema<uint16_t, uint16_t> SubscribeRequest;
+
+// the device never streams a deviceId faster than this
+#ifndef SUBSCRIPTION_MIN_PERIOD_ms
+#define SUBSCRIPTION_MIN_PERIOD_ms 5
+#endif
+
+#define SUBSCRIPTION_LEASE_ms 3000
+
+#endif
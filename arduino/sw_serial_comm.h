@@ -10,7 +10,6 @@
 #include <SoftwareSerial.h>
 
 #define SERIAL_BOUND_RATE 115200
-#define SERIAL_RCV_WAIT_DELAY_ms 2
 #define RCV_BUFFER_SIZE 64
 #define SND_BUFFER_SIZE 64
 
@@ -22,10 +21,6 @@ private:
     int txPin;
 
 protected:
-    void waitBus() override
-    {
-        delay(SERIAL_RCV_WAIT_DELAY_ms);
-    }
     void busInitialize() override
     {
         ss = new SoftwareSerial(rx, tx);
@@ -55,6 +50,10 @@ protected:
     {
         return ss != nullptr;
     }
+    unsigned long busMillis() override
+    {
+        return millis();
+    }
 
 public:
     SoftwareSerialCommunication(int rxPin, int txPin)
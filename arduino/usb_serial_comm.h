@@ -8,17 +8,12 @@
 #include "protocol.h"
 
 #define SERIAL_BOUND_RATE 115200
-#define SERIAL_RCV_WAIT_DELAY_ms 2
 #define RCV_BUFFER_SIZE 64
 #define SND_BUFFER_SIZE 64
 
 class UsbSerialCommunication : public AsyncCommunication
 {
 protected:
-    void waitBus() override
-    {
-        delay(SERIAL_RCV_WAIT_DELAY_ms);
-    }
     void busInitialize() override
     {
         Serial.begin(SERIAL_BOUND_RATE);
@@ -47,6 +42,10 @@ protected:
     {
         return (Serial);
     }
+    unsigned long busMillis() override
+    {
+        return millis();
+    }
 };
 
 #endif
@@ -0,0 +1,105 @@
+// How soon syncRequest() returns once the device has written its ACK. The
+// device side acks each request after a random 0..3 ms of "processing" and
+// stamps the time right before the ACK goes out, so the measurement is the ACK
+// crossing the socketpair plus the wakeup of the waiting requester. Waking on
+// the ACK rather than on the next SERIAL_WAIT_DELAY_ms tick keeps that well
+// under a tick, the test fails when the median isn't. Build on the host with:
+//   g++ -O2 -std=c++17 -I../arduino -I. -I../pc -o ack_latency_test ack_latency_test.cpp device_emulator.cpp ../pc/*.cpp -lpthread
+
+#include <stdio.h>
+#include <sys/socket.h>
+#include <vector>
+#include <random>
+#include <algorithm>
+
+#include "host_bus_comm.h"
+#include "../pc/serial_link.h"
+
+#define TEST_DEVICE_ID 7
+#define TEST_REQUESTS 500
+#define TEST_MAX_DELAY_us 3000
+// a requester that polls every SERIAL_WAIT_DELAY_ms waits half a tick on average
+#define TEST_MAX_MEDIAN_us (SERIAL_WAIT_DELAY_ms * 1000 / 4)
+
+static int64_t now_ns()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// acks every request, ackSent_ns is when the last ACK was written
+static void device(int fd, std::atomic<bool> &run, std::atomic<int64_t> &ackSent_ns)
+{
+    HostBusCommunication comm(fd);
+    comm.initialize();
+    std::mt19937 rng(1);
+    struct pollfd pfd = {fd, POLLIN, 0};
+    while (run)
+    {
+        if (poll(&pfd, 1, 10) <= 0)
+            continue;
+        comm.receiveData();
+        while (comm.hasData())
+        {
+            std::this_thread::sleep_for(std::chrono::microseconds(rng() % TEST_MAX_DELAY_us));
+            ackSent_ns = now_ns();
+            comm.ack();
+            comm.clearReceiveBuffer();
+            if (!comm.hasData())
+                comm.receiveData();
+        }
+    }
+}
+
+int main()
+{
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0)
+    {
+        perror("socketpair");
+        return 1;
+    }
+
+    std::atomic<bool> run(true);
+    std::atomic<int64_t> ackSent_ns(0);
+    std::thread emulator(device, fds[1], std::ref(run), std::ref(ackSent_ns));
+
+    std::vector<double> latency;
+    int acked = 0;
+    RttStats rtt;
+    {
+        SerialLink link(new SerialCommunication(fds[0]));
+        for (int i = 0; i < TEST_REQUESTS; i++)
+        {
+            bool ok = link.syncRequest((uchar)TEST_DEVICE_ID, (uchar)i);
+            int64_t returned = now_ns();
+            if (!ok)
+                continue;
+            acked++;
+            latency.push_back((returned - ackSent_ns) / 1000.0);
+        }
+        rtt = link.getRttStats(TEST_DEVICE_ID);
+    }
+    run = false;
+    emulator.join();
+    close(fds[1]);
+
+    if (latency.empty())
+    {
+        printf("FAILED: no request was acked\n");
+        return 1;
+    }
+    std::sort(latency.begin(), latency.end());
+    double p50 = latency[latency.size() / 2];
+    printf("%d/%d acked, ACK written to syncRequest() returning: p50 %.0f us, p99 %.0f us, max %.0f us\n", acked, TEST_REQUESTS, p50,
+           latency[latency.size() * 99 / 100], latency.back());
+    // the device waits 0..TEST_MAX_DELAY_us, about half of it on average
+    printf("round trip estimate: srtt %u us, rttvar %u us, timeout %u us over %u samples\n", rtt.srtt_us, rtt.rttvar_us, rtt.rto_us,
+           rtt.samples);
+    if (acked != TEST_REQUESTS || p50 > TEST_MAX_MEDIAN_us)
+    {
+        printf("FAILED: expected every request acked and a median under %d us\n", TEST_MAX_MEDIAN_us);
+        return 1;
+    }
+    printf("OK\n");
+    return 0;
+}
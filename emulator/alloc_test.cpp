@@ -0,0 +1,144 @@
+// Counts the heap allocations of steady-state requests: malloc() and friends
+// are interposed (operator new goes through them too) and every allocation
+// made by any thread of the process while requests run is counted. After a
+// warm-up, syncRequest(), asyncRequest() and asyncRequestWithAck() with a
+// completion callback must not allocate at all, nor must TxScheduler::post().
+// Exits non zero otherwise. glibc only (__libc_malloc). Build on the host with:
+//   g++ -O2 -std=c++17 -I../arduino -I. -I../pc -o alloc_test alloc_test.cpp device_emulator.cpp ../pc/*.cpp -lpthread
+
+#include <stdio.h>
+#include <sys/socket.h>
+
+#include "device_emulator.h"
+#include "../pc/serial_link.h"
+
+#define TEST_DEVICE_ID 7
+#define TEST_WARMUP_REQUESTS 300
+#define TEST_REQUESTS 1000
+
+extern "C" void *__libc_malloc(size_t size);
+extern "C" void *__libc_calloc(size_t n, size_t size);
+extern "C" void *__libc_realloc(void *p, size_t size);
+extern "C" void *__libc_memalign(size_t alignment, size_t size);
+
+static std::atomic<bool> counting(false);
+static std::atomic<unsigned long> allocations(0);
+
+static void count()
+{
+    if (counting.load(std::memory_order_relaxed))
+        allocations.fetch_add(1, std::memory_order_relaxed);
+}
+
+extern "C" void *malloc(size_t size)
+{
+    count();
+    return __libc_malloc(size);
+}
+
+extern "C" void *calloc(size_t n, size_t size)
+{
+    count();
+    return __libc_calloc(n, size);
+}
+
+extern "C" void *realloc(void *p, size_t size)
+{
+    count();
+    return __libc_realloc(p, size);
+}
+
+extern "C" void *memalign(size_t alignment, size_t size)
+{
+    count();
+    return __libc_memalign(alignment, size);
+}
+
+extern "C" int posix_memalign(void **p, size_t alignment, size_t size)
+{
+    count();
+    *p = __libc_memalign(alignment, size);
+    return *p != nullptr ? 0 : ENOMEM;
+}
+
+extern "C" void *aligned_alloc(size_t alignment, size_t size)
+{
+    count();
+    return __libc_memalign(alignment, size);
+}
+
+// allocations per request made by run(requests), after warming it up
+static bool measure(const char *name, std::function<void(int)> run)
+{
+    run(TEST_WARMUP_REQUESTS);
+    allocations = 0;
+    counting = true;
+    run(TEST_REQUESTS);
+    counting = false;
+    unsigned long n = allocations;
+    printf("%-36s %lu allocations in %d requests\n", name, n, TEST_REQUESTS);
+    return n == 0;
+}
+
+// waits until done reaches n, the completions running on the link's threads
+static void waitFor(std::atomic<int> &done, int n)
+{
+    while (done < n)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+}
+
+int main()
+{
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0)
+    {
+        perror("socketpair");
+        return 1;
+    }
+
+    bool ok = true;
+    {
+        DeviceEmulator device(fds[1]);
+        SerialLink link(new SerialCommunication(fds[0]));
+
+        ok &= measure("syncRequest()", [&link](int n) {
+            for (int i = 0; i < n; i++)
+                link.syncRequest((uchar)TEST_DEVICE_ID, (uchar)i);
+        });
+
+        ok &= measure("asyncRequest()", [&link, &device](int n) {
+            unsigned long before = device.receivedFrames();
+            for (int i = 0; i < n; i++)
+                link.asyncRequest((uchar)TEST_DEVICE_ID, (uchar)i);
+            while (device.receivedFrames() < before + n)
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        });
+
+        ok &= measure("asyncRequestWithAck(), callback", [&link](int n) {
+            std::atomic<int> done(0);
+            uchar params[2] = {1, 2};
+            for (int i = 0; i < n; i++)
+                link.asyncRequestWithAck(TEST_DEVICE_ID, params, sizeof(params), [&done](bool) { done++; });
+            waitFor(done, n);
+        });
+    }
+    close(fds[0]);
+    close(fds[1]);
+
+    // the copies post() queues, written by the scheduler thread
+    TxScheduler scheduler;
+    std::atomic<int> written(0);
+    scheduler.start([&written](TxFrame *) { written++; });
+    ok &= measure("TxScheduler::post()", [&scheduler, &written](int n) {
+        uchar payload[8] = {1, PROTOCOL_FRAME_TYPE_DATA, TEST_DEVICE_ID};
+        int before = written;
+        for (int i = 0; i < n; i++)
+            while (!scheduler.post(payload, sizeof(payload), i % TX_CLASS_COUNT))
+                std::this_thread::yield();
+        waitFor(written, before + n);
+    });
+    scheduler.stop();
+
+    printf(ok ? "OK\n" : "FAILED: requests allocated\n");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,174 @@
+#include "device_emulator.h"
+
+#include <stdlib.h>
+#include <termios.h>
+
+DeviceEmulator::DeviceEmulator(int fd) : comm(fd)
+{
+    run = true;
+    responseDelay_us = 0;
+    framesReceived = 0;
+    messagesReceived = 0;
+    publisherCount = 0;
+    message = new uint8_t[EMULATOR_MESSAGE_SIZE];
+    comm.initialize();
+    comm.setMessageBuffer(message, EMULATOR_MESSAGE_SIZE);
+    thread = new std::thread(&DeviceEmulator::loop, this);
+}
+
+DeviceEmulator::~DeviceEmulator()
+{
+    run = false;
+    thread->join();
+    delete thread;
+    delete[] message;
+}
+
+void DeviceEmulator::setResponder(uchar deviceId, EmulatorResponder responder)
+{
+    std::lock_guard<std::mutex> guard(respondersMtx);
+    responders[deviceId] = responder;
+}
+
+void DeviceEmulator::setPublisher(uchar deviceId, EmulatorPublisher publisher)
+{
+    std::lock_guard<std::mutex> guard(respondersMtx);
+    if (!publishers[deviceId] && publisher)
+        publisherCount++;
+    else if (publishers[deviceId] && !publisher)
+        publisherCount--;
+    publishers[deviceId] = publisher;
+}
+
+void DeviceEmulator::setResponseDelay(unsigned int delay_us)
+{
+    responseDelay_us = delay_us;
+}
+
+unsigned long DeviceEmulator::receivedFrames()
+{
+    return framesReceived;
+}
+
+unsigned long DeviceEmulator::receivedMessages()
+{
+    return messagesReceived;
+}
+
+void DeviceEmulator::reply(HostBusCommunication &comm, uchar deviceId, const uchar *data, int size)
+{
+    comm.write(deviceId);
+    for (int i = 0; i < size; i++)
+        comm.write(data[i]);
+    comm.sendData(1, PROTOCOL_FRAME_TYPE_DATA);
+}
+
+void DeviceEmulator::replyMessage(HostBusCommunication &comm, uchar deviceId, const uchar *data, uint32_t size)
+{
+    comm.sendMessage(deviceId, data, size);
+}
+
+void DeviceEmulator::handle()
+{
+    framesReceived++;
+    uchar deviceId = comm.read(2);
+
+    if (responseDelay_us > 0)
+        std::this_thread::sleep_for(std::chrono::microseconds(responseDelay_us));
+    comm.ack();
+
+    EmulatorResponder responder;
+    {
+        std::lock_guard<std::mutex> guard(respondersMtx);
+        responder = responders[deviceId];
+    }
+    if (responder)
+        responder(comm, deviceId);
+
+    // moves to the next entry of a DATA_LIST frame, if any
+    comm.clearReceiveBuffer();
+}
+
+// the samples due in this round go out together, in one DATA_LIST frame
+void DeviceEmulator::publish()
+{
+    for (int i = 0; i < EMULATOR_DEVICE_COUNT; i++)
+    {
+        if (!comm.subscriptionDue(i))
+            continue;
+        EmulatorPublisher publisher;
+        {
+            std::lock_guard<std::mutex> guard(respondersMtx);
+            publisher = publishers[i];
+        }
+        if (publisher)
+            publisher(comm, i);
+    }
+    comm.flushPublished();
+}
+
+void DeviceEmulator::loop()
+{
+    struct pollfd pfd;
+    pfd.fd = comm.fileDescriptor();
+    pfd.events = POLLIN;
+
+    while (run)
+    {
+        pfd.revents = 0;
+        bool publishing = publisherCount > 0;
+        int ready = poll(&pfd, 1, publishing ? EMULATOR_PUBLISH_TICK_ms : EMULATOR_POLL_TIMEOUT_ms);
+        if (publishing)
+            publish();
+        if (ready <= 0)
+            continue;
+        if (!(pfd.revents & POLLIN))
+        {
+            // the PC side closed its end
+            std::this_thread::sleep_for(std::chrono::milliseconds(EMULATOR_POLL_TIMEOUT_ms));
+            continue;
+        }
+
+        comm.receiveData();
+        while (comm.hasData())
+        {
+            handle();
+            if (!comm.hasData())
+                comm.receiveData();
+        }
+        if (comm.hasMessage())
+        {
+            messagesReceived++;
+            comm.clearMessage();
+        }
+    }
+}
+
+int DeviceEmulator::openPty(std::string &path)
+{
+    int master = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+    if (master < 0)
+        return -1;
+    if (grantpt(master) < 0 || unlockpt(master) < 0)
+    {
+        close(master);
+        return -1;
+    }
+
+    char name[128];
+    if (ptsname_r(master, name, sizeof(name)) != 0)
+    {
+        close(master);
+        return -1;
+    }
+    path = name;
+
+    // the master sees the bytes as they are, without line discipline
+    struct termios tio;
+    if (tcgetattr(master, &tio) == 0)
+    {
+        cfmakeraw(&tio);
+        tcsetattr(master, TCSANOW, &tio);
+    }
+    return master;
+}
@@ -0,0 +1,76 @@
+#ifndef _DEVICE_EMULATOR_H
+#define _DEVICE_EMULATOR_H
+
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <functional>
+#include <string>
+
+#include "host_bus_comm.h"
+
+#define EMULATOR_DEVICE_COUNT 256
+#define EMULATOR_POLL_TIMEOUT_ms 10
+// how often publishers are checked for due samples
+#define EMULATOR_PUBLISH_TICK_ms 1
+// largest message SerialLink::sendMessage() can send the emulator
+#define EMULATOR_MESSAGE_SIZE 65536
+
+// called for every request to a deviceId, after the request was acked. It reads
+// the request with comm.read(3..) and may answer with DeviceEmulator::reply().
+typedef std::function<void(HostBusCommunication &comm, uchar deviceId)> EmulatorResponder;
+
+// called whenever a sample of a deviceId the PC subscribed to is due, it
+// queues it with comm.publish(deviceId, ...)
+typedef std::function<void(HostBusCommunication &comm, uchar deviceId)> EmulatorPublisher;
+
+// The device half of the protocol running on the host: a thread receiving
+// requests through the real AsyncCommunication code, acking them and calling
+// the responder registered for their deviceId. Connect a SerialLink to it with
+// openPty() (SerialLink(path)) or socketpair() (SerialCommunication(fd)).
+class DeviceEmulator
+{
+private:
+    HostBusCommunication comm;
+    std::thread *thread;
+    std::atomic<bool> run;
+    std::mutex respondersMtx;
+    EmulatorResponder responders[EMULATOR_DEVICE_COUNT];
+    EmulatorPublisher publishers[EMULATOR_DEVICE_COUNT];
+    std::atomic<unsigned int> publisherCount;
+    std::atomic<unsigned int> responseDelay_us;
+    std::atomic<unsigned long> framesReceived;
+    std::atomic<unsigned long> messagesReceived;
+    uint8_t *message;
+
+    void loop();
+    void handle();
+    void publish();
+
+public:
+    // serves the fd, which stays owned by the caller
+    DeviceEmulator(int fd);
+    ~DeviceEmulator();
+
+    void setResponder(uchar deviceId, EmulatorResponder responder);
+    // serves SerialLink::subscribe() for deviceId
+    void setPublisher(uchar deviceId, EmulatorPublisher publisher);
+
+    // simulated processing time between receiving a request and acking it
+    void setResponseDelay(unsigned int delay_us);
+
+    unsigned long receivedFrames();
+    // complete messages sent with SerialLink::sendMessage(), they are acked and dropped
+    unsigned long receivedMessages();
+
+    // sends an unsolicited DATA frame [deviceId, data...] from the device
+    static void reply(HostBusCommunication &comm, uchar deviceId, const uchar *data, int size);
+    // sends size bytes as one fragmented message, see AsyncCommunication::sendMessage()
+    static void replyMessage(HostBusCommunication &comm, uchar deviceId, const uchar *data, uint32_t size);
+
+    // opens a pty pair: returns the master fd for the emulator and sets path to
+    // the slave device the PC side opens. Returns -1 on failure.
+    static int openPty(std::string &path);
+};
+
+#endif
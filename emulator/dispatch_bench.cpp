@@ -0,0 +1,117 @@
+// Cost of handing a received frame to its handlers with 1, 10 and 256 devices
+// registered: HandlerRegistry::dispatch() (one indexed load, the handlers of a
+// device stored inline in one allocation, a store to the thread's own reader
+// epoch) against the std::map of heap allocated handler vectors SerialLink
+// searched before. Frames go to the registered devices in a shuffled order,
+// each device has one handler that only counts. Build on the host with:
+//   g++ -O2 -std=c++17 -o dispatch_bench dispatch_bench.cpp -lpthread
+
+#include <stdio.h>
+#include <map>
+#include <vector>
+#include <random>
+#include <algorithm>
+#include <chrono>
+
+#include "../pc/serial_comm_pi.h"
+#include "../pc/handler_registry.h"
+
+#define BENCH_FRAMES 10000000
+#define BENCH_ORDER_SIZE 4096
+
+// the lookup SerialLink::executeCallbackForMessageData() used to do
+class MapDispatch
+{
+private:
+    std::map<uchar, std::vector<SerialLinkResponseCallback *> *> handlers;
+
+public:
+    ~MapDispatch()
+    {
+        for (auto &it : handlers)
+        {
+            for (auto rc : *it.second)
+                delete rc;
+            delete it.second;
+        }
+    }
+
+    void add(uchar deviceId, uchar handlerId, std::function<void(ResponseData *)> &func)
+    {
+        if (handlers.find(deviceId) == handlers.end())
+            handlers[deviceId] = new std::vector<SerialLinkResponseCallback *>();
+        SerialLinkResponseCallback *rc = new SerialLinkResponseCallback();
+        rc->id = handlerId;
+        rc->callback = func;
+        handlers[deviceId]->push_back(rc);
+    }
+
+    void dispatch(ResponseData *msg)
+    {
+        auto it = handlers.find(msg->deviceId);
+        if (it == handlers.end())
+            return;
+        for (auto rc : *it->second)
+            rc->callback(msg);
+    }
+};
+
+// deviceIds spread over the whole range, like boards numbered by function
+static std::vector<uchar> deviceIds(int devices)
+{
+    std::vector<uchar> ids;
+    for (int i = 0; i < devices; i++)
+        ids.push_back(devices == HANDLER_TABLE_SIZE ? i : (i * 37 + 11) % HANDLER_TABLE_SIZE);
+    return ids;
+}
+
+template <typename Dispatch>
+static double run(Dispatch &d, const std::vector<uchar> &order)
+{
+    ResponseData msg;
+    char data[8] = {};
+    msg.data = data;
+    msg.size = sizeof(data);
+    msg.frameId = 1;
+    msg.frameType = PROTOCOL_FRAME_TYPE_DATA;
+
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < BENCH_FRAMES; i++)
+    {
+        msg.deviceId = order[i & (BENCH_ORDER_SIZE - 1)];
+        d.dispatch(&msg);
+    }
+    return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / BENCH_FRAMES;
+}
+
+static void bench(int devices)
+{
+    std::vector<uchar> ids = deviceIds(devices);
+    std::vector<uchar> order(BENCH_ORDER_SIZE);
+    std::mt19937 rng(devices);
+    for (auto &id : order)
+        id = ids[rng() % ids.size()];
+
+    unsigned long handled = 0;
+    std::function<void(ResponseData *)> handler = [&handled](ResponseData *) { handled++; };
+    HandlerRegistry registry;
+    MapDispatch map;
+    for (uchar id : ids)
+    {
+        registry.add(id, 1, handler);
+        map.add(id, 1, handler);
+    }
+
+    double table_ns = run(registry, order);
+    double map_ns = run(map, order);
+    printf("%3d devices: HandlerRegistry %5.1f ns/frame, std::map %5.1f ns/frame, %lu frames handled\n", devices, table_ns, map_ns,
+           handled);
+}
+
+int main()
+{
+    bench(1);
+    bench(10);
+    bench(HANDLER_TABLE_SIZE);
+    return 0;
+}
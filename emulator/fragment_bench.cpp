@@ -0,0 +1,129 @@
+// Throughput of fragmented messages (SerialLink::sendMessage() and
+// AsyncCommunication::sendMessage()) between SerialLink and the device
+// emulator, no hardware needed. Build on the host with:
+//   g++ -O2 -std=c++17 -I../arduino -I. -I../pc -o fragment_bench fragment_bench.cpp device_emulator.cpp ../pc/*.cpp -lpthread
+
+#include <stdio.h>
+#include <sys/socket.h>
+#include <vector>
+#include <future>
+
+#include "device_emulator.h"
+#include "../pc/serial_link.h"
+
+#define BENCH_DEVICE_ID 8
+#define BENCH_MESSAGES 5
+
+typedef MessageSchema<uint32_t> MessageRequest;
+
+static const unsigned int benchSizes[] = {1024, 4096, 16384, 65536};
+
+static std::vector<uchar> pattern(unsigned int size)
+{
+    std::vector<uchar> data(size);
+    for (unsigned int i = 0; i < size; i++)
+        data[i] = (i * 7 + i / 251) & 0xff;
+    return data;
+}
+
+static double elapsed_s(std::chrono::steady_clock::time_point since)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - since).count();
+}
+
+static void benchToDevice(SerialLink &link, DeviceEmulator &device)
+{
+    for (unsigned int size : benchSizes)
+    {
+        std::vector<uchar> data = pattern(size);
+        unsigned long before = device.receivedMessages();
+        int acked = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < BENCH_MESSAGES; i++)
+            acked += link.sendMessage(BENCH_DEVICE_ID, data.data(), size);
+        double s = elapsed_s(start);
+        // the emulator acks a message before counting it
+        for (int i = 0; i < 100 && device.receivedMessages() - before < (unsigned long)acked; i++)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        printf("PC -> device %6u bytes: %d/%d acked, %lu received, %8.1f KB/s\n", size, acked, BENCH_MESSAGES,
+               device.receivedMessages() - before, BENCH_MESSAGES * size / 1024.0 / s);
+    }
+}
+
+static void benchFromDevice(SerialLink &link)
+{
+    std::mutex mtx;
+    std::promise<bool> *received = nullptr;
+    unsigned int expected = 0;
+
+    std::function<void(ResponseData *)> handler = [&](ResponseData *msg) {
+        if (msg->frameType != PROTOCOL_FRAME_TYPE_FRAGMENT)
+            return;
+        std::vector<uchar> data = pattern(expected);
+        bool ok = msg->size == expected && memcmp(msg->data, data.data(), expected) == 0;
+        // the waiting side may return as soon as the value is set: touch nothing after
+        std::promise<bool> *promise;
+        {
+            std::lock_guard<std::mutex> guard(mtx);
+            promise = received;
+            received = nullptr;
+        }
+        if (promise != nullptr)
+            promise->set_value(ok);
+    };
+    link.addHandler(BENCH_DEVICE_ID, 1, handler);
+
+    for (unsigned int size : benchSizes)
+    {
+        int intact = 0;
+        expected = size;
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < BENCH_MESSAGES; i++)
+        {
+            std::promise<bool> promise;
+            std::future<bool> result = promise.get_future();
+            {
+                std::lock_guard<std::mutex> guard(mtx);
+                received = &promise;
+            }
+            link.syncRequest<MessageRequest>(BENCH_DEVICE_ID, size);
+            if (result.wait_for(std::chrono::seconds(5)) == std::future_status::ready)
+                intact += result.get();
+            else
+            {
+                std::lock_guard<std::mutex> guard(mtx);
+                received = nullptr;
+            }
+        }
+        double s = elapsed_s(start);
+        printf("device -> PC %6u bytes: %d/%d intact, %8.1f KB/s\n", size, intact, BENCH_MESSAGES, BENCH_MESSAGES * size / 1024.0 / s);
+    }
+    link.removeHandler(BENCH_DEVICE_ID, 1);
+}
+
+int main()
+{
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0)
+    {
+        perror("socketpair");
+        return 1;
+    }
+
+    std::vector<uchar> payload = pattern(EMULATOR_MESSAGE_SIZE);
+    {
+        DeviceEmulator device(fds[1]);
+        device.setResponder(BENCH_DEVICE_ID, [&payload](HostBusCommunication &comm, uchar deviceId) {
+            uint32_t size = 0;
+            if (comm.readMessage<MessageRequest>(3, size) && size <= payload.size())
+                DeviceEmulator::replyMessage(comm, deviceId, payload.data(), size);
+        });
+
+        SerialLink link(new SerialCommunication(fds[0]));
+        benchToDevice(link, device);
+        benchFromDevice(link);
+        printf("%s", link.dumpMetrics("link").c_str());
+    }
+    close(fds[1]);
+    return 0;
+}
@@ -0,0 +1,240 @@
+// Property test of FrameParser (arduino/frame_parser.h): random frame bodies,
+// biased towards MSG_START/MSG_END/MSG_ESC bytes, are encoded with
+// frameEncode() with their CRC and mixed with line noise, truncated and
+// oversized frames and frames with a wrong CRC. The stream is cut at random
+// points and fed to the parser chunk by chunk, and through SerialCommunication
+// over a socketpair one write() per chunk. Every intact frame must come out
+// once, in order and byte for byte, and nothing else.
+// Exits non zero on the first failure. Build on the host with:
+//   g++ -O2 -std=c++17 -I../arduino -I. -I../pc -o frame_parser_test frame_parser_test.cpp device_emulator.cpp ../pc/*.cpp -lpthread
+// and run with an optional seed: ./frame_parser_test [seed]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <vector>
+#include <random>
+
+#include "../pc/serial_comm_pi.h"
+
+#define TEST_ROUNDS 100
+#define TEST_FRAMES_PER_ROUND 200
+#define TEST_MAX_CHUNK 64
+
+typedef std::vector<uint8_t> Bytes;
+
+struct Stream
+{
+    Bytes wire;
+    // bodies of the frames that must come out
+    std::vector<Bytes> expected;
+    unsigned int oversized = 0;
+    unsigned int damaged = 0;
+};
+
+static uint8_t randomByte(std::mt19937 &rng)
+{
+    // one byte in four is a delimiter, so escapes show up everywhere
+    static const uint8_t delimiters[] = {MSG_START, MSG_END, MSG_ESC};
+    if (rng() % 4 == 0)
+        return delimiters[rng() % 3];
+    return rng();
+}
+
+static void appendFrame(Stream &s, const Bytes &body, uint16_t crcError = 0)
+{
+    uint8_t wire[FRAME_ENCODED_MAX_SIZE(RCV_BUFFER_SIZE * 2)];
+    uint16_t crc = Crc16Slice::compute(body.data(), body.size()) ^ crcError;
+    unsigned int n = frameEncode(body.data(), body.size(), crc, wire);
+    s.wire.insert(s.wire.end(), wire, wire + n);
+}
+
+static Stream makeStream(std::mt19937 &rng)
+{
+    Stream s;
+    bool cut = false;
+    for (int f = 0; f < TEST_FRAMES_PER_ROUND; f++)
+    {
+        // noise between frames: anything but MSG_START is skipped while waiting
+        // for one. Not after a cut frame, the parser is still inside that one.
+        for (unsigned int i = cut ? 0 : rng() % 4; i > 0; i--)
+        {
+            uint8_t ch = randomByte(rng);
+            if (ch != MSG_START)
+                s.wire.push_back(ch);
+        }
+
+        unsigned int kind = rng() % 10;
+        Bytes body;
+        cut = kind == 0;
+        if (kind == 0)
+        {
+            // cut short before its MSG_END, the next frame's MSG_START discards it
+            body.resize(1 + rng() % RCV_BUFFER_SIZE);
+            for (auto &b : body)
+                b = randomByte(rng);
+            appendFrame(s, body);
+            s.wire.resize(s.wire.size() - 1 - rng() % 2);
+            continue;
+        }
+        if (kind == 1)
+        {
+            // doesn't fit the receive buffer
+            body.resize(RCV_BUFFER_SIZE + 1 + rng() % RCV_BUFFER_SIZE);
+            for (auto &b : body)
+                b = randomByte(rng);
+            appendFrame(s, body);
+            s.oversized++;
+            continue;
+        }
+        if (kind == 2)
+        {
+            // damaged on the way, the CRC doesn't match
+            body.resize(1 + rng() % RCV_BUFFER_SIZE);
+            for (auto &b : body)
+                b = randomByte(rng);
+            appendFrame(s, body, 1 + rng() % 0xffff);
+            s.damaged++;
+            continue;
+        }
+
+        body.resize(1 + rng() % RCV_BUFFER_SIZE);
+        for (auto &b : body)
+            b = randomByte(rng);
+        appendFrame(s, body);
+        s.expected.push_back(body);
+    }
+    return s;
+}
+
+static std::vector<unsigned int> randomCuts(std::mt19937 &rng, unsigned int size)
+{
+    std::vector<unsigned int> chunks;
+    while (size > 0)
+    {
+        unsigned int n = 1 + rng() % TEST_MAX_CHUNK;
+        if (n > size)
+            n = size;
+        chunks.push_back(n);
+        size -= n;
+    }
+    return chunks;
+}
+
+static bool check(const char *what, unsigned int seed, const std::vector<Bytes> &expected, const std::vector<Bytes> &received)
+{
+    for (size_t i = 0; i < expected.size() && i < received.size(); i++)
+    {
+        if (received[i] != expected[i])
+        {
+            printf("%s, seed %u: frame %zu differs (%zu bytes, expected %zu)\n", what, seed, i, received[i].size(), expected[i].size());
+            return false;
+        }
+    }
+    if (received.size() != expected.size())
+    {
+        printf("%s, seed %u: %zu frames received, expected %zu\n", what, seed, received.size(), expected.size());
+        return false;
+    }
+    return true;
+}
+
+static bool parseChunks(unsigned int seed, const Stream &s, const std::vector<unsigned int> &chunks)
+{
+    uint8_t buffer[RCV_BUFFER_SIZE + FRAME_CRC_SIZE];
+    FrameParser parser(buffer, sizeof(buffer));
+    std::vector<Bytes> received;
+    unsigned int invalid = 0;
+    unsigned int damaged = 0;
+    unsigned int at = 0;
+    for (unsigned int n : chunks)
+    {
+        for (unsigned int end = at + n; at < end; at++)
+        {
+            uint8_t r = parser.push(s.wire[at]);
+            if (r == FRAME_PARSER_INVALID)
+                invalid++;
+            if (r != FRAME_PARSER_COMPLETE)
+                continue;
+            unsigned int size = parser.frameSize();
+            if (size <= FRAME_CRC_SIZE)
+            {
+                damaged++;
+                continue;
+            }
+            size -= FRAME_CRC_SIZE;
+            uint16_t crc = Crc16Slice::compute(buffer, size);
+            if (buffer[size] != (crc & 0xff) || buffer[size + 1] != (crc >> 8))
+                damaged++;
+            else
+                received.push_back(Bytes(buffer, buffer + size));
+        }
+    }
+    if (invalid != s.oversized)
+    {
+        printf("FrameParser, seed %u: %u frames reported invalid, expected %u\n", seed, invalid, s.oversized);
+        return false;
+    }
+    if (damaged != s.damaged)
+    {
+        printf("FrameParser, seed %u: %u frames failed their CRC, expected %u\n", seed, damaged, s.damaged);
+        return false;
+    }
+    return check("FrameParser", seed, s.expected, received);
+}
+
+static void takeFrames(SerialCommunication &comm, std::vector<Bytes> &received)
+{
+    while (comm.receiveData())
+    {
+        char *body = comm.copy();
+        received.push_back(Bytes(body, body + comm.receivedDataSize()));
+        free(body);
+        comm.clearRcv();
+    }
+}
+
+static bool receiveChunks(unsigned int seed, const Stream &s, const std::vector<unsigned int> &chunks)
+{
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0)
+    {
+        perror("socketpair");
+        return false;
+    }
+    SerialCommunication comm(fds[0]);
+    std::vector<Bytes> received;
+    unsigned int at = 0;
+    for (unsigned int n : chunks)
+    {
+        if (::write(fds[1], &s.wire[at], n) != (ssize_t)n)
+        {
+            perror("write");
+            break;
+        }
+        at += n;
+        // one read() gets the chunk, frames it completes come out, the rest waits
+        takeFrames(comm, received);
+    }
+    close(fds[1]);
+    return check("SerialCommunication", seed, s.expected, received);
+}
+
+int main(int argc, char **argv)
+{
+    unsigned int seed = argc > 1 ? strtoul(argv[1], nullptr, 0) : std::random_device()();
+    printf("seed %u\n", seed);
+
+    unsigned long frames = 0;
+    for (int round = 0; round < TEST_ROUNDS; round++)
+    {
+        std::mt19937 rng(seed + round);
+        Stream s = makeStream(rng);
+        std::vector<unsigned int> chunks = randomCuts(rng, s.wire.size());
+        if (!parseChunks(seed + round, s, chunks) || !receiveChunks(seed + round, s, chunks))
+            return 1;
+        frames += s.expected.size();
+    }
+    printf("OK: %lu frames in %d randomly cut streams\n", frames, TEST_ROUNDS);
+    return 0;
+}
@@ -0,0 +1,93 @@
+// Frames per second SerialCommunication::receiveData() takes off a pty while
+// the device side writes DATA frames as fast as the pty accepts them, for a
+// few frame sizes. Every frame is CRC checked and counted, the receive loop
+// waits in poll() when the ring runs dry like SerialLink does. No hardware
+// needed, the pty stands in for the board. Build on the host with:
+//   g++ -O2 -std=c++17 -I../arduino -I. -I../pc -o frame_rate_bench frame_rate_bench.cpp device_emulator.cpp ../pc/*.cpp -lpthread
+
+#include <stdio.h>
+#include <vector>
+#include <string>
+
+#include "device_emulator.h"
+#include "../pc/serial_comm_pi.h"
+
+#define BENCH_FRAMES 100000
+// frames written per write() call
+#define BENCH_BATCH 16
+
+// [frameId, DATA, deviceId, params...] followed by its CRC
+static void writeFrames(int fd, unsigned int size)
+{
+    std::vector<uint8_t> body(size);
+    std::vector<uint8_t> wire(FRAME_ENCODED_MAX_SIZE(size) * BENCH_BATCH);
+    for (int f = 0; f < BENCH_FRAMES; f += BENCH_BATCH)
+    {
+        unsigned int n = 0;
+        for (int b = 0; b < BENCH_BATCH; b++)
+        {
+            body[0] = (f + b) % 255 + 1;
+            body[1] = PROTOCOL_FRAME_TYPE_DATA;
+            body[2] = 7;
+            for (unsigned int i = 3; i < size; i++)
+                body[i] = f + b + i;
+            n += frameEncode(body.data(), size, Crc16Slice::compute(body.data(), size), &wire[n]);
+        }
+        for (unsigned int sent = 0; sent < n;)
+        {
+            ssize_t w = ::write(fd, &wire[sent], n - sent);
+            if (w <= 0)
+                return;
+            sent += w;
+        }
+    }
+}
+
+static void run(unsigned int size)
+{
+    std::string path;
+    int master = DeviceEmulator::openPty(path);
+    if (master < 0)
+    {
+        perror("openpty");
+        return;
+    }
+    SerialCommunication comm(path.c_str());
+
+    auto start = std::chrono::steady_clock::now();
+    std::thread writer(writeFrames, master, size);
+
+    int frames = 0;
+    unsigned long bytes = 0;
+    auto last = start;
+    struct pollfd pfd = {comm.fileDescriptor(), POLLIN, 0};
+    while (frames < BENCH_FRAMES)
+    {
+        if (comm.receiveData())
+        {
+            frames++;
+            bytes += comm.receivedDataSize();
+            comm.clearRcv();
+            last = std::chrono::steady_clock::now();
+            continue;
+        }
+        // the writer is done when nothing comes for a while, frames that were
+        // lost on the way are not waited for
+        if (poll(&pfd, 1, 1000) <= 0)
+            break;
+    }
+    double s = std::chrono::duration<double>(last - start).count();
+    writer.join();
+    close(master);
+
+    printf("%3u byte frames: %d/%d received in %.3f s, %8.0f frames/s, %6.2f MB/s of payload\n", size, frames, BENCH_FRAMES, s,
+           frames / s, bytes / s / 1e6);
+}
+
+int main()
+{
+    run(8);
+    run(30);
+    run(64);
+    return 0;
+}
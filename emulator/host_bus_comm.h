@@ -0,0 +1,113 @@
+#ifndef _HOST_BUS_COMMUNICATION_H
+#define _HOST_BUS_COMMUNICATION_H
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <chrono>
+
+#include "protocol.h"
+#include "../arduino/async_comm.h"
+
+#define HOST_BUS_BUFFER_SIZE 256
+
+// AsyncCommunication over a host fd (a pty master or one end of a socketpair),
+// so the Arduino protocol code runs unchanged on Linux. Reads are buffered and
+// never block, writes are collected and go out with a single write() on busFlush().
+class HostBusCommunication : public AsyncCommunication
+{
+private:
+    int fd;
+    char rxBuffer[HOST_BUS_BUFFER_SIZE];
+    unsigned int rxHead;
+    unsigned int rxSize;
+    char txBuffer[HOST_BUS_BUFFER_SIZE];
+    unsigned int txSize;
+
+    void fill()
+    {
+        ssize_t n = ::read(fd, rxBuffer, sizeof(rxBuffer));
+        rxHead = 0;
+        rxSize = n > 0 ? n : 0;
+    }
+
+protected:
+    void busInitialize() override
+    {
+        int flags = fcntl(fd, F_GETFL);
+        if (flags != -1)
+            fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+        rxHead = rxSize = txSize = 0;
+    }
+    unsigned int busBufferAvailableRead() override
+    {
+        if (rxHead == rxSize)
+            fill();
+        return rxSize - rxHead;
+    }
+    char busRead() override
+    {
+        if (rxHead == rxSize)
+            fill();
+        return rxHead < rxSize ? rxBuffer[rxHead++] : 0;
+    }
+    void busWrite(char val) override
+    {
+        if (txSize == sizeof(txBuffer))
+            busFlush();
+        txBuffer[txSize++] = val;
+    }
+    unsigned int busBufferAvailableWrite() override
+    {
+        return sizeof(txBuffer);
+    }
+    void busFlush() override
+    {
+        unsigned int sent = 0;
+        while (sent < txSize)
+        {
+            ssize_t n = ::write(fd, txBuffer + sent, txSize - sent);
+            if (n > 0)
+            {
+                sent += n;
+                continue;
+            }
+            if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            {
+                fprintf(stderr, "host bus: write failed: %s\n", strerror(errno));
+                break;
+            }
+            struct pollfd pfd;
+            pfd.fd = fd;
+            pfd.events = POLLOUT;
+            pfd.revents = 0;
+            poll(&pfd, 1, 100);
+        }
+        txSize = 0;
+    }
+    bool busReady() override
+    {
+        return fd >= 0;
+    }
+    unsigned long busMillis() override
+    {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+public:
+    HostBusCommunication(int fd)
+    {
+        this->fd = fd;
+        rxHead = rxSize = txSize = 0;
+    }
+
+    int fileDescriptor()
+    {
+        return fd;
+    }
+};
+
+#endif
@@ -0,0 +1,104 @@
+// End-to-end latency and throughput of SerialLink against the device emulator,
+// no hardware needed. Build on the host with:
+//   g++ -O2 -std=c++17 -I../arduino -I. -I../pc -o link_bench link_bench.cpp device_emulator.cpp ../pc/*.cpp -lpthread
+
+#include <stdio.h>
+#include <sys/socket.h>
+#include <vector>
+#include <deque>
+#include <algorithm>
+#include <future>
+
+#include "device_emulator.h"
+#include "../pc/serial_link.h"
+
+#define BENCH_DEVICE_ID 7
+#define BENCH_SYNC_REQUESTS 2000
+#define BENCH_ASYNC_REQUESTS 20000
+// asyncRequestWithAck() requests outstanding at a time. The frame gap caps an
+// unbatched link at 500 frames/s, a deeper queue would time out in the backlog.
+#define BENCH_QUEUED_REQUESTS 64
+
+static double elapsed_us(std::chrono::steady_clock::time_point since)
+{
+    return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - since).count();
+}
+
+static void benchSync(const char *name, SerialLink &link)
+{
+    std::vector<double> latency;
+    int acked = 0;
+    for (int i = 0; i < BENCH_SYNC_REQUESTS; i++)
+    {
+        auto start = std::chrono::steady_clock::now();
+        acked += link.syncRequest((uchar)BENCH_DEVICE_ID, (uchar)i);
+        latency.push_back(elapsed_us(start));
+    }
+    std::sort(latency.begin(), latency.end());
+    printf("%-12s syncRequest: %d/%d acked, p50 %.0f us, p99 %.0f us, max %.0f us\n", name, acked, BENCH_SYNC_REQUESTS,
+           latency[latency.size() / 2], latency[latency.size() * 99 / 100], latency.back());
+}
+
+static void benchAsync(const char *name, SerialLink &link)
+{
+    std::deque<std::future<bool>> results;
+    uchar params[4] = {1, 2, 3, 4};
+    int acked = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < BENCH_ASYNC_REQUESTS; i++)
+    {
+        if (results.size() == BENCH_QUEUED_REQUESTS)
+        {
+            acked += results.front().get();
+            results.pop_front();
+        }
+        results.push_back(link.asyncRequestWithAck(BENCH_DEVICE_ID, params, sizeof(params)));
+    }
+    for (auto &r : results)
+        acked += r.get();
+    double us = elapsed_us(start);
+    printf("%-12s asyncRequestWithAck: %d/%d acked, %.0f requests/s\n", name, acked, BENCH_ASYNC_REQUESTS, BENCH_ASYNC_REQUESTS * 1e6 / us);
+}
+
+static void run(const char *name, SerialLink &link)
+{
+    benchSync(name, link);
+    benchAsync(name, link);
+    link.setTxBatching(1);
+    benchAsync("  batched", link);
+    link.setTxBatching(0);
+    printf("%s", link.dumpMetrics("link").c_str());
+}
+
+int main()
+{
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0)
+    {
+        perror("socketpair");
+        return 1;
+    }
+    {
+        DeviceEmulator device(fds[1]);
+        SerialLink link(new SerialCommunication(fds[0]));
+        link.setAckWindowSize(32);
+        run("socketpair", link);
+    }
+    close(fds[1]);
+
+    std::string path;
+    int master = DeviceEmulator::openPty(path);
+    if (master < 0)
+    {
+        perror("openpty");
+        return 1;
+    }
+    {
+        DeviceEmulator device(master);
+        SerialLink link(path.c_str());
+        link.setAckWindowSize(32);
+        run("pty", link);
+    }
+    close(master);
+    return 0;
+}
@@ -0,0 +1,18 @@
+#ifndef _EMULATOR_PROTOCOL_H
+#define _EMULATOR_PROTOCOL_H
+
+// stands in for the sketch's protocol.h when the arduino/ headers are built on
+// the host. Put emulator/ on the include path, after arduino/.
+
+#include "../pc/comm_types.h"
+
+#define MSG_ACK 1
+#define MSG_ERR 2
+
+#define PROTOCOL_FRAME_TYPE_DATA 1
+#define PROTOCOL_FRAME_TYPE_ACK 2
+#define PROTOCOL_FRAME_TYPE_DATA_LIST 3
+#define PROTOCOL_FRAME_TYPE_FRAGMENT 4
+#define PROTOCOL_FRAME_TYPE_SUBSCRIBE 5
+
+#endif
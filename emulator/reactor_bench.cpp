@@ -0,0 +1,107 @@
+// SerialLinks served by one SerialReactor, each talking to its own device
+// emulator: the threads the links add as boards are connected, and how the
+// acked request rate and the syncRequest() latency of one board hold up while
+// every other board is busy. No hardware needed. Build on the host with:
+//   g++ -O2 -std=c++17 -I../arduino -I. -I../pc -o reactor_bench reactor_bench.cpp device_emulator.cpp ../pc/*.cpp -lpthread
+
+#include <stdio.h>
+#include <sys/socket.h>
+#include <dirent.h>
+#include <vector>
+#include <deque>
+#include <algorithm>
+
+#include "device_emulator.h"
+#include "../pc/serial_link.h"
+
+#define BENCH_DEVICE_ID 7
+#define BENCH_ASYNC_REQUESTS 400
+#define BENCH_SYNC_REQUESTS 100
+
+static int threadCount()
+{
+    DIR *d = opendir("/proc/self/task");
+    if (d == nullptr)
+        return -1;
+    int n = 0;
+    while (struct dirent *e = readdir(d))
+        if (e->d_name[0] != '.')
+            n++;
+    closedir(d);
+    return n;
+}
+
+static void run(SerialReactor &reactor, int boards)
+{
+    std::vector<int> fds;
+    std::vector<DeviceEmulator *> devices;
+    for (int i = 0; i < boards; i++)
+    {
+        int pair[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) < 0)
+        {
+            perror("socketpair");
+            return;
+        }
+        fds.push_back(pair[0]);
+        fds.push_back(pair[1]);
+        devices.push_back(new DeviceEmulator(pair[1]));
+    }
+
+    int before = threadCount();
+    std::deque<SerialLink> links;
+    for (int i = 0; i < boards; i++)
+        links.emplace_back(new SerialCommunication(fds[2 * i]), &reactor);
+    int added = threadCount() - before;
+
+    // every board but the first kept busy with acked requests
+    std::atomic<unsigned long> acked(0);
+    std::vector<std::thread> senders;
+    for (int i = 1; i < boards; i++)
+    {
+        SerialLink *link = &links[i];
+        senders.emplace_back([link, &acked] {
+            uchar params[2] = {1, 2};
+            std::vector<std::future<bool>> results;
+            for (int n = 0; n < BENCH_ASYNC_REQUESTS; n++)
+                results.push_back(link->asyncRequestWithAck(BENCH_DEVICE_ID, params, sizeof(params)));
+            for (auto &r : results)
+                acked += r.get();
+        });
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<double> sync_us;
+    int syncAcked = 0;
+    for (int i = 0; i < BENCH_SYNC_REQUESTS; i++)
+    {
+        auto t = std::chrono::steady_clock::now();
+        syncAcked += links[0].syncRequest((uchar)BENCH_DEVICE_ID, (uchar)i);
+        sync_us.push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - t).count());
+    }
+    for (auto &s : senders)
+        s.join();
+    double s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    std::sort(sync_us.begin(), sync_us.end());
+    printf("%3d boards: %d threads added by the links, syncRequest %d/%d acked p50 %.0f us p99 %.0f us, %lu/%d async acked, %.0f requests/s\n",
+           boards, added, syncAcked, BENCH_SYNC_REQUESTS, sync_us[sync_us.size() / 2], sync_us[sync_us.size() * 99 / 100],
+           acked.load(), (boards - 1) * BENCH_ASYNC_REQUESTS, (acked + syncAcked) / s);
+
+    links.clear();
+    for (auto d : devices)
+        delete d;
+    for (int fd : fds)
+        close(fd);
+}
+
+int main()
+{
+    SerialReactor reactor;
+    if (!reactor.isOpen())
+        return 1;
+    run(reactor, 1);
+    run(reactor, 4);
+    run(reactor, 16);
+    return 0;
+}
@@ -0,0 +1,85 @@
+// How long a frame written to a pty takes to reach its handler, with the
+// receive thread blocked in poll() on the port (eventDriven) and with the old
+// loop sleeping SERIAL_WAIT_DELAY_ms between receiveData() attempts. One frame
+// is in flight at a time, handlers run on the receive thread. No hardware
+// needed, the pty stands in for the board. Build on the host with:
+//   g++ -O2 -std=c++17 -I../arduino -I. -I../pc -o receive_latency_bench receive_latency_bench.cpp device_emulator.cpp ../pc/*.cpp -lpthread
+
+#include <stdio.h>
+#include <vector>
+#include <algorithm>
+#include <mutex>
+#include <condition_variable>
+
+#include "device_emulator.h"
+#include "../pc/serial_link.h"
+
+#define BENCH_DEVICE_ID 9
+#define BENCH_FRAMES 200
+// not a multiple of SERIAL_WAIT_DELAY_ms, so frames land all over the sleep
+#define BENCH_INTERVAL_us 3100
+#define BENCH_FRAME_TIMEOUT_ms 500
+
+static void run(const char *name, bool eventDriven)
+{
+    std::string path;
+    int master = DeviceEmulator::openPty(path);
+    if (master < 0)
+    {
+        perror("openpty");
+        return;
+    }
+
+    std::mutex mtx;
+    std::condition_variable received;
+    std::chrono::steady_clock::time_point sentAt;
+    bool waiting = false;
+    std::vector<double> latency;
+    std::function<void(ResponseData *)> handler = [&](ResponseData *) {
+        auto now = std::chrono::steady_clock::now();
+        std::lock_guard<std::mutex> guard(mtx);
+        if (!waiting)
+            return;
+        latency.push_back(std::chrono::duration<double, std::micro>(now - sentAt).count());
+        waiting = false;
+        received.notify_one();
+    };
+
+    {
+        SerialLink link(path.c_str(), eventDriven);
+        link.addHandler(BENCH_DEVICE_ID, 1, handler);
+
+        // an unsolicited DATA frame [frameId, DATA, deviceId]
+        const uchar body[] = {1, PROTOCOL_FRAME_TYPE_DATA, BENCH_DEVICE_ID};
+        uchar frame[FRAME_ENCODED_MAX_SIZE(sizeof(body))];
+        unsigned int size = frameEncode(body, sizeof(body), Crc16Slice::compute(body, sizeof(body)), frame);
+        for (int i = 0; i < BENCH_FRAMES; i++)
+        {
+            std::this_thread::sleep_for(std::chrono::microseconds(BENCH_INTERVAL_us));
+            std::unique_lock<std::mutex> lk(mtx);
+            waiting = true;
+            sentAt = std::chrono::steady_clock::now();
+            if (::write(master, frame, size) != (ssize_t)size)
+                break;
+            received.wait_for(lk, std::chrono::milliseconds(BENCH_FRAME_TIMEOUT_ms), [&waiting] { return !waiting; });
+            waiting = false;
+        }
+    }
+    close(master);
+
+    if (latency.empty())
+    {
+        printf("%-8s no frames received\n", name);
+        return;
+    }
+    std::sort(latency.begin(), latency.end());
+    printf("%-8s %zu/%d frames, write to handler p50 %.0f us, p99 %.0f us, max %.0f us\n", name, latency.size(), BENCH_FRAMES,
+           latency[latency.size() / 2], latency[latency.size() * 99 / 100], latency.back());
+}
+
+int main()
+{
+    run("poll()", true);
+    run("sleep", false);
+    return 0;
+}
@@ -0,0 +1,137 @@
+// Records the traffic of a link talking to the device emulator into a capture
+// file (SerialLink::startRecording()), then replays it through a SerialLink on
+// a ReplayCommunication: as fast as the handlers take it, run on the receive
+// thread (dispatch workers would only drop what they can't queue), and at the
+// recorded timing. No hardware needed. Build on the host with:
+//   g++ -O2 -std=c++17 -I../arduino -I. -I../pc -o replay_bench replay_bench.cpp device_emulator.cpp ../pc/*.cpp -lpthread
+
+#include <stdio.h>
+#include <sys/socket.h>
+#include <vector>
+
+#include "device_emulator.h"
+#include "../pc/serial_link.h"
+#include "../pc/replay_comm.h"
+
+#define BENCH_CAPTURE_PATH "/tmp/replay_bench.cap"
+#define BENCH_FIRST_DEVICE_ID 20
+#define BENCH_DEVICES 4
+#define BENCH_RECORD_ms 2000
+#define BENCH_REQUESTS 500
+
+// sample counter, a reading
+typedef MessageSchema<uint32_t, float> Sample;
+typedef MessageSchema<> PollRequest;
+
+static double elapsed_s(std::chrono::steady_clock::time_point since)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - since).count();
+}
+
+static void sample(HostBusCommunication &comm, uchar deviceId, uint32_t &seq, bool streamed)
+{
+    seq++;
+    if (streamed)
+        comm.publish<Sample>(deviceId, seq, seq * 0.5f);
+    else
+    {
+        uchar values[Sample::size];
+        Sample::encode(values, seq, seq * 0.5f);
+        DeviceEmulator::reply(comm, deviceId, values, sizeof(values));
+    }
+}
+
+// streaming subscriptions with polling requests on top
+static void record()
+{
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0)
+    {
+        perror("socketpair");
+        return;
+    }
+    {
+        DeviceEmulator device(fds[1]);
+        uint32_t seq[BENCH_DEVICES] = {};
+        for (int i = 0; i < BENCH_DEVICES; i++)
+        {
+            uint32_t *s = &seq[i];
+            device.setResponder(BENCH_FIRST_DEVICE_ID + i, [s](HostBusCommunication &comm, uchar deviceId) { sample(comm, deviceId, *s, false); });
+            device.setPublisher(BENCH_FIRST_DEVICE_ID + i, [s](HostBusCommunication &comm, uchar deviceId) { sample(comm, deviceId, *s, true); });
+        }
+
+        SerialLink link(new SerialCommunication(fds[0]));
+        if (!link.startRecording(BENCH_CAPTURE_PATH))
+            return;
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < BENCH_DEVICES; i++)
+            link.subscribe(BENCH_FIRST_DEVICE_ID + i, SUBSCRIPTION_MIN_PERIOD_ms);
+        for (int i = 0; i < BENCH_REQUESTS; i++)
+            link.syncRequest<PollRequest>(BENCH_FIRST_DEVICE_ID + i % BENCH_DEVICES);
+        std::this_thread::sleep_until(start + std::chrono::milliseconds(BENCH_RECORD_ms));
+        for (int i = 0; i < BENCH_DEVICES; i++)
+            link.unsubscribe(BENCH_FIRST_DEVICE_ID + i);
+        link.stopRecording();
+    }
+    close(fds[1]);
+
+    FrameCapture capture;
+    if (!capture.open(BENCH_CAPTURE_PATH))
+        return;
+    FrameCaptureEntry e;
+    unsigned long frames[2] = {};
+    uint64_t last_ns = 0;
+    while (capture.next(e))
+    {
+        frames[e.direction]++;
+        last_ns = e.time_ns;
+    }
+    printf("recorded     %lu frames received, %lu sent over %.2f s, %u dropped\n", frames[FRAME_DIRECTION_RX],
+           frames[FRAME_DIRECTION_TX], last_ns / 1e9, capture.droppedFrames());
+}
+
+static void replay(const char *name, bool paced, unsigned int workers)
+{
+    std::atomic<unsigned long> samples(0);
+    std::atomic<double> sum(0);
+    std::function<void(ResponseData *)> handler = [&](ResponseData *msg) {
+        // a DATA frame [frameId, DATA, deviceId, values...] or a DATA_LIST entry [size, values...]
+        unsigned int at = msg->size == 3 + Sample::size ? 3 : 1;
+        if (msg->size != at + Sample::size)
+            return;
+        uint32_t seq;
+        float value;
+        Sample::decode((const uint8_t *)&msg->data[at], seq, value);
+        sum = sum + value;
+        samples++;
+    };
+
+    ReplayCommunication *comm = new ReplayCommunication(BENCH_CAPTURE_PATH, paced);
+    if (!comm->isOpen())
+    {
+        delete comm;
+        return;
+    }
+    SerialLink link(comm, true, workers);
+    for (int i = 0; i < BENCH_DEVICES; i++)
+        link.addHandler(BENCH_FIRST_DEVICE_ID + i, 1, handler);
+
+    auto start = std::chrono::steady_clock::now();
+    comm->start();
+    while (!comm->isFinished())
+        std::this_thread::sleep_for(std::chrono::microseconds(100));
+    double s = elapsed_s(start);
+    // the dispatch workers may still be running the last handlers
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    printf("%-12s %lu frames in %.3f s, %9.0f frames/s, %lu samples handled, %lu frames dropped\n", name, comm->replayedFrames(), s,
+           comm->replayedFrames() / s, samples.load(), (unsigned long)(link.getDispatchStats().dropped + link.getMetrics().droppedFrames));
+}
+
+int main()
+{
+    record();
+    replay("fast", false, 0);
+    replay("paced", true, DISPATCH_WORKERS_DEFAULT);
+    unlink(BENCH_CAPTURE_PATH);
+    return 0;
+}
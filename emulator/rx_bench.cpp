@@ -0,0 +1,118 @@
+// Cost of AsyncCommunication::receiveData() on the device side while frames
+// trickle in at the byte rate of a 115200 baud line: how long a single call
+// keeps the sketch's loop() busy, and how long after its MSG_END a frame is
+// handed out. Runs the arduino/ code on the host through HostBusCommunication,
+// no hardware needed. Build on the host with:
+//   g++ -O2 -std=c++17 -I../arduino -I. -o rx_bench rx_bench.cpp -lpthread
+
+#include <stdio.h>
+#include <sys/socket.h>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+
+#include "host_bus_comm.h"
+
+#define BENCH_FRAMES 500
+#define BENCH_FRAME_SIZE 30
+// one 8N1 byte at 115200 baud
+#define BENCH_BYTE_us 87
+#define BENCH_FRAME_GAP_us 1000
+
+static int64_t now_ns()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// sleeps rather than spins: the loop() side needs the CPU on a single core host
+static void sleep_until(int64_t t_ns)
+{
+    std::this_thread::sleep_for(std::chrono::nanoseconds(t_ns - now_ns()));
+}
+
+static double percentile(std::vector<double> &v, int p)
+{
+    return v.empty() ? 0 : v[v.size() * p / 100];
+}
+
+// writes BENCH_FRAMES DATA frames one byte at a time, the time each MSG_END
+// goes out in frameEnd_ns
+static void trickle(int fd, std::vector<std::atomic<int64_t>> &frameEnd_ns)
+{
+    uint8_t body[BENCH_FRAME_SIZE];
+    uint8_t wire[FRAME_ENCODED_MAX_SIZE(BENCH_FRAME_SIZE)];
+    for (int f = 0; f < BENCH_FRAMES; f++)
+    {
+        body[0] = f % 255 + 1;
+        body[1] = PROTOCOL_FRAME_TYPE_DATA;
+        body[2] = 7;
+        for (int i = 3; i < BENCH_FRAME_SIZE; i++)
+            body[i] = f + i;
+        unsigned int n = frameEncode(body, sizeof(body), crc16(body, sizeof(body)), wire);
+
+        int64_t t = now_ns();
+        for (unsigned int i = 0; i < n; i++)
+        {
+            t += BENCH_BYTE_us * 1000;
+            sleep_until(t);
+            if (i == n - 1)
+                frameEnd_ns[f] = now_ns();
+            if (::write(fd, &wire[i], 1) != 1)
+                return;
+        }
+        sleep_until(now_ns() + BENCH_FRAME_GAP_us * 1000);
+    }
+}
+
+int main()
+{
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0)
+    {
+        perror("socketpair");
+        return 1;
+    }
+
+    HostBusCommunication comm(fds[1]);
+    comm.initialize();
+
+    std::vector<std::atomic<int64_t>> frameEnd_ns(BENCH_FRAMES);
+    for (auto &t : frameEnd_ns)
+        t = 0;
+    std::thread writer(trickle, fds[0], std::ref(frameEnd_ns));
+
+    // the sketch's loop(): poll, handle a frame when there is one
+    std::vector<double> call_us;
+    std::vector<double> handoff_us;
+    int received = 0;
+    int64_t deadline = now_ns() + (int64_t)BENCH_FRAMES * (BENCH_FRAME_SIZE * 2 * BENCH_BYTE_us + BENCH_FRAME_GAP_us) * 1000 + 1000000000LL;
+    while (received < BENCH_FRAMES && now_ns() < deadline)
+    {
+        int64_t start = now_ns();
+        comm.receiveData();
+        int64_t end = now_ns();
+        call_us.push_back((end - start) / 1000.0);
+        if (!comm.hasData())
+        {
+            // the rest of loop(), and room for the writer on a single core host
+            std::this_thread::yield();
+            continue;
+        }
+
+        // frames arrive in order, each stamped before its MSG_END was written
+        handoff_us.push_back((end - frameEnd_ns[received]) / 1000.0);
+        received++;
+        comm.clearReceiveBuffer();
+    }
+    writer.join();
+
+    std::sort(call_us.begin(), call_us.end());
+    std::sort(handoff_us.begin(), handoff_us.end());
+    printf("%d/%d frames of %d bytes, %zu receiveData() calls\n", received, BENCH_FRAMES, BENCH_FRAME_SIZE, call_us.size());
+    printf("receiveData() call:     p50 %.1f us, p99 %.1f us, max %.1f us\n", percentile(call_us, 50), percentile(call_us, 99), call_us.empty() ? 0 : call_us.back());
+    printf("MSG_END to hasData():   p50 %.1f us, p99 %.1f us, max %.1f us\n", percentile(handoff_us, 50), percentile(handoff_us, 99), handoff_us.empty() ? 0 : handoff_us.back());
+    close(fds[0]);
+    close(fds[1]);
+    return 0;
+}
@@ -0,0 +1,94 @@
+// Throughput of the byte stuffing that keeps frames binary transparent
+// (arduino/frame_parser.h): frameEncode() escaping MSG_START/MSG_END/MSG_ESC
+// bytes of a body and its CRC on the way out, FrameParser undoing it on the way
+// in, for random payloads, payloads without a byte to escape and payloads made
+// only of them. Reports MB/s of body and the wire size, delimiters and CRC
+// included, against the body. Every decoded frame is checked against its body.
+// Build on the host with:
+//   g++ -O2 -std=c++17 -o stuffing_bench stuffing_bench.cpp
+
+#include <stdio.h>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <functional>
+
+#include "../pc/serial_comm_pi.h"
+
+#define BENCH_BODIES 1024
+#define BENCH_ROUNDS 200
+
+typedef std::vector<uint8_t> Bytes;
+
+static double elapsed_s(std::chrono::steady_clock::time_point since)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - since).count();
+}
+
+static void bench(const char *name, unsigned int size, std::function<uint8_t(std::mt19937 &)> byte)
+{
+    std::mt19937 rng(size);
+    std::vector<Bytes> bodies(BENCH_BODIES, Bytes(size));
+    for (auto &body : bodies)
+        for (auto &b : body)
+            b = byte(rng);
+
+    // encode: MSG_START, escaped body and CRC, MSG_END. The CRC is computed up
+    // front, only the escaping is timed.
+    std::vector<Bytes> wires(BENCH_BODIES, Bytes(FRAME_ENCODED_MAX_SIZE(size)));
+    std::vector<unsigned int> wireSizes(BENCH_BODIES);
+    std::vector<uint16_t> crcs(BENCH_BODIES);
+    for (int i = 0; i < BENCH_BODIES; i++)
+        crcs[i] = Crc16Slice::compute(bodies[i].data(), size);
+    unsigned long wireBytes = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int r = 0; r < BENCH_ROUNDS; r++)
+        for (int i = 0; i < BENCH_BODIES; i++)
+            wireSizes[i] = frameEncode(bodies[i].data(), size, crcs[i], wires[i].data());
+    double encode_s = elapsed_s(start);
+    for (unsigned int n : wireSizes)
+        wireBytes += n;
+
+    // decode: one byte at a time, as receiveData() feeds the parser
+    uint8_t buffer[RCV_BUFFER_SIZE + FRAME_CRC_SIZE];
+    FrameParser parser(buffer, sizeof(buffer));
+    int intact = 0;
+    start = std::chrono::steady_clock::now();
+    for (int r = 0; r < BENCH_ROUNDS; r++)
+    {
+        for (int i = 0; i < BENCH_BODIES; i++)
+        {
+            const uint8_t *wire = wires[i].data();
+            for (unsigned int j = 0; j < wireSizes[i]; j++)
+            {
+                if (parser.push(wire[j]) != FRAME_PARSER_COMPLETE)
+                    continue;
+                if (r == 0)
+                    intact += parser.frameSize() == size + FRAME_CRC_SIZE && memcmp(buffer, bodies[i].data(), size) == 0;
+            }
+        }
+    }
+    double decode_s = elapsed_s(start);
+
+    double mb = (double)size * BENCH_BODIES * BENCH_ROUNDS / 1e6;
+    printf("%-14s %3u bytes: encode %7.1f MB/s, decode %7.1f MB/s, wire %5.1f%% of body, %d/%d intact\n", name, size,
+           mb / encode_s, mb / decode_s, 100.0 * wireBytes / ((double)size * BENCH_BODIES), intact, BENCH_BODIES);
+}
+
+int main()
+{
+    static const uint8_t delimiters[] = {MSG_START, MSG_END, MSG_ESC};
+    for (unsigned int size : {8u, 32u, (unsigned int)RCV_BUFFER_SIZE})
+    {
+        bench("random", size, [](std::mt19937 &rng) { return (uint8_t)rng(); });
+        bench("no escapes", size, [](std::mt19937 &rng) {
+            uint8_t b;
+            do
+                b = rng();
+            while (frameNeedsEscape(b));
+            return b;
+        });
+        bench("all escaped", size, [](std::mt19937 &rng) { return delimiters[rng() % 3]; });
+    }
+    return 0;
+}
@@ -0,0 +1,172 @@
+// Samples per second and sample age of polling (a syncRequest() per sample)
+// against streaming subscriptions (SerialLink::subscribe()) for the same
+// devices, using the device emulator, no hardware needed. Build on the host with:
+//   g++ -O2 -std=c++17 -I../arduino -I. -I../pc -o subscription_bench subscription_bench.cpp device_emulator.cpp ../pc/*.cpp -lpthread
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <vector>
+#include <algorithm>
+
+#include "device_emulator.h"
+#include "../pc/serial_link.h"
+
+#define BENCH_FIRST_DEVICE_ID 20
+#define BENCH_DEVICES 4
+#define BENCH_DURATION_ms 2000
+#define BENCH_PERIOD_ms SUBSCRIPTION_MIN_PERIOD_ms
+
+// sample counter, device clock in us when the sample was taken
+typedef MessageSchema<uint32_t, uint32_t> Sample;
+typedef MessageSchema<> PollRequest;
+
+static uint32_t now_us()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// collects the samples the handlers get, from any thread. The age of a sample
+// is how old it is when it reaches the handler, the gap how long a handler
+// waits for the next sample of the same deviceId: how stale its value may get.
+class SampleStats
+{
+private:
+    std::mutex mtx;
+    std::vector<double> age_us;
+    std::vector<double> gap_us;
+    uint32_t lastArrival[256] = {};
+
+    static double percentile(std::vector<double> &v, int p)
+    {
+        return v.empty() ? 0 : v[v.size() * p / 100];
+    }
+
+public:
+    void reset()
+    {
+        std::lock_guard<std::mutex> guard(mtx);
+        age_us.clear();
+        gap_us.clear();
+        memset(lastArrival, 0, sizeof(lastArrival));
+    }
+
+    void record(uchar deviceId, const char *values)
+    {
+        uint32_t seq, stamp;
+        Sample::decode((const uint8_t *)values, seq, stamp);
+        uint32_t now = now_us();
+        std::lock_guard<std::mutex> guard(mtx);
+        age_us.push_back(now - stamp);
+        if (lastArrival[deviceId] != 0)
+            gap_us.push_back(now - lastArrival[deviceId]);
+        lastArrival[deviceId] = now;
+    }
+
+    void print(const char *name, unsigned long frames)
+    {
+        {
+            std::lock_guard<std::mutex> guard(mtx);
+            std::sort(age_us.begin(), age_us.end());
+            std::sort(gap_us.begin(), gap_us.end());
+            printf("%-10s %6zu samples, %7.1f samples/s, %5.2f samples/frame, age p50 %.0f us p99 %.0f us, gap p50 %.0f us p99 %.0f us\n",
+                   name, age_us.size(), age_us.size() * 1000.0 / BENCH_DURATION_ms, frames > 0 ? (double)age_us.size() / frames : 0.0,
+                   percentile(age_us, 50), percentile(age_us, 99), percentile(gap_us, 50), percentile(gap_us, 99));
+        }
+        reset();
+    }
+};
+
+static void sample(HostBusCommunication &comm, uchar deviceId, uint32_t &seq, bool streamed)
+{
+    if (streamed)
+        comm.publish<Sample>(deviceId, ++seq, now_us());
+    else
+    {
+        uchar values[Sample::size];
+        Sample::encode(values, ++seq, now_us());
+        DeviceEmulator::reply(comm, deviceId, values, sizeof(values));
+    }
+}
+
+// one sample per request, the devices polled round robin as fast as the link goes
+static void benchPolling(SerialLink &link, SampleStats &stats)
+{
+    std::function<void(ResponseData *)> handler = [&stats](ResponseData *msg) {
+        // a DATA frame [frameId, DATA, deviceId, values...]
+        if (msg->frameType == PROTOCOL_FRAME_TYPE_DATA && msg->size >= 3 + Sample::size)
+            stats.record(msg->deviceId, &msg->data[3]);
+    };
+    for (int i = 0; i < BENCH_DEVICES; i++)
+        link.addHandler(BENCH_FIRST_DEVICE_ID + i, 1, handler);
+
+    unsigned long before = link.getMetrics().framesReceived;
+    auto end = std::chrono::steady_clock::now() + std::chrono::milliseconds(BENCH_DURATION_ms);
+    for (int i = 0; std::chrono::steady_clock::now() < end; i = (i + 1) % BENCH_DEVICES)
+        link.syncRequest<PollRequest>(BENCH_FIRST_DEVICE_ID + i);
+    // the last samples are still on their way
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    // every sample costs an ACK frame and a DATA frame
+    stats.print("polling", link.getMetrics().framesReceived - before);
+
+    for (int i = 0; i < BENCH_DEVICES; i++)
+        link.removeHandler(BENCH_FIRST_DEVICE_ID + i, 1);
+}
+
+static void benchSubscription(SerialLink &link, SampleStats &stats)
+{
+    std::function<void(ResponseData *)> handler = [&stats](ResponseData *msg) {
+        // a DATA_LIST entry [size, values...]
+        if (msg->size >= 1 + Sample::size)
+            stats.record(msg->deviceId, &msg->data[1]);
+    };
+    for (int i = 0; i < BENCH_DEVICES; i++)
+        link.addHandler(BENCH_FIRST_DEVICE_ID + i, 1, handler);
+
+    int subscribed = 0;
+    for (int i = 0; i < BENCH_DEVICES; i++)
+        subscribed += link.subscribe(BENCH_FIRST_DEVICE_ID + i, BENCH_PERIOD_ms);
+    // the samples taken while subscribing aren't counted
+    std::this_thread::sleep_for(std::chrono::milliseconds(BENCH_PERIOD_ms));
+    stats.reset();
+
+    unsigned long before = link.getMetrics().framesReceived;
+    std::this_thread::sleep_for(std::chrono::milliseconds(BENCH_DURATION_ms));
+    unsigned long frames = link.getMetrics().framesReceived - before;
+    for (int i = 0; i < BENCH_DEVICES; i++)
+        link.unsubscribe(BENCH_FIRST_DEVICE_ID + i);
+    printf("%d/%d subscribed every %d ms\n", subscribed, BENCH_DEVICES, BENCH_PERIOD_ms);
+    stats.print("streaming", frames);
+
+    for (int i = 0; i < BENCH_DEVICES; i++)
+        link.removeHandler(BENCH_FIRST_DEVICE_ID + i, 1);
+}
+
+int main()
+{
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0)
+    {
+        perror("socketpair");
+        return 1;
+    }
+
+    {
+        DeviceEmulator device(fds[1]);
+        uint32_t seq[BENCH_DEVICES] = {};
+        for (int i = 0; i < BENCH_DEVICES; i++)
+        {
+            uint32_t *s = &seq[i];
+            device.setResponder(BENCH_FIRST_DEVICE_ID + i, [s](HostBusCommunication &comm, uchar deviceId) { sample(comm, deviceId, *s, false); });
+            device.setPublisher(BENCH_FIRST_DEVICE_ID + i, [s](HostBusCommunication &comm, uchar deviceId) { sample(comm, deviceId, *s, true); });
+        }
+
+        SerialLink link(new SerialCommunication(fds[0]));
+        SampleStats stats;
+        benchPolling(link, stats);
+        benchSubscription(link, stats);
+        printf("%s", link.dumpMetrics("link").c_str());
+    }
+    close(fds[1]);
+    return 0;
+}
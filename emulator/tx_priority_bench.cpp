@@ -0,0 +1,122 @@
+// Latency of control frames while bulk traffic saturates the link, with the
+// control deviceId in the normal transmit class and then in TX_CLASS_CONTROL
+// (SerialLink::setDevicePriority()), using the device emulator, no hardware
+// needed. Build on the host with:
+//   g++ -O2 -std=c++17 -I../arduino -I. -I../pc -o tx_priority_bench tx_priority_bench.cpp device_emulator.cpp ../pc/*.cpp -lpthread
+
+#include <stdio.h>
+#include <sys/socket.h>
+#include <vector>
+#include <algorithm>
+#include <future>
+
+#include "device_emulator.h"
+#include "../pc/serial_link.h"
+
+#define BENCH_CONTROL_DEVICE_ID 1
+#define BENCH_NORMAL_DEVICE_ID 2
+#define BENCH_BULK_DEVICE_ID 3
+#define BENCH_CONTROL_REQUESTS 200
+#define BENCH_CONTROL_PERIOD_ms 10
+#define BENCH_BULK_SENDERS 1
+#define BENCH_NORMAL_SENDERS 2
+#define BENCH_MESSAGE_SIZE 1024
+
+// a motor stop: mode, speed
+typedef MessageSchema<uint8_t, int16_t> MotorCommand;
+
+static double elapsed_us(std::chrono::steady_clock::time_point since)
+{
+    return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - since).count();
+}
+
+// keeps the link busy with fragmented messages and acked requests until run is cleared
+class BulkLoad
+{
+private:
+    std::atomic<bool> run;
+    std::vector<std::thread> threads;
+    std::atomic<unsigned long> messages;
+    std::atomic<unsigned long> requests;
+
+public:
+    BulkLoad(SerialLink &link)
+    {
+        run = true;
+        messages = 0;
+        requests = 0;
+        for (int i = 0; i < BENCH_BULK_SENDERS; i++)
+            threads.emplace_back([this, &link] {
+                std::vector<uchar> data(BENCH_MESSAGE_SIZE, 0x55);
+                while (run)
+                    messages += link.sendMessage(BENCH_BULK_DEVICE_ID, data.data(), data.size());
+            });
+        for (int i = 0; i < BENCH_NORMAL_SENDERS; i++)
+            threads.emplace_back([this, &link] {
+                uchar params[8] = {1, 2, 3, 4, 5, 6, 7, 8};
+                while (run)
+                    requests += link.asyncRequestWithAck(BENCH_NORMAL_DEVICE_ID, params, sizeof(params)).get();
+            });
+    }
+
+    ~BulkLoad()
+    {
+        run = false;
+        for (auto &t : threads)
+            t.join();
+    }
+
+    void print(double s)
+    {
+        printf("             load: %.1f KB/s of messages, %.0f requests/s\n", messages * BENCH_MESSAGE_SIZE / 1024.0 / s, requests / s);
+    }
+};
+
+static void benchControl(const char *name, SerialLink &link, bool loaded)
+{
+    std::unique_ptr<BulkLoad> load;
+    if (loaded)
+    {
+        load.reset(new BulkLoad(link));
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+
+    std::vector<double> latency;
+    int acked = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < BENCH_CONTROL_REQUESTS; i++)
+    {
+        auto sent = std::chrono::steady_clock::now();
+        acked += link.syncRequest<MotorCommand>(BENCH_CONTROL_DEVICE_ID, (uint8_t)0, (int16_t)0);
+        latency.push_back(elapsed_us(sent));
+        std::this_thread::sleep_for(std::chrono::milliseconds(BENCH_CONTROL_PERIOD_ms));
+    }
+    std::sort(latency.begin(), latency.end());
+    printf("%-12s control: %d/%d acked, p50 %.0f us, p99 %.0f us, max %.0f us\n", name, acked, BENCH_CONTROL_REQUESTS,
+           latency[latency.size() / 2], latency[latency.size() * 99 / 100], latency.back());
+    if (load)
+        load->print(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+}
+
+int main()
+{
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0)
+    {
+        perror("socketpair");
+        return 1;
+    }
+    {
+        DeviceEmulator device(fds[1]);
+        SerialLink link(new SerialCommunication(fds[0]));
+        link.setAckWindowSize(32);
+
+        benchControl("idle", link, false);
+        benchControl("normal", link, true);
+        link.setDevicePriority(BENCH_CONTROL_DEVICE_ID, TX_CLASS_CONTROL);
+        benchControl("control", link, true);
+        printf("%s", link.dumpMetrics("link").c_str());
+    }
+    close(fds[1]);
+    return 0;
+}
@@ -18,9 +18,10 @@ typedef union
     char bval[2];
 } uint16p;
 
+// int32_t, not long: long is 8 bytes on 64-bit Linux but 4 on the AVR
 typedef union
 {
-    long val;
+    int32_t val;
     char bval[4];
 } longp;
 
@@ -0,0 +1,60 @@
+#ifndef _CRC16_SLICE_H
+#define _CRC16_SLICE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// CRC-16/CCITT-FALSE (poly 0x1021, init 0xFFFF), the same CRC the Arduino side
+// computes nibble by nibble in arduino/crc16.h, eight bytes per step using
+// slicing-by-8 tables (4 KB, built on first use).
+
+#define CRC16_SLICE_INIT 0xFFFF
+#define CRC16_SLICE_POLY 0x1021
+
+class Crc16Slice
+{
+private:
+    uint16_t table[8][256];
+
+    Crc16Slice()
+    {
+        for (int b = 0; b < 256; b++)
+        {
+            uint16_t crc = b << 8;
+            for (int bit = 0; bit < 8; bit++)
+                crc = (crc & 0x8000) ? (crc << 1) ^ CRC16_SLICE_POLY : crc << 1;
+            table[0][b] = crc;
+        }
+        // table[k][b]: CRC of byte b followed by k zero bytes
+        for (int k = 1; k < 8; k++)
+            for (int b = 0; b < 256; b++)
+                table[k][b] = (table[k - 1][b] << 8) ^ table[0][table[k - 1][b] >> 8];
+    }
+
+    static const Crc16Slice &instance()
+    {
+        static Crc16Slice tables;
+        return tables;
+    }
+
+public:
+    static uint16_t compute(const uint8_t *data, size_t size, uint16_t crc = CRC16_SLICE_INIT)
+    {
+        const uint16_t(*t)[256] = instance().table;
+
+        while (size >= 8)
+        {
+            uint16_t top = crc ^ (data[0] << 8 | data[1]);
+            crc = t[7][top >> 8] ^ t[6][top & 0xff] ^
+                  t[5][data[2]] ^ t[4][data[3]] ^ t[3][data[4]] ^
+                  t[2][data[5]] ^ t[1][data[6]] ^ t[0][data[7]];
+            data += 8;
+            size -= 8;
+        }
+        while (size-- > 0)
+            crc = (crc << 8) ^ t[0][(crc >> 8) ^ *data++];
+        return crc;
+    }
+};
+
+#endif
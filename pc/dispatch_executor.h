@@ -0,0 +1,253 @@
+#ifndef _DISPATCH_EXECUTOR_H
+#define _DISPATCH_EXECUTOR_H
+
+#include "comm_types.h"
+#include "response_pool.h"
+#include "handler_registry.h"
+#include "link_metrics.h"
+#include <stdint.h>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <vector>
+#include <chrono>
+
+#define DISPATCH_QUEUE_SIZE 64 // must be a power of two
+#define DISPATCH_WORKERS_DEFAULT 1
+
+// Bounded single-producer single-consumer ring. head/tail are free running
+// counters, the slot index is (counter & (N - 1)).
+template <typename T, unsigned int N>
+class SpscQueue
+{
+private:
+    T items[N];
+    std::atomic<unsigned int> head;
+    std::atomic<unsigned int> tail;
+
+public:
+    SpscQueue()
+    {
+        head = 0;
+        tail = 0;
+    }
+
+    // producer side. Returns false when the queue is full.
+    bool push(const T &item)
+    {
+        unsigned int h = head.load(std::memory_order_relaxed);
+        if (h - tail.load(std::memory_order_acquire) == N)
+            return false;
+        items[h & (N - 1)] = item;
+        // seq_cst so the consumer going to sleep can't miss it, see DispatchExecutor
+        head.store(h + 1);
+        return true;
+    }
+
+    // consumer side. Returns false when the queue is empty.
+    bool pop(T &item)
+    {
+        unsigned int t = tail.load(std::memory_order_relaxed);
+        if (head.load() == t)
+            return false;
+        item = items[t & (N - 1)];
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+    unsigned int size()
+    {
+        return head.load() - tail.load();
+    }
+};
+
+typedef struct DispatchStats
+{
+    unsigned int queueDepth;    // frames waiting for a worker right now
+    unsigned int maxQueueDepth; // highest queueDepth seen by a worker
+    uint64_t dispatched;
+    uint64_t dropped;           // frames lost because their worker's queue was full
+    uint64_t handlerTotal_us;   // time spent running handlers
+    uint64_t handlerMax_us;     // slowest single frame
+} DispatchStats;
+
+// Runs the handlers of received frames on a pool of worker threads, so a slow
+// handler doesn't keep the receive thread from draining the serial port. Every
+// deviceId is always served by the same worker, which keeps the frames of a
+// device in order. Frames are queued with a reference on their pooled buffer,
+// the worker drops it once the handlers are done. One executor may serve
+// several links (see SerialReactor), each job carries its link's handlers and pool.
+// submit() must always be called from the same thread (the receive thread).
+class DispatchExecutor
+{
+private:
+    typedef struct
+    {
+        HandlerRegistry *handlers;
+        ResponseDataPool *pool;
+        PooledResponseData *frame;
+        ResponseData msg; // the frame itself or a DATA_LIST entry viewing into it
+        LinkMetrics *metrics;
+        std::chrono::steady_clock::time_point queuedAt;
+    } Job;
+
+    typedef struct Worker
+    {
+        SpscQueue<Job, DISPATCH_QUEUE_SIZE> queue;
+        std::atomic<bool> sleeping;
+        std::mutex mtx;
+        std::condition_variable cv;
+        std::thread *thread;
+    } Worker;
+
+    std::vector<Worker *> workers;
+    std::atomic<bool> run;
+
+    std::atomic<unsigned int> maxQueueDepth;
+    std::atomic<uint64_t> dispatched;
+    std::atomic<uint64_t> dropped;
+    std::atomic<uint64_t> handlerTotal_us;
+    std::atomic<uint64_t> handlerMax_us;
+
+    void execute(Job &job)
+    {
+        auto start = std::chrono::steady_clock::now();
+        job.handlers->dispatch(&job.msg);
+        uint64_t elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+        job.pool->unref(job.frame);
+
+        if (job.metrics != nullptr)
+        {
+            job.metrics->dispatchWait_us.record(std::chrono::duration_cast<std::chrono::microseconds>(start - job.queuedAt).count());
+            job.metrics->handlerTime_us.record(elapsed);
+        }
+
+        dispatched.fetch_add(1, std::memory_order_relaxed);
+        handlerTotal_us.fetch_add(elapsed, std::memory_order_relaxed);
+        uint64_t max = handlerMax_us.load(std::memory_order_relaxed);
+        while (elapsed > max && !handlerMax_us.compare_exchange_weak(max, elapsed, std::memory_order_relaxed))
+            ;
+    }
+
+    void workerLoop(Worker *w)
+    {
+        Job job;
+        while (true)
+        {
+            unsigned int depth = w->queue.size();
+            unsigned int max = maxQueueDepth.load(std::memory_order_relaxed);
+            while (depth > max && !maxQueueDepth.compare_exchange_weak(max, depth, std::memory_order_relaxed))
+                ;
+
+            if (w->queue.pop(job))
+            {
+                execute(job);
+                continue;
+            }
+            if (!run)
+                return;
+
+            // holds no handler list while it sleeps
+            ReaderEpochs::idle();
+
+            // announce the sleep before checking the queue one last time: either
+            // submit() sees sleeping and notifies, or we see its job
+            std::unique_lock<std::mutex> lk(w->mtx);
+            w->sleeping = true;
+            w->cv.wait(lk, [this, w] { return w->queue.size() > 0 || !run; });
+            w->sleeping = false;
+        }
+    }
+
+    void wake(Worker *w)
+    {
+        if (!w->sleeping)
+            return;
+        std::lock_guard<std::mutex> guard(w->mtx);
+        w->cv.notify_one();
+    }
+
+public:
+    // workerCount must be at least 1
+    DispatchExecutor(unsigned int workerCount)
+    {
+        run = true;
+        maxQueueDepth = 0;
+        dispatched = 0;
+        dropped = 0;
+        handlerTotal_us = 0;
+        handlerMax_us = 0;
+
+        if (workerCount < 1)
+            workerCount = 1;
+        for (unsigned int i = 0; i < workerCount; i++)
+        {
+            Worker *w = new Worker();
+            w->sleeping = false;
+            w->thread = nullptr;
+            workers.push_back(w);
+        }
+        for (auto w : workers)
+            w->thread = new std::thread(&DispatchExecutor::workerLoop, this, w);
+    }
+
+    // runs the frames still queued, then stops the workers
+    ~DispatchExecutor()
+    {
+        run = false;
+        for (auto w : workers)
+        {
+            {
+                std::lock_guard<std::mutex> guard(w->mtx);
+                w->cv.notify_one();
+            }
+            w->thread->join();
+            delete w->thread;
+            delete w;
+        }
+    }
+
+    // queues msg, which is frame or a view into it, for the worker serving its
+    // deviceId. frame must come from pool. Returns false and counts a drop when
+    // that worker is too far behind. Queue wait and handler time go to metrics
+    // when it isn't nullptr.
+    bool submit(HandlerRegistry &handlers, ResponseDataPool &pool, PooledResponseData *frame, ResponseData *msg, LinkMetrics *metrics = nullptr)
+    {
+        Worker *w = workers[msg->deviceId % workers.size()];
+        Job job;
+        job.handlers = &handlers;
+        job.pool = &pool;
+        job.frame = frame;
+        job.msg = *msg;
+        job.metrics = metrics;
+        if (metrics != nullptr)
+            job.queuedAt = std::chrono::steady_clock::now();
+
+        pool.ref(frame);
+        if (!w->queue.push(job))
+        {
+            pool.unref(frame);
+            dropped.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        wake(w);
+        return true;
+    }
+
+    DispatchStats stats()
+    {
+        DispatchStats s;
+        s.queueDepth = 0;
+        for (auto w : workers)
+            s.queueDepth += w->queue.size();
+        s.maxQueueDepth = maxQueueDepth;
+        s.dispatched = dispatched;
+        s.dropped = dropped;
+        s.handlerTotal_us = handlerTotal_us;
+        s.handlerMax_us = handlerMax_us;
+        return s;
+    }
+};
+
+#endif
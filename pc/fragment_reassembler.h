@@ -0,0 +1,147 @@
+#ifndef _FRAGMENT_REASSEMBLER_H
+#define _FRAGMENT_REASSEMBLER_H
+
+#include <stdint.h>
+#include <string.h>
+
+#include "comm_types.h"
+#include "../arduino/fragment.h"
+
+// largest message reassembled, and the most fragments it may come in
+#define FRAGMENT_MAX_MESSAGE_SIZE 65536
+#define FRAGMENT_MAX_COUNT 4096
+// messages being reassembled at the same time, each with its own buffer
+#define FRAGMENT_REASSEMBLY_SLOTS 4
+
+#define FRAGMENT_RESULT_NONE 0       // stored, more fragments to come
+#define FRAGMENT_RESULT_COMPLETE 1   // last fragment of a complete message: ack it, deliver it
+#define FRAGMENT_RESULT_INCOMPLETE 2 // last fragment, some are missing: nack it
+#define FRAGMENT_RESULT_DUPLICATE 3  // last fragment of the message delivered before: ack it again
+#define FRAGMENT_RESULT_INVALID 4    // malformed or too large, dropped
+
+// Puts FRAGMENT frames (arduino/fragment.h) back together. Every slot owns a
+// FRAGMENT_MAX_MESSAGE_SIZE buffer allocated once, a bitmap tracks which
+// fragments it got so they may arrive in any order and any number of times.
+// When every slot is busy the least recently used one is given up.
+// Not thread safe: a link feeds it from its receive thread only.
+class FragmentReassembler
+{
+private:
+    typedef struct
+    {
+        bool active;
+        uchar deviceId;
+        uchar msgId;
+        uint32_t size;
+        uint16_t count;
+        uint16_t received;
+        uint64_t lastUsed;
+        uint8_t bitmap[FRAGMENT_MAX_COUNT / 8];
+        char *buffer;
+    } Slot;
+
+    Slot slots[FRAGMENT_REASSEMBLY_SLOTS];
+    // msgId + 1 of the last message delivered for every deviceId, 0 for none,
+    // so the retransmission of a message whose ACK got lost isn't delivered twice
+    uint16_t delivered[256];
+    uint64_t useCounter;
+
+    Slot *find(uchar deviceId, uchar msgId)
+    {
+        for (int i = 0; i < FRAGMENT_REASSEMBLY_SLOTS; i++)
+            if (slots[i].active && slots[i].deviceId == deviceId && slots[i].msgId == msgId)
+                return &slots[i];
+        return nullptr;
+    }
+
+    // a free slot, or the least recently used one
+    Slot *allocate()
+    {
+        Slot *victim = &slots[0];
+        for (int i = 1; i < FRAGMENT_REASSEMBLY_SLOTS && victim->active; i++)
+            if (!slots[i].active || slots[i].lastUsed < victim->lastUsed)
+                victim = &slots[i];
+        return victim;
+    }
+
+public:
+    FragmentReassembler()
+    {
+        useCounter = 0;
+        memset(delivered, 0, sizeof(delivered));
+        for (int i = 0; i < FRAGMENT_REASSEMBLY_SLOTS; i++)
+        {
+            slots[i].active = false;
+            slots[i].buffer = new char[FRAGMENT_MAX_MESSAGE_SIZE];
+        }
+    }
+
+    ~FragmentReassembler()
+    {
+        for (int i = 0; i < FRAGMENT_REASSEMBLY_SLOTS; i++)
+            delete[] slots[i].buffer;
+    }
+
+    // stores the chunk of frame, a FRAGMENT frame. On FRAGMENT_RESULT_COMPLETE
+    // message is the whole message, pointing into a slot buffer that stays
+    // valid until the next push().
+    int push(ResponseData *frame, ResponseData *message)
+    {
+        if (frame->size < FRAGMENT_FRAME_HEADER_SIZE)
+            return FRAGMENT_RESULT_INVALID;
+
+        uint8_t msgId;
+        uint16_t seq, count;
+        uint32_t size;
+        FragmentHeader::decode((const uint8_t *)&frame->data[3], msgId, seq, count, size);
+        uchar deviceId = frame->data[2];
+
+        if (size > FRAGMENT_MAX_MESSAGE_SIZE || count > FRAGMENT_MAX_COUNT || !fragmentHeaderValid(size, count) || seq >= count)
+            return FRAGMENT_RESULT_INVALID;
+        uint32_t chunk = frame->size - FRAGMENT_FRAME_HEADER_SIZE;
+        if (chunk != fragmentSize(size, count, seq))
+            return FRAGMENT_RESULT_INVALID;
+
+        bool last = seq == count - 1;
+        Slot *s = find(deviceId, msgId);
+        if (s == nullptr && delivered[deviceId] == msgId + 1)
+            return last ? FRAGMENT_RESULT_DUPLICATE : FRAGMENT_RESULT_NONE;
+
+        // a msgId reused for another message starts over
+        if (s == nullptr || s->size != size || s->count != count)
+        {
+            if (s == nullptr)
+                s = allocate();
+            s->active = true;
+            s->deviceId = deviceId;
+            s->msgId = msgId;
+            s->size = size;
+            s->count = count;
+            s->received = 0;
+            memset(s->bitmap, 0, (count + 7) / 8);
+        }
+        s->lastUsed = ++useCounter;
+        if (!(s->bitmap[seq / 8] & (1 << (seq % 8))))
+        {
+            s->bitmap[seq / 8] |= 1 << (seq % 8);
+            s->received++;
+            memcpy(s->buffer + (uint32_t)seq * fragmentChunkSize(size, count), &frame->data[FRAGMENT_FRAME_HEADER_SIZE], chunk);
+        }
+
+        if (!last)
+            return FRAGMENT_RESULT_NONE;
+        if (s->received < s->count)
+            return FRAGMENT_RESULT_INCOMPLETE;
+
+        s->active = false;
+        delivered[deviceId] = msgId + 1;
+        message->data = s->buffer;
+        message->size = size;
+        message->frameId = frame->frameId;
+        message->frameType = PROTOCOL_FRAME_TYPE_FRAGMENT;
+        message->deviceId = deviceId;
+        return FRAGMENT_RESULT_COMPLETE;
+    }
+};
+
+#endif
@@ -0,0 +1,265 @@
+#include "frame_capture.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <chrono>
+#include <thread>
+
+static int64_t steadyNow_ns()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static uint32_t recordSize(unsigned int frameSize)
+{
+    return (sizeof(FrameRecord) + frameSize + FRAME_CAPTURE_ALIGN - 1) & ~(uint32_t)(FRAME_CAPTURE_ALIGN - 1);
+}
+
+FrameRecorder::FrameRecorder()
+{
+    fd = -1;
+    base = nullptr;
+    header = nullptr;
+    active = false;
+    writers = 0;
+    start_ns = 0;
+}
+
+FrameRecorder::~FrameRecorder()
+{
+    close();
+}
+
+bool FrameRecorder::open(const char *path, uint32_t capacity)
+{
+    std::lock_guard<std::mutex> guard(mtx);
+    closeLocked();
+    if (capacity < sizeof(FrameCaptureHeader) + recordSize(0))
+    {
+        fprintf(stderr, "capture %s: %u bytes is too small\n", path, capacity);
+        return false;
+    }
+
+    int f = ::open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (f < 0)
+    {
+        fprintf(stderr, "unable to create capture %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    if (ftruncate(f, capacity) < 0)
+    {
+        fprintf(stderr, "unable to size capture %s: %s\n", path, strerror(errno));
+        ::close(f);
+        return false;
+    }
+    // populated right away: record() must not take page faults into the kernel
+    void *m = mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, f, 0);
+    if (m == MAP_FAILED)
+    {
+        fprintf(stderr, "unable to map capture %s: %s\n", path, strerror(errno));
+        ::close(f);
+        return false;
+    }
+
+    fd = f;
+    base = (uint8_t *)m;
+    header = (FrameCaptureHeader *)base;
+    header->magic = FRAME_CAPTURE_MAGIC;
+    header->version = FRAME_CAPTURE_VERSION;
+    header->capacity = capacity;
+    header->used = sizeof(FrameCaptureHeader);
+    header->dropped = 0;
+    header->reserved = 0;
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    header->startRealtime_ns = (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    start_ns = steadyNow_ns();
+    active = true;
+    return true;
+}
+
+void FrameRecorder::close()
+{
+    std::lock_guard<std::mutex> guard(mtx);
+    closeLocked();
+}
+
+void FrameRecorder::closeLocked()
+{
+    if (base == nullptr)
+        return;
+
+    active = false;
+    while (writers > 0)
+        std::this_thread::yield();
+
+    uint32_t used = header->used;
+    munmap(base, header->capacity);
+    if (ftruncate(fd, used) < 0)
+        fprintf(stderr, "unable to trim capture: %s\n", strerror(errno));
+    ::close(fd);
+    fd = -1;
+    base = nullptr;
+    header = nullptr;
+}
+
+bool FrameRecorder::isOpen()
+{
+    return active;
+}
+
+void FrameRecorder::record(uint8_t direction, const uchar *frame, unsigned int size)
+{
+    // close() waits for the writers it may have missed, the others see !active
+    writers++;
+    if (!active)
+    {
+        writers--;
+        return;
+    }
+
+    uint32_t len = recordSize(size);
+    uint32_t offset = header->used.load(std::memory_order_relaxed);
+    do
+    {
+        if (size > UINT16_MAX || len > header->capacity - offset)
+        {
+            header->dropped.fetch_add(1, std::memory_order_relaxed);
+            writers--;
+            return;
+        }
+    } while (!header->used.compare_exchange_weak(offset, offset + len, std::memory_order_relaxed));
+
+    FrameRecord *r = (FrameRecord *)(base + offset);
+    r->length.store(len, std::memory_order_relaxed);
+    r->time_ns = steadyNow_ns() - start_ns;
+    r->size = size;
+    r->direction = direction;
+    r->frameId = size > 0 ? frame[0] : 0;
+    r->reserved = 0;
+    memcpy((uint8_t *)(r + 1), frame, size);
+    r->committed.store(FRAME_RECORD_COMMITTED, std::memory_order_release);
+    writers--;
+}
+
+uint32_t FrameRecorder::droppedFrames()
+{
+    std::lock_guard<std::mutex> guard(mtx);
+    return header != nullptr ? header->dropped.load() : 0;
+}
+
+FrameCapture::FrameCapture()
+{
+    fd = -1;
+    base = nullptr;
+    mapped = 0;
+    size = 0;
+    offset = 0;
+}
+
+FrameCapture::~FrameCapture()
+{
+    close();
+}
+
+bool FrameCapture::open(const char *path)
+{
+    close();
+    int f = ::open(path, O_RDONLY | O_CLOEXEC);
+    if (f < 0)
+    {
+        fprintf(stderr, "unable to open capture %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    struct stat st;
+    if (fstat(f, &st) < 0 || (size_t)st.st_size < sizeof(FrameCaptureHeader))
+    {
+        fprintf(stderr, "capture %s is too short\n", path);
+        ::close(f);
+        return false;
+    }
+    void *m = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, f, 0);
+    if (m == MAP_FAILED)
+    {
+        fprintf(stderr, "unable to map capture %s: %s\n", path, strerror(errno));
+        ::close(f);
+        return false;
+    }
+
+    const FrameCaptureHeader *h = (const FrameCaptureHeader *)m;
+    if (h->magic != FRAME_CAPTURE_MAGIC || h->version != FRAME_CAPTURE_VERSION)
+    {
+        fprintf(stderr, "%s is not a capture file\n", path);
+        munmap(m, st.st_size);
+        ::close(f);
+        return false;
+    }
+
+    fd = f;
+    base = (const uint8_t *)m;
+    mapped = st.st_size;
+    // a recording that was cut short keeps its full capacity on disk
+    size = (uint32_t)st.st_size;
+    if (h->used.load() < size)
+        size = h->used.load();
+    offset = sizeof(FrameCaptureHeader);
+    return true;
+}
+
+void FrameCapture::close()
+{
+    if (base == nullptr)
+        return;
+    munmap((void *)base, mapped);
+    ::close(fd);
+    fd = -1;
+    base = nullptr;
+    mapped = 0;
+    size = 0;
+    offset = 0;
+}
+
+bool FrameCapture::isOpen()
+{
+    return base != nullptr;
+}
+
+bool FrameCapture::next(FrameCaptureEntry &entry)
+{
+    while (base != nullptr && size - offset >= sizeof(FrameRecord))
+    {
+        // a length that can't be a record's means its writer never got to store
+        // it, nothing after it can be found
+        const FrameRecord *r = (const FrameRecord *)(base + offset);
+        uint32_t len = r->length.load(std::memory_order_relaxed);
+        if (len < recordSize(0) || len % FRAME_CAPTURE_ALIGN != 0 || len > size - offset)
+            return false;
+        offset += len;
+
+        if (r->committed.load(std::memory_order_acquire) != FRAME_RECORD_COMMITTED || recordSize(r->size) != len)
+            continue;
+        entry.time_ns = r->time_ns;
+        entry.direction = r->direction;
+        entry.frameId = r->frameId;
+        entry.data = (const uchar *)(r + 1);
+        entry.size = r->size;
+        return true;
+    }
+    return false;
+}
+
+void FrameCapture::rewind()
+{
+    offset = sizeof(FrameCaptureHeader);
+}
+
+uint32_t FrameCapture::droppedFrames()
+{
+    return base != nullptr ? ((const FrameCaptureHeader *)base)->dropped.load() : 0;
+}
@@ -0,0 +1,122 @@
+#ifndef _FRAME_CAPTURE_H
+#define _FRAME_CAPTURE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+#include <mutex>
+
+#include "comm_types.h"
+
+// Capture files of the frames a SerialLink sent and received, written by
+// FrameRecorder and read back by FrameCapture (e.g. by ReplayCommunication).
+// A FrameCaptureHeader followed by records, each a FrameRecord, the frame body
+// as handed to / by the ISerialCommunication (no escaping, no CRC) and padding
+// up to FRAME_CAPTURE_ALIGN. A record's length is stored as soon as its bytes
+// are reserved, so a reader steps over one that was never committed. Host byte
+// order: captures are read on the machine type that wrote them.
+
+#define FRAME_CAPTURE_MAGIC 0x50414346 // "FCAP"
+#define FRAME_CAPTURE_VERSION 2
+#define FRAME_CAPTURE_ALIGN 8
+#define FRAME_CAPTURE_DEFAULT_SIZE (16u << 20)
+
+#define FRAME_DIRECTION_RX 0
+#define FRAME_DIRECTION_TX 1
+
+typedef struct FrameCaptureHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t capacity;           // bytes of the file, header included
+    std::atomic<uint32_t> used;  // bytes reserved by records, header included
+    std::atomic<uint32_t> dropped; // frames that didn't fit anymore
+    uint32_t reserved;
+    int64_t startRealtime_ns;    // CLOCK_REALTIME when recording started, to match logs
+} FrameCaptureHeader;
+
+typedef struct FrameRecord
+{
+    std::atomic<uint32_t> length;    // bytes of the record, padding included, written first
+    std::atomic<uint32_t> committed; // FRAME_RECORD_COMMITTED once the frame is written
+    uint64_t time_ns;            // steady clock since recording started
+    uint16_t size;
+    uint8_t direction;           // FRAME_DIRECTION_RX or FRAME_DIRECTION_TX
+    uint8_t frameId;
+    uint32_t reserved;
+} FrameRecord;
+
+#define FRAME_RECORD_COMMITTED 0x52434d54
+
+static_assert(sizeof(FrameCaptureHeader) % FRAME_CAPTURE_ALIGN == 0, "records must stay aligned");
+static_assert(sizeof(FrameRecord) % FRAME_CAPTURE_ALIGN == 0, "records must stay aligned");
+
+// Appends frames to a capture file mapped into memory. open() sizes the file
+// and faults its pages in, so record() neither allocates nor makes a syscall:
+// it reserves its bytes with an atomic add and copies the frame, any number of
+// threads may call it at once. Frames arriving once the file is full are only
+// counted. A record is valid once committed, one a crash interrupted is
+// skipped when reading.
+class FrameRecorder
+{
+private:
+    int fd;
+    uint8_t *base;
+    FrameCaptureHeader *header;
+    std::atomic<bool> active;
+    std::atomic<int> writers; // record() calls close() waits for
+    int64_t start_ns;
+    std::mutex mtx;           // open() against close(), record() doesn't take it
+
+    void closeLocked();
+
+public:
+    FrameRecorder();
+    ~FrameRecorder();
+
+    // creates or truncates path and maps capacity bytes of it, printing why
+    // when it fails. A capture already open is closed first.
+    bool open(const char *path, uint32_t capacity = FRAME_CAPTURE_DEFAULT_SIZE);
+    // stops recording and trims the file to the records written
+    void close();
+    bool isOpen();
+
+    void record(uint8_t direction, const uchar *frame, unsigned int size);
+    uint32_t droppedFrames();
+};
+
+typedef struct FrameCaptureEntry
+{
+    uint64_t time_ns;
+    uint8_t direction;
+    uint8_t frameId;
+    const uchar *data;
+    unsigned int size;
+} FrameCaptureEntry;
+
+// Read-only mapping of a capture file, walked record by record with next().
+class FrameCapture
+{
+private:
+    int fd;
+    const uint8_t *base;
+    size_t mapped;
+    uint32_t size;  // bytes holding records, header included
+    uint32_t offset;
+
+public:
+    FrameCapture();
+    ~FrameCapture();
+
+    // maps path, printing why when it isn't a capture file
+    bool open(const char *path);
+    void close();
+    bool isOpen();
+
+    // the next committed record, false at the end of the capture
+    bool next(FrameCaptureEntry &entry);
+    void rewind();
+    uint32_t droppedFrames();
+};
+
+#endif
@@ -0,0 +1,314 @@
+#ifndef _HANDLER_REGISTRY_H
+#define _HANDLER_REGISTRY_H
+
+#include "comm_types.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <functional>
+#include <new>
+
+// one dispatch entry per possible deviceId
+#define HANDLER_TABLE_SIZE 256
+
+// a reader thread that isn't dispatching and may hold no list
+#define READER_EPOCH_IDLE 0
+
+typedef struct SerialLinkResponseCallback
+{
+    uchar id;
+    std::function<void(ResponseData *)> callback;
+} SerialLinkResponseCallback;
+
+// handlers registered for one deviceId. The entries are stored inline right
+// after the count, in the same allocation, so dispatching a frame is one
+// indexed load plus a walk over a contiguous array. A list is sized for its
+// handlers when it is built and never modified once published.
+struct alignas(SerialLinkResponseCallback) HandlerList
+{
+    unsigned int count;
+
+    SerialLinkResponseCallback *entries()
+    {
+        return reinterpret_cast<SerialLinkResponseCallback *>(this + 1);
+    }
+
+    // an empty list with room for capacity handlers
+    static HandlerList *create(unsigned int capacity)
+    {
+        void *p = ::operator new(sizeof(HandlerList) + capacity * sizeof(SerialLinkResponseCallback));
+        HandlerList *list = new (p) HandlerList();
+        list->count = 0;
+        return list;
+    }
+
+    // appends a copy of rc, the list must have room for it
+    void append(const SerialLinkResponseCallback &rc)
+    {
+        new (&entries()[count]) SerialLinkResponseCallback(rc);
+        count++;
+    }
+
+    static void destroy(HandlerList *list)
+    {
+        if (list == nullptr)
+            return;
+        for (unsigned int i = 0; i < list->count; i++)
+            list->entries()[i].~SerialLinkResponseCallback();
+        list->~HandlerList();
+        ::operator delete(list);
+    }
+};
+
+// Quiescent state based reclamation for the lists HandlerRegistry replaces.
+// Every thread that dispatches gets its own epoch record, registered the first
+// time it dispatches and dropped when it exits. After each dispatch the thread
+// copies the global epoch into its record: it holds no list any more. A list
+// retired at epoch E can be freed once every record is idle or at E or later.
+// Dispatching is an acquire load of the global epoch and a release store to the
+// thread's own record, no read-modify-write on shared memory. A thread calls
+// idle() before it blocks, so it doesn't hold back reclamation while it waits.
+class ReaderEpochs
+{
+private:
+    typedef struct Record
+    {
+        std::atomic<uint64_t> epoch;
+        Record *next;
+    } Record;
+
+    // the calling thread's record, linked into the registered ones while the
+    // thread runs
+    struct ThreadRecord
+    {
+        Record record;
+
+        ThreadRecord()
+        {
+            record.epoch = READER_EPOCH_IDLE;
+            std::lock_guard<std::mutex> guard(recordsMtx);
+            record.next = records;
+            records = &record;
+        }
+
+        ~ThreadRecord()
+        {
+            std::lock_guard<std::mutex> guard(recordsMtx);
+            for (Record **r = &records; *r != nullptr; r = &(*r)->next)
+            {
+                if (*r == &record)
+                {
+                    *r = record.next;
+                    break;
+                }
+            }
+        }
+    };
+
+    static inline std::atomic<uint64_t> globalEpoch{READER_EPOCH_IDLE + 1};
+    static inline std::mutex recordsMtx;
+    static inline Record *records = nullptr;
+
+    static Record &self()
+    {
+        static thread_local ThreadRecord thread;
+        return thread.record;
+    }
+
+public:
+    // before the calling thread loads a list. Only does something when the
+    // thread was idle: the seq_cst store orders its record before the loads
+    // that follow, against a writer that scans the records after swapping a list.
+    static void enter()
+    {
+        Record &r = self();
+        if (r.epoch.load(std::memory_order_relaxed) == READER_EPOCH_IDLE)
+            r.epoch.store(globalEpoch.load());
+    }
+
+    // the calling thread is done with every list it loaded
+    static void quiescent()
+    {
+        self().epoch.store(globalEpoch.load(std::memory_order_acquire), std::memory_order_release);
+    }
+
+    // the calling thread is about to block and holds no list until its next enter()
+    static void idle()
+    {
+        self().epoch.store(READER_EPOCH_IDLE, std::memory_order_release);
+    }
+
+    // writer side, after a list was swapped out: the epoch it is retired at
+    static uint64_t retire()
+    {
+        return globalEpoch.fetch_add(1) + 1;
+    }
+
+    // writer side: lists retired at this epoch or before are unreachable
+    static uint64_t safeEpoch()
+    {
+        uint64_t safe = globalEpoch.load();
+        std::lock_guard<std::mutex> guard(recordsMtx);
+        for (Record *r = records; r != nullptr; r = r->next)
+        {
+            uint64_t e = r->epoch.load();
+            if (e != READER_EPOCH_IDLE && e < safe)
+                safe = e;
+        }
+        return safe;
+    }
+};
+
+// Copy-on-write handler table. dispatch() reads the current list of a deviceId
+// without taking any lock. Writers are serialised among themselves, build a new
+// list and swap it in. The list it replaces is retired and freed by a later
+// write once every dispatching thread went past it (see ReaderEpochs), so a
+// reader never sees a list being changed or freed. Writers never wait for
+// readers, handlers may add or remove handlers from inside their callback.
+class HandlerRegistry
+{
+private:
+    typedef struct RetiredList
+    {
+        HandlerList *list;
+        uint64_t epoch;
+    } RetiredList;
+
+    std::atomic<HandlerList *> table[HANDLER_TABLE_SIZE];
+    std::mutex writeMtx;
+    std::vector<RetiredList> retired;
+
+    // writeMtx must be held
+    void publish(uchar deviceId, HandlerList *list)
+    {
+        HandlerList *old = table[deviceId].exchange(list);
+        if (old != nullptr)
+            retired.push_back({old, ReaderEpochs::retire()});
+        reclaim();
+    }
+
+    // writeMtx must be held. Frees the retired lists no reader can still hold.
+    void reclaim()
+    {
+        if (retired.empty())
+            return;
+        uint64_t safe = ReaderEpochs::safeEpoch();
+        size_t kept = 0;
+        for (auto &r : retired)
+        {
+            if (r.epoch <= safe)
+                HandlerList::destroy(r.list);
+            else
+                retired[kept++] = r;
+        }
+        retired.resize(kept);
+    }
+
+public:
+    HandlerRegistry()
+    {
+        for (int i = 0; i < HANDLER_TABLE_SIZE; i++)
+            table[i] = nullptr;
+    }
+
+    // no dispatch() may be running any more
+    ~HandlerRegistry()
+    {
+        for (int i = 0; i < HANDLER_TABLE_SIZE; i++)
+            HandlerList::destroy(table[i].load());
+        for (auto &r : retired)
+            HandlerList::destroy(r.list);
+    }
+
+    void add(uchar deviceId, uchar handlerId, std::function<void(ResponseData *)> &func)
+    {
+        std::lock_guard<std::mutex> guard(writeMtx);
+        HandlerList *current = table[deviceId].load();
+        unsigned int count = current != nullptr ? current->count : 0;
+
+        HandlerList *list = HandlerList::create(count + 1);
+        for (unsigned int i = 0; i < count; i++)
+            list->append(current->entries()[i]);
+        SerialLinkResponseCallback rc;
+        rc.id = handlerId;
+        rc.callback = func;
+        list->append(rc);
+        publish(deviceId, list);
+    }
+
+    void remove(uchar deviceId, uchar handlerId)
+    {
+        std::lock_guard<std::mutex> guard(writeMtx);
+        HandlerList *current = table[deviceId].load();
+        if (current == nullptr)
+            return;
+
+        unsigned int found = current->count;
+        for (unsigned int i = 0; i < current->count && found == current->count; i++)
+        {
+            if (current->entries()[i].id == handlerId)
+                found = i;
+        }
+        if (found == current->count)
+            return;
+
+        // keep the entries contiguous and in registration order
+        HandlerList *list = nullptr;
+        if (current->count > 1)
+        {
+            list = HandlerList::create(current->count - 1);
+            for (unsigned int i = 0; i < current->count; i++)
+                if (i != found)
+                    list->append(current->entries()[i]);
+        }
+        publish(deviceId, list);
+    }
+
+    bool contains(uchar deviceId, uchar handlerId)
+    {
+        std::lock_guard<std::mutex> guard(writeMtx);
+        HandlerList *list = table[deviceId].load();
+        if (list == nullptr)
+            return false;
+
+        for (unsigned int i = 0; i < list->count; i++)
+        {
+            if (list->entries()[i].id == handlerId)
+                return true;
+        }
+        return false;
+    }
+
+    void clear()
+    {
+        std::lock_guard<std::mutex> guard(writeMtx);
+        for (int i = 0; i < HANDLER_TABLE_SIZE; i++)
+        {
+            HandlerList *old = table[i].exchange(nullptr);
+            if (old != nullptr)
+                retired.push_back({old, ReaderEpochs::retire()});
+        }
+        reclaim();
+    }
+
+    // calls every handler of msg->deviceId. Never blocks.
+    void dispatch(ResponseData *msg)
+    {
+        ReaderEpochs::enter();
+        HandlerList *list = table[msg->deviceId].load(std::memory_order_acquire);
+        if (list != nullptr)
+        {
+#ifdef DEBUG
+            printf("found %d handlers for deviceId = %d\n", list->count, msg->deviceId);
+#endif
+            SerialLinkResponseCallback *entries = list->entries();
+            for (unsigned int i = 0; i < list->count; i++)
+                entries[i].callback(msg);
+        }
+        ReaderEpochs::quiescent();
+    }
+};
+
+#endif
@@ -0,0 +1,249 @@
+#ifndef _LINK_METRICS_H
+#define _LINK_METRICS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <atomic>
+#include <string>
+
+// counters are split in shards so the threads of a link (receive, timer,
+// dispatch workers, callers) don't bounce the same cache line around
+#define METRIC_COUNTER_SHARDS 8
+
+// log-linear histogram: one group per power of two, each split in
+// 2^METRIC_HISTOGRAM_SUB_BITS linear buckets, i.e. about 25% resolution
+#define METRIC_HISTOGRAM_SUB_BITS 2
+#define METRIC_HISTOGRAM_GROUPS 32
+#define METRIC_HISTOGRAM_BUCKETS (METRIC_HISTOGRAM_GROUPS << METRIC_HISTOGRAM_SUB_BITS)
+
+static inline unsigned int metricShard()
+{
+    static std::atomic<unsigned int> nextShard(0);
+    thread_local unsigned int shard = nextShard.fetch_add(1, std::memory_order_relaxed) % METRIC_COUNTER_SHARDS;
+    return shard;
+}
+
+class MetricCounter
+{
+private:
+    struct alignas(64) Shard
+    {
+        std::atomic<uint64_t> value;
+    };
+    Shard shards[METRIC_COUNTER_SHARDS];
+
+public:
+    MetricCounter()
+    {
+        for (int i = 0; i < METRIC_COUNTER_SHARDS; i++)
+            shards[i].value = 0;
+    }
+
+    void add(uint64_t n = 1)
+    {
+        shards[metricShard()].value.fetch_add(n, std::memory_order_relaxed);
+    }
+
+    uint64_t read()
+    {
+        uint64_t sum = 0;
+        for (int i = 0; i < METRIC_COUNTER_SHARDS; i++)
+            sum += shards[i].value.load(std::memory_order_relaxed);
+        return sum;
+    }
+};
+
+typedef struct MetricHistogramSnapshot
+{
+    uint64_t count;
+    uint64_t sum;
+    uint64_t buckets[METRIC_HISTOGRAM_BUCKETS];
+
+    // upper bound of the bucket holding the q-quantile (0 <= q <= 1), 0 when empty
+    uint64_t quantile(double q) const;
+} MetricHistogramSnapshot;
+
+class MetricHistogram
+{
+private:
+    std::atomic<uint64_t> buckets[METRIC_HISTOGRAM_BUCKETS];
+    std::atomic<uint64_t> count;
+    std::atomic<uint64_t> sum;
+
+public:
+    static unsigned int bucketOf(uint64_t value)
+    {
+        const unsigned int sub = 1 << METRIC_HISTOGRAM_SUB_BITS;
+        if (value < sub)
+            return value;
+
+        unsigned int msb = 63 - __builtin_clzll(value);
+        unsigned int group = msb - METRIC_HISTOGRAM_SUB_BITS + 1;
+        if (group >= METRIC_HISTOGRAM_GROUPS)
+            return METRIC_HISTOGRAM_BUCKETS - 1;
+        unsigned int offset = (value >> (msb - METRIC_HISTOGRAM_SUB_BITS)) & (sub - 1);
+        return (group << METRIC_HISTOGRAM_SUB_BITS) + offset;
+    }
+
+    // largest value that falls in bucket
+    static uint64_t bucketLimit(unsigned int bucket)
+    {
+        const unsigned int sub = 1 << METRIC_HISTOGRAM_SUB_BITS;
+        if (bucket < sub)
+            return bucket;
+
+        unsigned int group = bucket >> METRIC_HISTOGRAM_SUB_BITS;
+        unsigned int offset = bucket & (sub - 1);
+        unsigned int shift = group - 1;
+        return ((uint64_t)(sub + offset + 1) << shift) - 1;
+    }
+
+    MetricHistogram()
+    {
+        for (int i = 0; i < METRIC_HISTOGRAM_BUCKETS; i++)
+            buckets[i] = 0;
+        count = 0;
+        sum = 0;
+    }
+
+    void record(uint64_t value)
+    {
+        buckets[bucketOf(value)].fetch_add(1, std::memory_order_relaxed);
+        count.fetch_add(1, std::memory_order_relaxed);
+        sum.fetch_add(value, std::memory_order_relaxed);
+    }
+
+    void snapshot(MetricHistogramSnapshot &s)
+    {
+        for (int i = 0; i < METRIC_HISTOGRAM_BUCKETS; i++)
+            s.buckets[i] = buckets[i].load(std::memory_order_relaxed);
+        s.count = count.load(std::memory_order_relaxed);
+        s.sum = sum.load(std::memory_order_relaxed);
+    }
+};
+
+inline uint64_t MetricHistogramSnapshot::quantile(double q) const
+{
+    uint64_t total = 0;
+    for (int i = 0; i < METRIC_HISTOGRAM_BUCKETS; i++)
+        total += buckets[i];
+    if (total == 0)
+        return 0;
+
+    uint64_t rank = (uint64_t)(q * (total - 1)) + 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < METRIC_HISTOGRAM_BUCKETS; i++)
+    {
+        seen += buckets[i];
+        if (seen >= rank)
+            return MetricHistogram::bucketLimit(i);
+    }
+    return MetricHistogram::bucketLimit(METRIC_HISTOGRAM_BUCKETS - 1);
+}
+
+typedef struct LinkMetricsSnapshot
+{
+    uint64_t framesSent;
+    uint64_t bytesSent;
+    uint64_t framesReceived;
+    uint64_t bytesReceived;
+    uint64_t invalidFrames; // too large for the receive buffer
+    uint64_t crcErrors;
+    uint64_t droppedFrames; // received fine but no pooled buffer or dispatch slot left
+    uint64_t retransmits;
+    uint64_t ackTimeouts;
+    uint64_t nacksReceived;
+    uint64_t requestTimeouts; // requests that gave up without an ACK
+    uint64_t txDropped;       // frames posted while every TxScheduler copy was queued
+    MetricHistogramSnapshot ackRtt_us;
+    MetricHistogramSnapshot dispatchWait_us; // frame received to handlers started
+    MetricHistogramSnapshot handlerTime_us;
+    MetricHistogramSnapshot controlTxWait_us; // control frame queued to written, see TxScheduler
+} LinkMetricsSnapshot;
+
+// Counters and histograms of one link, updated with relaxed atomics on the hot
+// paths and only summed up when someone asks for a snapshot.
+class LinkMetrics
+{
+public:
+    MetricCounter framesSent;
+    MetricCounter bytesSent;
+    MetricCounter framesReceived;
+    MetricCounter bytesReceived;
+    MetricCounter invalidFrames;
+    MetricCounter crcErrors;
+    MetricCounter droppedFrames;
+    MetricCounter retransmits;
+    MetricCounter ackTimeouts;
+    MetricCounter nacksReceived;
+    MetricCounter requestTimeouts;
+    MetricCounter txDropped;
+    MetricHistogram ackRtt_us;
+    MetricHistogram dispatchWait_us;
+    MetricHistogram handlerTime_us;
+    MetricHistogram controlTxWait_us;
+
+    void snapshot(LinkMetricsSnapshot &s)
+    {
+        s.framesSent = framesSent.read();
+        s.bytesSent = bytesSent.read();
+        s.framesReceived = framesReceived.read();
+        s.bytesReceived = bytesReceived.read();
+        s.invalidFrames = invalidFrames.read();
+        s.crcErrors = crcErrors.read();
+        s.droppedFrames = droppedFrames.read();
+        s.retransmits = retransmits.read();
+        s.ackTimeouts = ackTimeouts.read();
+        s.nacksReceived = nacksReceived.read();
+        s.requestTimeouts = requestTimeouts.read();
+        s.txDropped = txDropped.read();
+        ackRtt_us.snapshot(s.ackRtt_us);
+        dispatchWait_us.snapshot(s.dispatchWait_us);
+        handlerTime_us.snapshot(s.handlerTime_us);
+        controlTxWait_us.snapshot(s.controlTxWait_us);
+    }
+
+    // plain text, one "prefix_name value" per line. Histograms give their count,
+    // sum and p50/p90/p99/max bucket bounds.
+    static std::string format(const LinkMetricsSnapshot &s, const char *prefix)
+    {
+        std::string out;
+        char line[160];
+
+#define METRIC_LINE(name, value)                                                                 \
+    do                                                                                           \
+    {                                                                                            \
+        snprintf(line, sizeof(line), "%s_%s %llu\n", prefix, name, (unsigned long long)(value)); \
+        out += line;                                                                             \
+    } while (0)
+
+        METRIC_LINE("frames_sent", s.framesSent);
+        METRIC_LINE("bytes_sent", s.bytesSent);
+        METRIC_LINE("frames_received", s.framesReceived);
+        METRIC_LINE("bytes_received", s.bytesReceived);
+        METRIC_LINE("invalid_frames", s.invalidFrames);
+        METRIC_LINE("crc_errors", s.crcErrors);
+        METRIC_LINE("dropped_frames", s.droppedFrames);
+        METRIC_LINE("retransmits", s.retransmits);
+        METRIC_LINE("ack_timeouts", s.ackTimeouts);
+        METRIC_LINE("nacks_received", s.nacksReceived);
+        METRIC_LINE("request_timeouts", s.requestTimeouts);
+        METRIC_LINE("tx_dropped", s.txDropped);
+
+        const char *names[4] = {"ack_rtt_us", "dispatch_wait_us", "handler_time_us", "control_tx_wait_us"};
+        const MetricHistogramSnapshot *histograms[4] = {&s.ackRtt_us, &s.dispatchWait_us, &s.handlerTime_us, &s.controlTxWait_us};
+        for (int i = 0; i < 4; i++)
+        {
+            const MetricHistogramSnapshot &h = *histograms[i];
+            snprintf(line, sizeof(line), "%s_%s count=%llu sum=%llu p50=%llu p90=%llu p99=%llu max=%llu\n",
+                     prefix, names[i], (unsigned long long)h.count, (unsigned long long)h.sum,
+                     (unsigned long long)h.quantile(0.5), (unsigned long long)h.quantile(0.9),
+                     (unsigned long long)h.quantile(0.99), (unsigned long long)h.quantile(1.0));
+            out += line;
+        }
+#undef METRIC_LINE
+        return out;
+    }
+};
+
+#endif
@@ -0,0 +1,208 @@
+#include "replay_comm.h"
+
+ReplayCommunication::ReplayCommunication(const char *path, bool paced)
+{
+    this->paced = paced;
+    rcvBufferSize = 0;
+    sndBufferSize = 0;
+    metrics = nullptr;
+    firstFrame_ns = 0;
+    running = false;
+    started = false;
+    hasPending = false;
+    finished = false;
+    replayed = 0;
+    capture.open(path);
+}
+
+bool ReplayCommunication::isOpen()
+{
+    return capture.isOpen();
+}
+
+bool ReplayCommunication::isFinished()
+{
+    return finished;
+}
+
+unsigned long ReplayCommunication::replayedFrames()
+{
+    return replayed;
+}
+
+void ReplayCommunication::start()
+{
+    std::lock_guard<std::mutex> guard(replayMtx);
+    capture.rewind();
+    started = false;
+    finished = false;
+    hasPending = false;
+    replayed = 0;
+    firstFrame_ns = 0;
+    running = true;
+}
+
+// replayMtx must be held. The next frame the link received, skipping the ones
+// it sent.
+bool ReplayCommunication::nextReceived(FrameCaptureEntry &entry)
+{
+    if (hasPending)
+    {
+        entry = pending;
+        hasPending = false;
+        return true;
+    }
+    while (capture.next(entry))
+    {
+        if (entry.direction == FRAME_DIRECTION_RX && entry.size <= RCV_BUFFER_SIZE)
+            return true;
+    }
+    finished = true;
+    return false;
+}
+
+int ReplayCommunication::readByte()
+{
+    return -1;
+}
+
+void ReplayCommunication::clearReceiveBuffer()
+{
+    rcvBufferSize = 0;
+}
+
+bool ReplayCommunication::receiveData()
+{
+    if (rcvBufferSize > 0)
+        return false;
+
+    // a paced frame due within SERIAL_WAIT_DELAY_ms is waited for with the lock
+    // held, a start() meanwhile waits that long at most
+    std::lock_guard<std::mutex> guard(replayMtx);
+    if (!running || finished)
+        return false;
+
+    FrameCaptureEntry entry;
+    if (!nextReceived(entry))
+        return false;
+
+    if (!started)
+    {
+        started = true;
+        startedAt = std::chrono::steady_clock::now();
+        firstFrame_ns = entry.time_ns;
+    }
+    if (paced)
+    {
+        // a short wait is slept here, a longer one left to the link's polling
+        // so that it still notices being shut down
+        auto due = startedAt + std::chrono::nanoseconds(entry.time_ns - firstFrame_ns);
+        if (due > std::chrono::steady_clock::now() + std::chrono::milliseconds(SERIAL_WAIT_DELAY_ms))
+        {
+            pending = entry;
+            hasPending = true;
+            return false;
+        }
+        std::this_thread::sleep_until(due);
+    }
+
+    memcpy(rcvBuffer, entry.data, entry.size);
+    rcvBufferSize = entry.size;
+    replayed++;
+    if (metrics)
+    {
+        metrics->framesReceived.add();
+        metrics->bytesReceived.add(entry.size);
+    }
+    return true;
+}
+
+void ReplayCommunication::sendData()
+{
+    if (sndBufferSize > 0 && metrics)
+    {
+        metrics->framesSent.add();
+        metrics->bytesSent.add(sndBufferSize);
+    }
+    sndBufferSize = 0;
+}
+
+bool ReplayCommunication::hasData()
+{
+    return rcvBufferSize > 0;
+}
+
+char ReplayCommunication::read(unsigned int pos)
+{
+    return rcvBuffer[pos];
+}
+
+float ReplayCommunication::readF(unsigned int pos)
+{
+    return WireField<float>::decode(&rcvBuffer[pos]);
+}
+
+uint16_t ReplayCommunication::readInt16(unsigned int pos)
+{
+    return WireField<uint16_t>::decode(&rcvBuffer[pos]);
+}
+
+void ReplayCommunication::writeInt16(uint16_t val)
+{
+    uint8_t p[2];
+    WireField<uint16_t>::encode(p, val);
+    write(p[0]);
+    write(p[1]);
+}
+
+void ReplayCommunication::write(unsigned char val)
+{
+    if (sndBufferSize >= SND_BUFFER_SIZE)
+        return;
+    sndBuffer[sndBufferSize++] = val;
+}
+
+char *ReplayCommunication::copy()
+{
+    char *p = (char *)malloc(sizeof(char) * (rcvBufferSize + 1));
+    memcpy(p, rcvBuffer, rcvBufferSize);
+    p[rcvBufferSize] = 0;
+    return p;
+}
+
+unsigned int ReplayCommunication::copyTo(char *dst, unsigned int capacity)
+{
+    unsigned int size = rcvBufferSize < capacity ? rcvBufferSize : capacity;
+    memcpy(dst, rcvBuffer, size);
+    return size;
+}
+
+unsigned int ReplayCommunication::receivedDataSize()
+{
+    return rcvBufferSize;
+}
+
+unsigned int ReplayCommunication::sendDataSize()
+{
+    return sndBufferSize;
+}
+
+void ReplayCommunication::clearRcv()
+{
+    rcvBufferSize = 0;
+}
+
+void ReplayCommunication::clearSnd()
+{
+    sndBufferSize = 0;
+}
+
+int ReplayCommunication::fileDescriptor()
+{
+    return -1;
+}
+
+void ReplayCommunication::setMetrics(LinkMetrics *metrics)
+{
+    this->metrics = metrics;
+}
@@ -0,0 +1,78 @@
+#ifndef _REPLAY_COMM_H
+#define _REPLAY_COMM_H
+
+#include <chrono>
+#include <atomic>
+#include <mutex>
+
+#include "serial_comm_pi.h"
+#include "frame_capture.h"
+
+// An ISerialCommunication that plays back the frames a link received, from a
+// capture file recorded with SerialLink::startRecording(). A SerialLink on top
+// of it runs them through processData() and the handlers like frames off the
+// port: either as fast as the link takes them, or paced at the recorded
+// timing. Frames the link sends are counted and dropped. It has no file
+// descriptor, the link polls it. Nothing is replayed before start(), so the
+// handlers can be added to the link first.
+class ReplayCommunication : public ISerialCommunication
+{
+private:
+    bool paced;
+    // guards the replay position below: start() may rewind it from another
+    // thread while the link's receive thread replays
+    std::mutex replayMtx;
+    FrameCapture capture;
+    // the steady clock time the first frame is replayed at, and its recorded time
+    std::chrono::steady_clock::time_point startedAt;
+    uint64_t firstFrame_ns;
+    bool running;
+    bool started;
+    std::atomic<bool> finished;
+    std::atomic<unsigned long> replayed;
+
+    FrameCaptureEntry pending; // next frame, read ahead when paced
+    bool hasPending;
+
+    unsigned char rcvBuffer[RCV_BUFFER_SIZE];
+    unsigned char sndBuffer[SND_BUFFER_SIZE];
+    unsigned int rcvBufferSize;
+    unsigned int sndBufferSize;
+
+    LinkMetrics *metrics;
+
+    bool nextReceived(FrameCaptureEntry &entry);
+
+public:
+    // plays path back as fast as possible, or at the recorded timing when paced
+    ReplayCommunication(const char *path, bool paced = false);
+
+    bool isOpen();
+    // every received frame of the capture was handed out
+    bool isFinished();
+    unsigned long replayedFrames();
+    // replays from the first frame on, again after isFinished(). May be called
+    // while the link is running.
+    void start();
+
+    int readByte() override;
+    void clearReceiveBuffer() override;
+    bool receiveData() override;
+    void sendData() override;
+    bool hasData() override;
+    char read(unsigned int pos) override;
+    float readF(unsigned int pos) override;
+    uint16_t readInt16(unsigned int pos) override;
+    void writeInt16(uint16_t val) override;
+    void write(unsigned char val) override;
+    char *copy() override;
+    unsigned int copyTo(char *dst, unsigned int capacity) override;
+    unsigned int receivedDataSize() override;
+    unsigned int sendDataSize() override;
+    void clearRcv() override;
+    void clearSnd() override;
+    int fileDescriptor() override;
+    void setMetrics(LinkMetrics *metrics) override;
+};
+
+#endif
@@ -0,0 +1,93 @@
+#ifndef _RESPONSE_POOL_H
+#define _RESPONSE_POOL_H
+
+#include "serial_comm_pi.h"
+#include "comm_types.h"
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+#define RESPONSE_POOL_SIZE 64
+
+// a ResponseData that carries its own frame storage, so receiving a frame
+// doesn't need to allocate anything. refs counts the holders of the frame and of
+// the views into it, the last unref() gives it back to the pool.
+class PooledResponseData : public ResponseData
+{
+public:
+    char storage[RCV_BUFFER_SIZE + 1];
+    std::atomic<int> refs;
+    PooledResponseData *nextFree;
+};
+
+// Fixed set of PooledResponseData recycled through a free list. acquire()
+// returns nullptr when every entry is in use, the caller decides whether to
+// drop the frame or wait.
+class ResponseDataPool
+{
+private:
+    PooledResponseData entries[RESPONSE_POOL_SIZE];
+    PooledResponseData *freeList;
+    unsigned int inUse;
+    std::mutex mtx;
+    std::condition_variable idleCv;
+
+public:
+    ResponseDataPool()
+    {
+        freeList = nullptr;
+        inUse = 0;
+        for (int i = RESPONSE_POOL_SIZE - 1; i >= 0; i--)
+        {
+            entries[i].data = entries[i].storage;
+            entries[i].size = 0;
+            entries[i].nextFree = freeList;
+            freeList = &entries[i];
+        }
+    }
+
+    // the returned entry holds one reference
+    PooledResponseData *acquire()
+    {
+        std::lock_guard<std::mutex> guard(mtx);
+        PooledResponseData *p = freeList;
+        if (p != nullptr)
+        {
+            freeList = p->nextFree;
+            p->refs = 1;
+            inUse++;
+        }
+        return p;
+    }
+
+    void ref(PooledResponseData *p)
+    {
+        p->refs.fetch_add(1);
+    }
+
+    void unref(PooledResponseData *p)
+    {
+        if (p->refs.fetch_sub(1) == 1)
+            release(p);
+    }
+
+    void release(PooledResponseData *p)
+    {
+        std::lock_guard<std::mutex> guard(mtx);
+        p->data = p->storage;
+        p->size = 0;
+        p->nextFree = freeList;
+        freeList = p;
+        if (--inUse == 0)
+            idleCv.notify_all();
+    }
+
+    // returns once every entry is back in the pool, i.e. no handler still holds a frame
+    void waitIdle()
+    {
+        std::unique_lock<std::mutex> lk(mtx);
+        idleCv.wait(lk, [this] { return inUse == 0; });
+    }
+};
+
+#endif
@@ -0,0 +1,135 @@
+#ifndef _RTT_ESTIMATOR_H
+#define _RTT_ESTIMATOR_H
+
+#include <stdint.h>
+#include <mutex>
+
+#include "comm_types.h"
+
+#define RTT_DEVICE_COUNT 256
+// retransmission timeout bounds and the timeout used before the first sample
+#define RTO_MIN_ms 5
+#define RTO_MAX_ms 1000
+#define RTO_INITIAL_ms 100
+// the clock granularity G of RFC 6298: our timers tick every millisecond
+#define RTO_GRANULARITY_us 1000
+
+typedef struct RttStats
+{
+    uint32_t srtt_us;   // smoothed round-trip time
+    uint32_t rttvar_us; // round-trip time variation
+    uint32_t rto_us;    // retransmission timeout currently in use
+    uint32_t samples;
+} RttStats;
+
+// Jacobson/Karels round-trip estimation (RFC 6298): srtt and rttvar follow the
+// measured ACK delays with gains 1/8 and 1/4, rto = srtt + max(G, 4 * rttvar)
+// clamped to [RTO_MIN_ms, RTO_MAX_ms]. Kept for the link as a whole and per
+// deviceId, a device without samples of its own uses the link estimate.
+// Callers only sample frames that were not retransmitted (Karn's algorithm).
+class RttEstimator
+{
+private:
+    typedef struct
+    {
+        uint32_t srtt_us;
+        uint32_t rttvar_us;
+        uint32_t rto_us;
+        uint32_t samples;
+    } Estimate;
+
+    Estimate link;
+    Estimate devices[RTT_DEVICE_COUNT];
+    std::mutex mtx;
+
+    static void reset(Estimate &e)
+    {
+        e.srtt_us = 0;
+        e.rttvar_us = 0;
+        e.rto_us = RTO_INITIAL_ms * 1000;
+        e.samples = 0;
+    }
+
+    static void update(Estimate &e, uint32_t rtt_us)
+    {
+        if (e.samples == 0)
+        {
+            e.srtt_us = rtt_us;
+            e.rttvar_us = rtt_us / 2;
+        }
+        else
+        {
+            uint32_t err = rtt_us > e.srtt_us ? rtt_us - e.srtt_us : e.srtt_us - rtt_us;
+            e.rttvar_us = e.rttvar_us - e.rttvar_us / 4 + err / 4;
+            e.srtt_us = e.srtt_us - e.srtt_us / 8 + rtt_us / 8;
+        }
+        e.samples++;
+
+        uint32_t var = 4 * e.rttvar_us;
+        uint32_t rto = e.srtt_us + (var > RTO_GRANULARITY_us ? var : RTO_GRANULARITY_us);
+        if (rto < RTO_MIN_ms * 1000)
+            rto = RTO_MIN_ms * 1000;
+        if (rto > RTO_MAX_ms * 1000)
+            rto = RTO_MAX_ms * 1000;
+        e.rto_us = rto;
+    }
+
+    static RttStats toStats(const Estimate &e)
+    {
+        RttStats s;
+        s.srtt_us = e.srtt_us;
+        s.rttvar_us = e.rttvar_us;
+        s.rto_us = e.rto_us;
+        s.samples = e.samples;
+        return s;
+    }
+
+public:
+    RttEstimator()
+    {
+        reset(link);
+        for (int i = 0; i < RTT_DEVICE_COUNT; i++)
+            reset(devices[i]);
+    }
+
+    // deviceId < 0 for frames that don't belong to a single device (DATA_LIST)
+    void sample(int deviceId, uint32_t rtt_us)
+    {
+        std::lock_guard<std::mutex> guard(mtx);
+        update(link, rtt_us);
+        if (deviceId >= 0 && deviceId < RTT_DEVICE_COUNT)
+            update(devices[deviceId], rtt_us);
+    }
+
+    // timeout for the attempt-th transmission (0 for the first one) of a frame
+    // to deviceId: the rto doubled for every retransmission, up to RTO_MAX_ms
+    uint32_t timeout_ms(int deviceId, unsigned int attempt)
+    {
+        uint32_t rto_us;
+        {
+            std::lock_guard<std::mutex> guard(mtx);
+            rto_us = link.rto_us;
+            if (deviceId >= 0 && deviceId < RTT_DEVICE_COUNT && devices[deviceId].samples > 0)
+                rto_us = devices[deviceId].rto_us;
+        }
+
+        uint32_t rto_ms = (rto_us + 999) / 1000;
+        for (unsigned int i = 0; i < attempt && rto_ms < RTO_MAX_ms; i++)
+            rto_ms *= 2;
+        return rto_ms < RTO_MAX_ms ? rto_ms : RTO_MAX_ms;
+    }
+
+    RttStats linkStats()
+    {
+        std::lock_guard<std::mutex> guard(mtx);
+        return toStats(link);
+    }
+
+    RttStats deviceStats(uchar deviceId)
+    {
+        std::lock_guard<std::mutex> guard(mtx);
+        return toStats(devices[deviceId]);
+    }
+};
+
+#endif
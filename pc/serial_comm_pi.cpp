@@ -1,103 +1,227 @@
 #include "serial_comm_pi.h"
-#include "../lib/include/crawler_hal.h"
+#include "comm_types.h"
 
-char *SerialCommunication::buildSendMessage()
+// returns the wire size of the frame built in sndFrame
+unsigned int SerialCommunication::buildSendMessage()
 {
-    char *msg = (char *)malloc(sizeof(unsigned char) * (sndBufferSize + 3));
+    return frameEncode(sndBuffer, sndBufferSize, Crc16Slice::compute(sndBuffer, sndBufferSize), sndFrame);
+}
 
-    msg[0] = MSG_START;
-    uint8_t i = 0;
-    for (i = 0; i < sndBufferSize; i++)
+// the fd is non-blocking: wait for room in the driver whenever it is full
+bool SerialCommunication::writeAll(const unsigned char *buf, unsigned int size)
+{
+    unsigned int sent = 0;
+    while (sent < size)
     {
-        msg[i + 1] = sndBuffer[i];
+        ssize_t n = ::write(connFd, buf + sent, size - sent);
+        if (n > 0)
+        {
+            sent += n;
+            continue;
+        }
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+        {
+#ifdef DEBUG
+            printf("writeAll(): write failed: %s\n", strerror(errno));
+#endif
+            return false;
+        }
+
+        struct pollfd pfd;
+        pfd.fd = connFd;
+        pfd.events = POLLOUT;
+        pfd.revents = 0;
+        int r = poll(&pfd, 1, SERIAL_WRITE_TIMEOUT_ms);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            return false;
     }
-    msg[i + 1] = MSG_END;
-    msg[i + 2] = 0;
-    return msg;
+    return true;
 }
 
 SerialCommunication::SerialCommunication(const char *device)
+    : SerialCommunication(device, serialPortDefaultConfig(SERIAL_BOUND_RATE))
 {
-    if (wiringPiSetup() == -1)
-    {
-        fprintf(stderr, "unable to initialize wiringPi\n");
-        exit(1);
-    }
+}
 
-    connFd = serialOpen(device, SERIAL_BOUND_RATE);
-    if (connFd == -1)
-    {
+SerialCommunication::SerialCommunication(const char *device, const SerialPortConfig &config)
+    : rcvParser(rcvBuffer, RCV_BUFFER_SIZE + FRAME_CRC_SIZE)
+{
+    SerialPortConfig c = config;
+    // reads must never block: we drain whatever the driver has with a single read
+    // and return to the caller (who either polls the fd or retries later).
+    c.nonBlocking = true;
+
+    int fd = serialPortOpen(device, c);
+    if (fd < 0)
         fprintf(stderr, "unable to open device %s: %s\n", device, strerror(errno));
-        exit(1);
-    }
+    initialize(fd);
+}
 
+SerialCommunication::SerialCommunication(int fd) : rcvParser(rcvBuffer, RCV_BUFFER_SIZE + FRAME_CRC_SIZE)
+{
+    int flags = fcntl(fd, F_GETFL);
+    if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)
+        fprintf(stderr, "unable to set fd %d non-blocking: %s\n", fd, strerror(errno));
+    initialize(fd);
+}
+
+SerialCommunication::~SerialCommunication()
+{
+    if (connFd >= 0)
+        close(connFd);
+}
+
+void SerialCommunication::initialize(int fd)
+{
+    connFd = fd;
     sndBufferSize = 0;
+    sndFrameSize = 0;
+    sndFrameSent = 0;
     rcvBufferSize = 0;
+    ringHead = 0;
+    ringTail = 0;
+    metrics = nullptr;
 }
 
-int SerialCommunication::readByte()
+bool SerialCommunication::isOpen()
 {
-    std::this_thread::sleep_for(std::chrono::milliseconds(SERIAL_WAIT_DELAY_ms));
-    return serialGetchar(connFd);
+    return connFd >= 0;
 }
 
-void SerialCommunication::clearReceiveBuffer()
+int SerialCommunication::fillRing()
 {
+    unsigned int used = ringHead - ringTail;
+    if (used == RING_BUFFER_SIZE)
+        return 0;
+
+    unsigned int head = ringHead & (RING_BUFFER_SIZE - 1);
+    unsigned int tail = ringTail & (RING_BUFFER_SIZE - 1);
+
+    // the free space may wrap around the end of the ring: hand both pieces to
+    // the kernel so everything available is drained with one syscall.
+    struct iovec iov[2];
+    int iovcnt = 1;
+    iov[0].iov_base = &ringBuffer[head];
+    if (head >= tail)
+    {
+        iov[0].iov_len = RING_BUFFER_SIZE - head;
+        iov[1].iov_base = &ringBuffer[0];
+        iov[1].iov_len = tail;
+        if (tail > 0)
+            iovcnt = 2;
+    }
+    else
+        iov[0].iov_len = tail - head;
 
-    while (serialDataAvail(connFd) > 0)
-        serialGetchar(connFd);
-    rcvBufferSize = 0;
+    if (used == 0)
+    {
+        // empty ring: restart at the beginning so the read is contiguous
+        ringHead = ringTail = 0;
+        iov[0].iov_base = &ringBuffer[0];
+        iov[0].iov_len = RING_BUFFER_SIZE;
+        iovcnt = 1;
+    }
+
+    ssize_t n = readv(connFd, iov, iovcnt);
+    if (n <= 0)
+    {
+#ifdef DEBUG
+        if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            printf("fillRing(): read failed: %s\n", strerror(errno));
+#endif
+        return 0;
+    }
+
+    ringHead += n;
+    if (metrics)
+        metrics->bytesReceived.add(n);
+    return n;
 }
 
-bool SerialCommunication::receiveData() 
+unsigned int SerialCommunication::ringAvailable()
 {
-    if (rcvBufferSize > 0)
-        return false;
-
-    if (serialDataAvail(connFd) <= 0)
-        return false;
+    return ringHead - ringTail;
+}
 
-    rcvBufferSize = 0;
-    int ch;
-    int resp = RCV_RESP_INVALID;
+unsigned char SerialCommunication::ringPop()
+{
+    return ringBuffer[ringTail++ & (RING_BUFFER_SIZE - 1)];
+}
 
-    // printf ("** buffer size: %d\n", serialDataAvail(connFd));
+bool SerialCommunication::checkCrc(unsigned int size)
+{
+    if (size <= FRAME_CRC_SIZE)
+        return false;
 
-    bool valid = false;
+    uint16_t crc = Crc16Slice::compute(rcvBuffer, size - FRAME_CRC_SIZE);
+    if (rcvBuffer[size - 2] == (crc & 0xff) && rcvBuffer[size - 1] == (crc >> 8))
+        return true;
 
-    while (!valid && serialDataAvail(connFd) > 0)
-    {
-        ch = readByte();
-        if (ch == MSG_START)
-            valid = true;
 #ifdef DEBUG
-        else
-            printf("ignoring: %d\n", ch);
+    printf("RCV_RESP_INVALID: CRC mismatch on a %d byte frame\n", size);
 #endif
-    }
+    if (metrics)
+        metrics->crcErrors.add();
+    return false;
+}
+
+int SerialCommunication::readByte()
+{
+    if (ringAvailable() == 0 && fillRing() == 0)
+        return -1;
+    return ringPop();
+}
+
+void SerialCommunication::clearReceiveBuffer()
+{
+    ringHead = ringTail = 0;
+    while (fillRing() > 0)
+        ringHead = ringTail = 0;
+    rcvParser.reset();
+    rcvBufferSize = 0;
+}
 
-    if (!valid)
+bool SerialCommunication::receiveData() 
+{
+    if (rcvBufferSize > 0)
         return false;
 
-    valid = false;
+    if (ringAvailable() == 0 && fillRing() == 0)
+        return false;
 
-    while (!valid && serialDataAvail(connFd) > 0 && rcvBufferSize < RCV_BUFFER_SIZE)
+    // bytes of a frame that isn't complete yet stay in rcvParser, the rest of
+    // it will come with a later read. Bytes following a complete frame stay in
+    // the ring for the next call.
+    while (ringAvailable() > 0 || fillRing() > 0)
     {
-        ch = readByte();
-        if (ch == MSG_END)
+        switch (rcvParser.push(ringPop()))
+        {
+        case FRAME_PARSER_COMPLETE:
+            // a damaged frame is dropped. The device doesn't retransmit, so
+            // there is no point in NACKing it: if it was an ACK the request
+            // simply times out and is resent.
+            if (!checkCrc(rcvParser.frameSize()))
+                break;
+            rcvBufferSize = rcvParser.frameSize() - FRAME_CRC_SIZE;
+            if (metrics)
+                metrics->framesReceived.add();
             return true;
-
-        rcvBuffer[rcvBufferSize++] = (unsigned char)ch;
-    }
-
-#ifdef DEBUGf
-    printf("RCV_RESP_INVALID [");
-    for (int i = 0; i < rcvBufferSize; i++)
-        printf(" %d", rcvBuffer[i]);
-    printf(" ]\n");
+        case FRAME_PARSER_INVALID:
+#ifdef DEBUG
+            printf("RCV_RESP_INVALID: frame larger than %d bytes dropped\n", RCV_BUFFER_SIZE);
 #endif
+            if (metrics)
+                metrics->invalidFrames.add();
+            break;
+        default:
+            break;
+        }
+    }
 
-    rcvBufferSize = 0;
     return false;
 }
 
@@ -106,18 +230,72 @@ void SerialCommunication::sendData()
     if (sndBufferSize == 0)
         return;
 
-    char *msg = buildSendMessage();
+    unsigned int size = buildSendMessage();
 #ifdef DEBUG
     printf("sending: [");
-    for (int i = 0; i < sndBufferSize + 3; i++)
+    for (unsigned int i = 0; i < size; i++)
     {
-        printf(" %d", msg[i]);
+        printf(" %d", sndFrame[i]);
     }
     printf("]\n");
 #endif
-    serialPuts(connFd, msg);
-    std::this_thread::sleep_for(std::chrono::milliseconds(SERIAL_WAIT_DELAY_ms));
+    // keep SERIAL_WAIT_DELAY_ms between frames, but wait before writing rather
+    // than after, so the caller is free as soon as its frame is out
+    std::this_thread::sleep_until(lastSent + std::chrono::milliseconds(SERIAL_WAIT_DELAY_ms));
+    // an explicit length: the frame may hold 0 bytes, which serialPuts() stops at
+    if (!writeAll(sndFrame, size))
+        fprintf(stderr, "unable to send frame: %s\n", strerror(errno));
+    else if (metrics)
+    {
+        metrics->framesSent.add();
+        metrics->bytesSent.add(size);
+    }
+    lastSent = std::chrono::steady_clock::now();
+    sndBufferSize = 0;
+    sndFrameSize = 0;
+}
+
+bool SerialCommunication::sendDataNoWait()
+{
+    sndFrameSize = 0;
+    sndFrameSent = 0;
+    if (sndBufferSize == 0)
+        return true;
+
+    sndFrameSize = buildSendMessage();
     sndBufferSize = 0;
+    return sendPendingData();
+}
+
+bool SerialCommunication::sendPendingData()
+{
+    while (sndFrameSent < sndFrameSize)
+    {
+        ssize_t n = ::write(connFd, sndFrame + sndFrameSent, sndFrameSize - sndFrameSent);
+        if (n > 0)
+        {
+            sndFrameSent += n;
+            continue;
+        }
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n == 0 || errno == EAGAIN || errno == EWOULDBLOCK)
+            return false;
+
+        fprintf(stderr, "unable to send frame: %s\n", strerror(errno));
+        sndFrameSize = 0;
+        return true;
+    }
+
+    if (sndFrameSize > 0 && metrics)
+    {
+        metrics->framesSent.add();
+        metrics->bytesSent.add(sndFrameSize);
+    }
+    // a sendData() that follows keeps its gap from this frame
+    lastSent = std::chrono::steady_clock::now();
+    sndFrameSize = 0;
+    return true;
 }
 
 bool SerialCommunication::hasData() 
@@ -132,29 +310,25 @@ char SerialCommunication::read(unsigned int pos)
 
 float SerialCommunication::readF(unsigned int pos) 
 {
-    floatp p;
-    for (uint8_t i = 0; i < 4; i++)
-        p.bval[i] = rcvBuffer[pos++];
-    return p.fval;
+    return WireField<float>::decode(&rcvBuffer[pos]);
 }
 
 uint16_t SerialCommunication::readInt16(unsigned int pos) 
 {
-    uint16p p;
-    p.bval[0] = rcvBuffer[pos++];
-    p.bval[1] = rcvBuffer[pos++];
-    return p.val;
+    return WireField<uint16_t>::decode(&rcvBuffer[pos]);
 }
 
 void SerialCommunication::writeInt16(uint16_t val) 
 {
-    uint16p p;
-    p.val = val;
-    write(p.bval[0]);
-    write(p.bval[1]);
+    uint8_t p[2];
+    WireField<uint16_t>::encode(p, val);
+    write(p[0]);
+    write(p[1]);
 }
 void SerialCommunication::write(unsigned char val) 
 {
+    if (sndBufferSize >= SND_BUFFER_SIZE)
+        return;
     sndBuffer[sndBufferSize++] = val;
 }
 
@@ -166,6 +340,13 @@ char *SerialCommunication::copy()
     return p;
 }
 
+unsigned int SerialCommunication::copyTo(char *dst, unsigned int capacity)
+{
+    unsigned int size = rcvBufferSize < capacity ? rcvBufferSize : capacity;
+    memcpy(dst, rcvBuffer, size);
+    return size;
+}
+
 unsigned int SerialCommunication::receivedDataSize() 
 {
     return rcvBufferSize;
@@ -186,3 +367,14 @@ void SerialCommunication::clearSnd()
 {
     sndBufferSize = 0;
 }
+
+
+int SerialCommunication::fileDescriptor()
+{
+    return connFd;
+}
+
+void SerialCommunication::setMetrics(LinkMetrics *metrics)
+{
+    this->metrics = metrics;
+}
\ No newline at end of file
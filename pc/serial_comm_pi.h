@@ -3,11 +3,14 @@
 
 #define SERIAL_BOUND_RATE 115200
 #define SERIAL_WAIT_DELAY_ms 2
+#define SERIAL_WRITE_TIMEOUT_ms 100
 #define RCV_BUFFER_SIZE 100
 #define SND_BUFFER_SIZE 100
+#define RING_BUFFER_SIZE 1024 // must be a power of two
 
 #define MSG_START 32
 #define MSG_END 31
+#define MSG_ESC 30
 
 #define RCV_RESP_NO_DATA 0
 #define RCV_RESP_VALID 1
@@ -16,6 +19,8 @@
 #define PROTOCOL_FRAME_TYPE_DATA 1
 #define PROTOCOL_FRAME_TYPE_ACK 2
 #define PROTOCOL_FRAME_TYPE_DATA_LIST 3
+#define PROTOCOL_FRAME_TYPE_FRAGMENT 4
+#define PROTOCOL_FRAME_TYPE_SUBSCRIBE 5
 
 #define PROTOCOL_ACK 1
 #define PROTOCOL_NACK 2
@@ -27,17 +32,25 @@
 #include <string.h>
 #include <errno.h>
 #include <unistd.h>
-#include <wiringPi.h>
-#include <wiringSerial.h>
 #include <pthread.h>
 #include <thread>
 #include <chrono>
 #include <mutex>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <poll.h>
+
+#include "../arduino/frame_parser.h"
+#include "../arduino/message_schema.h"
+#include "crc16_slice.h"
+#include "serial_port.h"
+#include "link_metrics.h"
 
 class ISerialCommunication
 {
 public:
+    virtual ~ISerialCommunication() {}
     virtual bool receiveData() = 0;
     virtual void sendData() = 0;
     virtual bool hasData() = 0;
@@ -48,31 +61,83 @@ public:
     virtual void writeInt16(uint16_t val) = 0;
     virtual void write(unsigned char val) = 0;
     virtual char *copy() = 0;
+    virtual unsigned int copyTo(char *dst, unsigned int capacity) = 0;
     virtual unsigned int receivedDataSize() = 0;
     virtual unsigned int sendDataSize() = 0;
     virtual void clearReceiveBuffer() = 0;
     virtual void clearRcv() = 0;
     virtual void clearSnd() = 0;
+    virtual int fileDescriptor() = 0;
+    // like sendData(), but never waits: neither for SERIAL_WAIT_DELAY_ms since
+    // the last frame nor for room in the driver, the caller keeps frames apart.
+    // Returns false when the driver took only part of the frame,
+    // sendPendingData() then writes more of it.
+    virtual bool sendDataNoWait()
+    {
+        sendData();
+        return true;
+    }
+    // true once the frame sendDataNoWait() started is all written
+    virtual bool sendPendingData() { return true; }
+    // frame and byte counts go to metrics from then on, nullptr stops counting
+    virtual void setMetrics(LinkMetrics * /* metrics */) {}
 };
 
 class SerialCommunication : public ISerialCommunication
 {
 private:
     int connFd;
-    unsigned char rcvBuffer[RCV_BUFFER_SIZE];
+    // frame body followed by its CRC, which receiveData() strips
+    unsigned char rcvBuffer[RCV_BUFFER_SIZE + FRAME_CRC_SIZE];
     unsigned char sndBuffer[SND_BUFFER_SIZE];
     unsigned int rcvBufferSize;
     unsigned int sndBufferSize;
 
-    char *buildSendMessage();
+    // MSG_START + escaped sndBuffer + MSG_END, built in place by buildSendMessage()
+    unsigned char sndFrame[FRAME_ENCODED_MAX_SIZE(SND_BUFFER_SIZE)];
+    // what sendDataNoWait() has left of sndFrame: bytes sndFrameSent up to sndFrameSize
+    unsigned int sndFrameSize;
+    unsigned int sndFrameSent;
+
+    // bytes drained from the serial fd but not yet parsed. ringHead/ringTail are free
+    // running counters, the slot index is (counter & (RING_BUFFER_SIZE - 1))
+    unsigned char ringBuffer[RING_BUFFER_SIZE];
+    unsigned int ringHead;
+    unsigned int ringTail;
+
+    // keeps a partially received frame in rcvBuffer across receiveData() calls
+    FrameParser rcvParser;
+
+    // when the last frame was written, sendData() keeps the next one
+    // SERIAL_WAIT_DELAY_ms away from it
+    std::chrono::steady_clock::time_point lastSent;
+    LinkMetrics *metrics;
+
+    unsigned int buildSendMessage();
+    bool writeAll(const unsigned char *buf, unsigned int size);
+    int fillRing();
+    unsigned int ringAvailable();
+    unsigned char ringPop();
+    bool checkCrc(unsigned int size);
+    void initialize(int fd);
 
 public:
+    // opens device with termios (serial_port.h) at SERIAL_BOUND_RATE. When the
+    // device can't be opened the error is printed and isOpen() returns false.
     SerialCommunication(const char *device);
+    SerialCommunication(const char *device, const SerialPortConfig &config);
+    // takes over fd, which must be set up already (e.g. one end of a pty pair)
+    SerialCommunication(int fd);
+    ~SerialCommunication();
+
+    bool isOpen();
 
     int readByte() override;
     void clearReceiveBuffer() override;
     bool receiveData() override;
     void sendData() override;
+    bool sendDataNoWait() override;
+    bool sendPendingData() override;
     bool hasData() override;
     char read(unsigned int pos) override;
     float readF(unsigned int pos) override;
@@ -80,10 +145,13 @@ public:
     void writeInt16(uint16_t val) override;
     void write(unsigned char val) override;
     char *copy() override;
+    unsigned int copyTo(char *dst, unsigned int capacity) override;
     unsigned int receivedDataSize() override;
     unsigned int sendDataSize() override;
     void clearRcv() override;
     void clearSnd() override;
+    int fileDescriptor() override;
+    void setMetrics(LinkMetrics *metrics) override;
 };
 
 #endif
\ No newline at end of file
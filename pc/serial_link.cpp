@@ -2,14 +2,116 @@
 #include "serial_link.h"
 
 #include <unistd.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
 
 void SerialLink::initialize()
 {
     run = true;
-    this->rcvThread = new std::thread(&SerialLink::rcvThreadHandler, this);
-    this->handlers = new std::map<uchar, std::vector<SerialLinkResponseCallback *> *>();
+    comm->setMetrics(&metrics);
     comm->clearRcv();
     comm->clearSnd();
+
+    shutdownFd = -1;
+
+    startTime = std::chrono::steady_clock::now();
+    for (int i = 0; i < FRAME_ID_COUNT; i++)
+        pendingRequests[i].active = false;
+
+    txBatch.size = 0;
+    txBatch.count = 0;
+    txBatchWindow_ms = 0;
+    txBatchMaxSize = TX_BATCH_MAX_SIZE;
+    nextMessageId = 0;
+    for (int i = 0; i < HANDLER_TABLE_SIZE; i++)
+    {
+        subscriptions[i].active = false;
+        deviceTxClass[i] = TX_CLASS_NORMAL;
+    }
+
+    timerFd = -1;
+    timerWakeAt = std::chrono::steady_clock::time_point::max();
+    txTimerFd = -1;
+    txWriting = nullptr;
+    this->rcvThread = nullptr;
+    this->timerThread = nullptr;
+
+    if (reactor != nullptr)
+    {
+        // frames may arrive as soon as the fd is watched
+        dispatcher = reactor->dispatcher();
+        if (attachToReactor())
+            return;
+        reactor = nullptr;
+    }
+
+    shutdownFd = eventfd(0, EFD_CLOEXEC);
+    if (shutdownFd < 0)
+    {
+        fprintf(stderr, "unable to create shutdown eventfd, falling back to polling: %s\n", strerror(errno));
+        eventDriven = false;
+    }
+
+    dispatcher = nullptr;
+    if (dispatchWorkers > 0)
+        dispatcher = new DispatchExecutor(dispatchWorkers);
+
+    txScheduler.start([this](TxFrame *f) { writeFrame(f); });
+    this->rcvThread = new std::thread(&SerialLink::rcvThreadHandler, this);
+    this->timerThread = new std::thread(&SerialLink::timerThreadHandler, this);
+}
+
+bool SerialLink::attachToReactor()
+{
+    if (!reactor->isOpen())
+    {
+        fprintf(stderr, "serial reactor isn't running, the link runs its own threads\n");
+        return false;
+    }
+    if (comm->fileDescriptor() < 0)
+    {
+        fprintf(stderr, "serial link has no file descriptor for the reactor, running its own threads\n");
+        return false;
+    }
+
+    timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    if (timerFd < 0)
+    {
+        fprintf(stderr, "unable to create the link timer, running its own threads: %s\n", strerror(errno));
+        return false;
+    }
+
+    txTimerFd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    if (txTimerFd < 0)
+    {
+        fprintf(stderr, "unable to create the link TX timer, running its own threads: %s\n", strerror(errno));
+        close(timerFd);
+        timerFd = -1;
+        return false;
+    }
+
+    if (reactor->add(timerFd, [this] { reactorTimerHandler(); }))
+    {
+        if (reactor->add(txTimerFd, [this] { reactorTxHandler(); }))
+        {
+            if (reactor->add(comm->fileDescriptor(), [this] { receivePendingFrames(); }))
+            {
+                // frames queued from now on, ACKs to what was received already
+                // included, are written by reactorTxHandler()
+                txScheduler.startDriven([this] { armTxTimer(0); });
+                return true;
+            }
+            reactor->remove(txTimerFd);
+        }
+        reactor->remove(timerFd);
+    }
+
+    close(txTimerFd);
+    txTimerFd = -1;
+    close(timerFd);
+    timerFd = -1;
+    return false;
 }
 
 void SerialLink::lock()
@@ -30,20 +132,68 @@ int SerialLink::wait()
 
 void SerialLink::rcvThreadHandlerValid()
 {
-    ResponseData *rcvMsg = new ResponseData();
-    rcvMsg->data = comm->copy();
-    rcvMsg->size = comm->receivedDataSize();
+    PooledResponseData *rcvMsg = responsePool.acquire();
+    if (rcvMsg == nullptr)
+    {
+        rcvThreadHandlerUnpooled();
+        return;
+    }
+
+    rcvMsg->size = comm->copyTo(rcvMsg->storage, RCV_BUFFER_SIZE);
+    rcvMsg->storage[rcvMsg->size] = 0;
     rcvMsg->frameId = rcvMsg->data[0];
     rcvMsg->frameType = rcvMsg->data[1];
     rcvMsg->deviceId = rcvMsg->data[2];
+    recorder.record(FRAME_DIRECTION_RX, (const uchar *)rcvMsg->data, rcvMsg->size);
 
 #ifdef DEBUG
     printf("received valid message: frameId: %d, frameType: %d, deviceId: %d, size: %d\n", rcvMsg->frameId, rcvMsg->frameType, rcvMsg->deviceId, rcvMsg->size);
 #endif
-    processData(rcvMsg);
+    processData(rcvMsg, rcvMsg);
+    responsePool.unref(rcvMsg);
+}
+
+// the response pool is held by handlers that are still running. Only the
+// handlers miss this frame: an ACK or NACK still settles its request, so the
+// link doesn't retransmit on top, and fragments are still reassembled.
+void SerialLink::rcvThreadHandlerUnpooled()
+{
+    char storage[RCV_BUFFER_SIZE + 1];
+    ResponseData rcvMsg;
+    rcvMsg.data = storage;
+    rcvMsg.size = comm->copyTo(storage, RCV_BUFFER_SIZE);
+    storage[rcvMsg.size] = 0;
+    rcvMsg.frameId = storage[0];
+    rcvMsg.frameType = storage[1];
+    rcvMsg.deviceId = storage[2];
+    recorder.record(FRAME_DIRECTION_RX, (const uchar *)storage, rcvMsg.size);
+
+    switch (rcvMsg.frameType)
+    {
+    case PROTOCOL_FRAME_TYPE_ACK:
+        processAck(&rcvMsg);
+        break;
+    case PROTOCOL_FRAME_TYPE_FRAGMENT:
+        processFragment(&rcvMsg);
+        return;
+    default:
+        break;
+    }
+#ifdef DEBUG
+    printf("response pool exhausted, dropping frame\n");
+#endif
+    metrics.droppedFrames.add();
 }
 
 void SerialLink::rcvThreadHandler()
+{
+    if (eventDriven && comm->fileDescriptor() >= 0)
+        rcvThreadHandlerEvent();
+    else
+        rcvThreadHandlerPoll();
+}
+
+void SerialLink::rcvThreadHandlerPoll()
 {
     while (run)
     {
@@ -53,33 +203,80 @@ void SerialLink::rcvThreadHandler()
             comm->clearRcv();
         }
         else
+        {
+            // holds no handler list while it sleeps
+            ReaderEpochs::idle();
             wait();
+        }
     }
 }
 
-void SerialLink::executeCallbackForMessageData(ResponseData *rcvMsg)
+void SerialLink::receivePendingFrames()
 {
-    auto it = this->handlers->find(rcvMsg->deviceId);
+    while (run && comm->receiveData())
+    {
+        rcvThreadHandlerValid();
+        comm->clearRcv();
+    }
+}
 
-    if (it != this->handlers->end())
+void SerialLink::rcvThreadHandlerEvent()
+{
+    struct pollfd fds[2];
+    fds[0].fd = comm->fileDescriptor();
+    fds[0].events = POLLIN;
+    fds[1].fd = shutdownFd;
+    fds[1].events = POLLIN;
+
+    while (run)
     {
-#ifdef DEBUG
-        printf("found handler for deviceId = %d\n", it->first);
-        if (it->second == nullptr)
+        receivePendingFrames();
+
+        fds[0].revents = 0;
+        fds[1].revents = 0;
+
+        // holds no handler list while it waits for the port
+        ReaderEpochs::idle();
+        if (poll(fds, 2, -1) < 0)
         {
-            printf("handler for deviceId = %d is NULL!!\n", it->first);
-        }
+            if (errno == EINTR)
+                continue;
+#ifdef DEBUG
+            printf("rcvThreadHandlerEvent(): poll failed: %s, falling back to polling\n", strerror(errno));
 #endif
-        if (it->second != nullptr)
+            rcvThreadHandlerPoll();
+            return;
+        }
+
+        if (fds[1].revents & POLLIN)
+            return;
+
+        // the peer went away (e.g. the pty master was closed). Don't spin on a
+        // descriptor that stays readable-with-error, just back off like the poll mode.
+        if (!(fds[0].revents & POLLIN) && (fds[0].revents & (POLLERR | POLLHUP | POLLNVAL)))
+            wait();
+    }
+}
+
+// frame is the pooled buffer rcvMsg lives in, nullptr when rcvMsg is only
+// borrowed for this call and has to be handled before returning
+void SerialLink::executeCallbackForMessageData(ResponseData *rcvMsg, PooledResponseData *frame)
+{
+    if (dispatcher != nullptr && frame != nullptr)
+    {
+        if (!dispatcher->submit(handlers, responsePool, frame, rcvMsg, &metrics))
         {
-            auto vector = it->second;
-            for (auto ptr = vector->begin(); ptr < vector->end(); ptr++)
-            {
-                (*ptr)->callback(rcvMsg);
-            }
+#ifdef DEBUG
+            printf("dispatch queue full, dropping frame for deviceId %d\n", rcvMsg->deviceId);
+#endif
+            metrics.droppedFrames.add();
         }
-        // it->second(rcvMsg);
+        return;
     }
+
+    auto start = std::chrono::steady_clock::now();
+    handlers.dispatch(rcvMsg);
+    metrics.handlerTime_us.record(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count());
 }
 
 void SerialLink::printRawData(const char *sensorName, ResponseData *p)
@@ -96,275 +293,1187 @@ void SerialLink::printRawData(const char *sensorName, ResponseData *p)
     printf(" ]\n");
 }
 
-void SerialLink::processListData(ResponseData *rcvMsg)
+void SerialLink::processListData(ResponseData *rcvMsg, PooledResponseData *frame)
 {
-    int i = 2;
+    // each entry is [deviceId, size, size - 1 bytes]. The sub-message handed to the
+    // handlers is a view into the parent frame starting at its size byte.
+    ResponseData subMsg;
+    subMsg.frameId = 1;
+    subMsg.frameType = PROTOCOL_FRAME_TYPE_DATA;
+
+    unsigned int i = 2;
     while (i < rcvMsg->size)
     {
-        ResponseData *subMsg = new ResponseData();
-        subMsg->deviceId = rcvMsg->data[i];
-        subMsg->frameId = 1;
-        subMsg->frameType = PROTOCOL_FRAME_TYPE_DATA;
-        subMsg->size = rcvMsg->data[++i];
-        subMsg->data = (char *)malloc(sizeof(char) * (subMsg->size + 1));
+        subMsg.deviceId = rcvMsg->data[i];
+        if (++i >= rcvMsg->size)
+            break;
 
-        for (int j = 0; j < subMsg->size && i < rcvMsg->size; j++, i++)
-            subMsg->data[j] = rcvMsg->data[i];
+        unsigned int size = (uchar)rcvMsg->data[i];
+        if (size > rcvMsg->size - i)
+            size = rcvMsg->size - i;
 
-        processData(subMsg);
+        subMsg.data = &rcvMsg->data[i];
+        subMsg.size = size;
+        i += size;
+
+        processData(&subMsg, frame);
     }
 }
 
 void SerialLink::processData(ResponseData *rcvMsg)
+{
+    processData(rcvMsg, nullptr);
+}
+
+void SerialLink::processData(ResponseData *rcvMsg, PooledResponseData *frame)
 {
     switch (rcvMsg->frameType)
     {
     case PROTOCOL_FRAME_TYPE_ACK:
-        requestAckWaitCheck.checkAck(rcvMsg);
+        processAck(rcvMsg);
 #ifdef DEBUG
         printf("data is ack\n");
 #endif
-        executeCallbackForMessageData(rcvMsg);
+        executeCallbackForMessageData(rcvMsg, frame);
         break;
     case PROTOCOL_FRAME_TYPE_DATA_LIST:
-        processListData(rcvMsg);
+        processListData(rcvMsg, frame);
         break;
     case PROTOCOL_FRAME_TYPE_DATA:
-        executeCallbackForMessageData(rcvMsg);
+        executeCallbackForMessageData(rcvMsg, frame);
+        break;
+    case PROTOCOL_FRAME_TYPE_FRAGMENT:
+        processFragment(rcvMsg);
         break;
 
     default:
         break;
     }
+}
 
-    delete rcvMsg;
+// settles the request an ACK or NACK frame answers
+void SerialLink::processAck(ResponseData *rcvMsg)
+{
+    if (requestAckWindow.checkAck(rcvMsg))
+        completePendingRequest(rcvMsg->frameId, true);
+    else if (requestAckWindow.checkNack(rcvMsg))
+    {
+        metrics.nacksReceived.add();
+        retransmitPendingRequest(rcvMsg->frameId);
+    }
 }
 
-uchar *SerialLink::allocBuffer(int size)
+// acks a device message once its last fragment is in, then hands it to the
+// handlers. The reassembly buffer is reused by the next fragment, so they run
+// right here instead of on the dispatch workers.
+void SerialLink::processFragment(ResponseData *rcvMsg)
 {
-    return (uchar *)malloc(sizeof(uchar) * size);
+    ResponseData message;
+    int result = reassembler.push(rcvMsg, &message);
+    if (result == FRAGMENT_RESULT_NONE)
+        return;
+    if (result == FRAGMENT_RESULT_INVALID)
+    {
+#ifdef DEBUG
+        printf("invalid fragment from deviceId %d dropped\n", rcvMsg->deviceId);
+#endif
+        metrics.invalidFrames.add();
+        return;
+    }
+
+    uchar ack[3];
+    ack[0] = rcvMsg->frameId;
+    ack[1] = PROTOCOL_FRAME_TYPE_ACK;
+    ack[2] = result == FRAGMENT_RESULT_INCOMPLETE ? PROTOCOL_NACK : PROTOCOL_ACK;
+    postRequest(3, ack);
+
+    if (result != FRAGMENT_RESULT_COMPLETE)
+        return;
+    auto start = std::chrono::steady_clock::now();
+    handlers.dispatch(&message);
+    metrics.handlerTime_us.record(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count());
 }
 
 void SerialLink::request(int num_params, uchar *payload)
 {
-    comm->clearSnd();
-    payload[0] = requestAckWaitCheck.getNextAckFrameId();
 #ifdef DEBUG
     printf("request(): frameId = %d\n", payload[0]);
 #endif
-    for (int i = 0; i < num_params; i++)
+    // the reactor thread serves every link, it never waits for a frame to go
+    // out: a handler running on it posts its requests
+    if (reactor != nullptr && reactor->onLoopThread())
+    {
+        postRequest(num_params, payload);
+        return;
+    }
+    TxFrame frame;
+    frame.payload = payload;
+    frame.size = num_params;
+    frame.txClass = txClassOf(payload);
+    txScheduler.send(&frame);
+}
+
+// like request(), but returns without waiting for the frame to be sent: for
+// the receive and timer threads, and for requests nobody waits on. Returns
+// false when the frame was dropped, the TX queue holding all the copies it has.
+bool SerialLink::postRequest(int num_params, uchar *payload)
+{
+#ifdef DEBUG
+    printf("postRequest(): frameId = %d\n", payload[0]);
+#endif
+    if (txScheduler.post(payload, num_params, txClassOf(payload)))
+        return true;
+    metrics.txDropped.add();
+    return false;
+}
+
+// hands f to the port. With wait, on the TxScheduler thread, like sendData():
+// waiting out SERIAL_WAIT_DELAY_ms since the previous frame and for room in
+// the driver. Without, on the reactor thread, it returns false when part of
+// the frame is left for comm->sendPendingData().
+bool SerialLink::startFrame(TxFrame *f, bool wait)
+{
+    if (f->txClass == TX_CLASS_CONTROL)
+        metrics.controlTxWait_us.record(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - f->queuedAt).count());
+    recorder.record(FRAME_DIRECTION_TX, f->payload, f->size);
+    lock();
+    comm->clearSnd();
+    for (int i = 0; i < f->size; i++)
+    {
+        // printf ("writing payload[%d] = %d\n - buffer: %d\n", i, f->payload[i], comm->sendDataSize());
+        comm->write(f->payload[i]);
+    }
+    bool sent = true;
+    if (wait)
+        comm->sendData();
+    else
+        sent = comm->sendDataNoWait();
+    unlock();
+    return sent;
+}
+
+// the ack timer of a request runs from when its frame left, not from when it
+// was queued behind other frames
+void SerialLink::frameWritten(TxFrame *f)
+{
+    if (f->payload[1] == PROTOCOL_FRAME_TYPE_ACK)
+        return;
+    std::lock_guard<std::mutex> guard(pendingMtx);
+    PendingRequest &p = pendingRequests[f->payload[0]];
+    if (p.active && p.size == f->size && memcmp(p.payload, f->payload, f->size) == 0)
     {
-        // printf ("writing payload[%d] = %d\n - buffer: %d\n", i, payload[i], comm->sendDataSize());
-        comm->write(payload[i]);
+        p.written = true;
+        p.sentAt = std::chrono::steady_clock::now();
+        scheduleTimer(f->payload[0], rtt.timeout_ms(rttDevice(p.payload), p.timeouts));
     }
+}
 
-    // lock();
-    comm->sendData();
-    // unlock();
+// runs on the TxScheduler thread, one frame at a time
+void SerialLink::writeFrame(TxFrame *f)
+{
+    startFrame(f, true);
+    frameWritten(f);
+}
+
+// fires txTimerFd after delay_ms, right away with 0
+void SerialLink::armTxTimer(unsigned int delay_ms)
+{
+    struct itimerspec ts;
+    memset(&ts, 0, sizeof(ts));
+    ts.it_value.tv_nsec = delay_ms > 0 ? delay_ms * 1000000L : 1;
+    if (timerfd_settime(txTimerFd, 0, &ts, nullptr) < 0)
+        fprintf(stderr, "unable to arm the link TX timer: %s\n", strerror(errno));
+}
+
+// runs on the reactor thread when txTimerFd fires: right after the TxScheduler
+// queued a frame while idle, then SERIAL_WAIT_DELAY_ms after every frame until
+// nothing is queued. Writes a frame at a time without ever waiting on the port,
+// the timer keeps the frames apart and retries a frame the driver had no room for.
+void SerialLink::reactorTxHandler()
+{
+    uint64_t expirations;
+    if (::read(txTimerFd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+        fprintf(stderr, "unable to read the link TX timer: %s\n", strerror(errno));
+
+    bool sent;
+    if (txWriting == nullptr)
+    {
+        // nothing left: the scheduler arms the timer for the next frame
+        txWriting = txScheduler.take();
+        if (txWriting == nullptr)
+            return;
+        sent = startFrame(txWriting, false);
+    }
+    else
+    {
+        lock();
+        sent = comm->sendPendingData();
+        unlock();
+    }
+
+    if (sent)
+    {
+        frameWritten(txWriting);
+        txScheduler.done(txWriting);
+        txWriting = nullptr;
+    }
+    armTxTimer(SERIAL_WAIT_DELAY_ms);
+}
+
+// once the reactor no longer writes for the link: sends the rest of the frame
+// it was writing and whatever is still queued, as the TX thread does on stop()
+void SerialLink::drainTx()
+{
+    if (txWriting != nullptr)
+    {
+        unsigned int waited = 0;
+        lock();
+        while (!comm->sendPendingData() && waited < SERIAL_WRITE_TIMEOUT_ms)
+            waited += wait();
+        unlock();
+        frameWritten(txWriting);
+        txScheduler.done(txWriting);
+        txWriting = nullptr;
+    }
+
+    TxFrame *f;
+    while ((f = txScheduler.take()) != nullptr)
+    {
+        writeFrame(f);
+        txScheduler.done(f);
+    }
+}
+
+int SerialLink::txClassOf(const uchar *payload)
+{
+    switch (payload[1])
+    {
+    case PROTOCOL_FRAME_TYPE_ACK:
+        return TX_CLASS_CONTROL;
+    case PROTOCOL_FRAME_TYPE_DATA:
+        return deviceTxClass[payload[2]];
+    case PROTOCOL_FRAME_TYPE_FRAGMENT:
+        return TX_CLASS_BULK;
+    default:
+        return TX_CLASS_NORMAL;
+    }
+}
+
+void SerialLink::untrackedRequest(int num_params, uchar *payload)
+{
+    std::vector<SerialLinkCompletion> failed;
+    bool batched = false;
+    {
+        SerialLinkCompletion none;
+        std::lock_guard<std::mutex> guard(pendingMtx);
+        if (txBatchWindow_ms > 0)
+            batched = appendToBatch(num_params, payload, none, failed);
+    }
+    for (auto &f : failed)
+        if (f)
+            f(false);
+    if (batched)
+        return;
+
+    payload[0] = requestAckWindow.untrackedFrameId();
+    request(num_params, payload);
 }
 
 bool SerialLink::syncRequest(int num_params, uchar *payload)
 {
-    unsigned int time_ms = 0, ack_time_ms = 0;
+    bool batching;
+    {
+        std::lock_guard<std::mutex> guard(pendingMtx);
+        batching = txBatchWindow_ms > 0;
+    }
+    if (batching)
+    {
+        std::promise<bool> promise;
+        std::future<bool> result = promise.get_future();
+        submitRequest(num_params, payload, [&promise](bool acked) { promise.set_value(acked); });
+        return result.get();
+    }
+
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(REQUEST_TIMEOUT_ms);
+    uchar frameId;
 
-    while (time_ms < REQUEST_TIMEOUT_ms)
+    if (!requestAckWindow.acquire(frameId, deadline))
     {
-        ack_time_ms = 0;
+#ifdef DEBUG
+        printf("syncRequest(): ack window full\n");
+#endif
+        return false;
+    }
+
+    // retries resend the same frameId, so only this frame is retransmitted and
+    // a late ACK for an earlier attempt still counts
+    payload[0] = frameId;
+    bool acked = false;
+
+    int device = rttDevice(payload);
+    unsigned int attempt = 0;
+    unsigned int timeouts = 0;
+
+    while (!acked && std::chrono::steady_clock::now() < deadline)
+    {
+        if (attempt > 0)
+            metrics.retransmits.add();
+        // request() may first wait out the gap after the previous frame, the
+        // round trip starts once it returns
         request(num_params, payload);
+        auto sentAt = std::chrono::steady_clock::now();
 
-        while (ack_time_ms < ACK_TIMEOUT_ms)
-        {
-            if (this->requestAckWaitCheck.isAck(payload[0]))
-                return true;
+        // the receive thread wakes us up as soon as checkAck() sees our frameId,
+        // or checkNack() does, in which case we resend right away. Only timeouts
+        // back off, a NACK means the device is there.
+        auto ackDeadline = std::min(deadline, sentAt + std::chrono::milliseconds(rtt.timeout_ms(device, timeouts)));
+        acked = requestAckWindow.waitAck(frameId, ackDeadline);
 
-            ack_time_ms += wait();
+        // an ACK after a retransmission can't tell which copy it answers (Karn)
+        if (acked && attempt == 0)
+        {
+            uint32_t rtt_us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - sentAt).count();
+            rtt.sample(device, rtt_us);
+            metrics.ackRtt_us.record(rtt_us);
         }
+        if (!acked && std::chrono::steady_clock::now() >= ackDeadline)
+        {
+            timeouts++;
+            metrics.ackTimeouts.add();
 #ifdef DEBUG
-        printf("syncRequest(): ACK timeout\n");
+            printf("syncRequest(): ACK timeout for frameId %d\n", frameId);
 #endif
-        time_ms += ack_time_ms;
+        }
+        attempt++;
+    }
+    if (!acked)
+        metrics.requestTimeouts.add();
+
+    std::vector<SerialLinkCompletion> failed;
+    {
+        std::lock_guard<std::mutex> guard(pendingMtx);
+        releaseFrame(frameId, failed);
+    }
+    for (auto &f : failed)
+        if (f)
+            f(false);
+
+    return acked;
+}
+
+bool SerialLink::sendMessage(uchar deviceId, const uchar *data, unsigned int size)
+{
+    const unsigned int maxChunk = DEVICE_FRAME_MAX_SIZE - FRAGMENT_FRAME_HEADER_SIZE;
+    if (size > FRAGMENT_MAX_MESSAGE_SIZE)
+        return false;
+
+    uchar frameId;
+    if (!requestAckWindow.acquire(frameId, std::chrono::steady_clock::now() + std::chrono::milliseconds(REQUEST_TIMEOUT_ms)))
+        return false;
+
+    uint16_t count = fragmentCount(size, maxChunk);
+    uint32_t chunk = fragmentChunkSize(size, count);
+    uchar msgId = nextMessageId++;
+    uchar payload[DEVICE_FRAME_MAX_SIZE];
+    payload[1] = PROTOCOL_FRAME_TYPE_FRAGMENT;
+    payload[2] = deviceId;
+
+    // only the last fragment is tracked: its ACK or NACK stands for the whole
+    // message. A resend repeats every fragment, the device keeps what it has.
+    bool acked = false;
+    unsigned int attempt = 0;
+    unsigned int timeouts = 0;
+    std::chrono::steady_clock::time_point deadline;
+    while (!acked && (attempt == 0 || std::chrono::steady_clock::now() < deadline))
+    {
+        if (attempt > 0)
+            metrics.retransmits.add();
+        for (uint16_t seq = 0; seq < count; seq++)
+        {
+            uint32_t n = fragmentSize(size, count, seq);
+            payload[0] = seq == count - 1 ? frameId : requestAckWindow.untrackedFrameId();
+            FragmentHeader::encode(&payload[3], msgId, seq, count, size);
+            memcpy(&payload[FRAGMENT_FRAME_HEADER_SIZE], data + (uint32_t)seq * chunk, n);
+            request(FRAGMENT_FRAME_HEADER_SIZE + n, payload);
+        }
+
+        auto sentAt = std::chrono::steady_clock::now();
+        if (attempt == 0)
+            deadline = sentAt + std::chrono::milliseconds(REQUEST_TIMEOUT_ms);
+        auto ackDeadline = std::min(deadline, sentAt + std::chrono::milliseconds(rtt.timeout_ms(deviceId, timeouts)));
+        acked = requestAckWindow.waitAck(frameId, ackDeadline);
+        if (!acked && std::chrono::steady_clock::now() >= ackDeadline)
+        {
+            timeouts++;
+            metrics.ackTimeouts.add();
+        }
+        attempt++;
+    }
+    if (!acked)
+        metrics.requestTimeouts.add();
+
+    std::vector<SerialLinkCompletion> failed;
+    {
+        std::lock_guard<std::mutex> guard(pendingMtx);
+        releaseFrame(frameId, failed);
+    }
+    for (auto &f : failed)
+        if (f)
+            f(false);
+
+    return acked;
+}
+
+uint64_t SerialLink::timerTick()
+{
+    auto elapsed = std::chrono::steady_clock::now() - startTime;
+    return std::chrono::duration_cast<std::chrono::milliseconds>(elapsed).count() / TIMER_WHEEL_TICK_ms;
+}
+
+// pendingMtx must be held. The frame is posted to the TX thread, writeFrame()
+// restarts the timer once it has left.
+void SerialLink::startPendingRequest(uchar frameId, uchar *payload, int size, std::chrono::steady_clock::time_point deadline, SerialLinkCompletion &onComplete)
+{
+    PendingRequest &p = pendingRequests[frameId];
+    p.active = true;
+    memcpy(p.payload, payload, size);
+    p.payload[0] = frameId;
+    p.size = size;
+    p.deadline = deadline;
+    p.onComplete = std::move(onComplete);
+    p.retries = 0;
+    p.timeouts = 0;
+    p.written = false;
+    p.sentAt = std::chrono::steady_clock::now();
+
+    scheduleTimer(frameId, rtt.timeout_ms(rttDevice(p.payload), 0));
+    // a frame the TX queue had no room for is as good as lost on the wire: the
+    // timer resends it
+    if (!postRequest(p.size, p.payload))
+        p.written = true;
+}
+
+// the deviceId whose round-trip estimate a frame updates, -1 for a DATA_LIST
+// frame that addresses several devices
+int SerialLink::rttDevice(const uchar *payload)
+{
+    return payload[1] == PROTOCOL_FRAME_TYPE_DATA ? payload[2] : -1;
+}
+
+// pendingMtx must be held. The wheel only moves when a timer comes due, so
+// its tick lags behind the clock: count the delay from now.
+void SerialLink::scheduleTimer(int id, unsigned int delay_ms)
+{
+    uint64_t now = timerTick();
+    uint64_t lag = now > requestTimers.tick() ? now - requestTimers.tick() : 0;
+    uint64_t expiry = requestTimers.schedule(id, lag + delay_ms / TIMER_WHEEL_TICK_ms);
+    wakeTimer(startTime + std::chrono::milliseconds(expiry * TIMER_WHEEL_TICK_ms));
+}
+
+// pendingMtx must be held. Frees the frameId and hands the window slot to the
+// oldest queued request. Queued requests whose deadline passed while waiting are
+// returned in failed, to be completed once the lock is dropped.
+void SerialLink::releaseFrame(uchar frameId, std::vector<SerialLinkCompletion> &failed)
+{
+    requestAckWindow.release(frameId);
+
+    auto now = std::chrono::steady_clock::now();
+    uchar nextFrameId;
+    while (!requestBacklog.empty())
+    {
+        QueuedRequest &q = requestBacklog.front();
+        if (q.deadline <= now)
+        {
+            metrics.requestTimeouts.add();
+            failed.push_back(std::move(q.onComplete));
+            requestBacklog.pop();
+            continue;
+        }
+        if (!requestAckWindow.acquire(nextFrameId))
+            break;
+        startPendingRequest(nextFrameId, q.payload, q.size, q.deadline, q.onComplete);
+        requestBacklog.pop();
+    }
+    backlogCv.notify_all();
+}
+
+void SerialLink::completePendingRequest(uchar frameId, bool acked)
+{
+    SerialLinkCompletion done;
+    std::vector<SerialLinkCompletion> failed;
+    {
+        std::lock_guard<std::mutex> guard(pendingMtx);
+        PendingRequest &p = pendingRequests[frameId];
+        if (!p.active)
+            return;
+
+        p.active = false;
+        if (acked && p.retries == 0)
+        {
+            uint32_t rtt_us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - p.sentAt).count();
+            rtt.sample(rttDevice(p.payload), rtt_us);
+            metrics.ackRtt_us.record(rtt_us);
+        }
+        done = std::move(p.onComplete);
+        requestTimers.cancel(frameId);
+        releaseFrame(frameId, failed);
     }
 
+    if (done)
+        done(acked);
+    for (auto &f : failed)
+        if (f)
+            f(false);
+}
+
+// pendingMtx must be held. Sends the request right away when the ack window
+// has room, queues it otherwise. Returns false when the backlog is full, in
+// which case onComplete is left untouched.
+bool SerialLink::enqueueRequest(uchar *payload, int size, std::chrono::steady_clock::time_point deadline, SerialLinkCompletion &onComplete)
+{
+    uchar frameId;
+    if (requestBacklog.empty() && requestAckWindow.acquire(frameId))
+    {
+        startPendingRequest(frameId, payload, size, deadline, onComplete);
+        return true;
+    }
+    if (!requestBacklog.full())
+    {
+        QueuedRequest &q = requestBacklog.back();
+        memcpy(q.payload, payload, size);
+        q.size = size;
+        q.deadline = deadline;
+        q.onComplete = std::move(onComplete);
+        requestBacklog.push();
+        wakeTimer(deadline);
+        return true;
+    }
+#ifdef DEBUG
+    printf("enqueueRequest(): request backlog full\n");
+#endif
     return false;
 }
 
-SerialLink::SerialLink(ISerialCommunication *comm)
+// pendingMtx must be held. Adds the DATA request in payload to the current
+// batch, flushing it first if the request doesn't fit. Returns false for a
+// request too large to ever share a frame, which the caller sends on its own.
+bool SerialLink::appendToBatch(int num_params, uchar *payload, SerialLinkCompletion &onComplete, std::vector<SerialLinkCompletion> &failed)
 {
-    this->comm = comm;
-    initialize();
+    // [frameId, DATA, deviceId, params...] becomes [deviceId, 1 + num params, params...]
+    int entrySize = num_params - 1;
+    if (num_params < 3 || payload[1] != PROTOCOL_FRAME_TYPE_DATA || 2 + entrySize > (int)txBatchMaxSize)
+        return false;
+    if (deviceTxClass[payload[2]] == TX_CLASS_CONTROL)
+        return false;
+
+    if (txBatch.size + entrySize > (int)txBatchMaxSize)
+        flushBatch(failed);
+
+    if (txBatch.count == 0)
+    {
+        txBatch.payload[0] = 0;
+        txBatch.payload[1] = PROTOCOL_FRAME_TYPE_DATA_LIST;
+        txBatch.size = 2;
+        scheduleTimer(TX_BATCH_TIMER_ID, txBatchWindow_ms);
+    }
+
+    uchar *entry = &txBatch.payload[txBatch.size];
+    entry[0] = payload[2];
+    entry[1] = entrySize - 1;
+    for (int i = 3; i < num_params; i++)
+        entry[i - 1] = payload[i];
+    txBatch.size += entrySize;
+    txBatch.count++;
+    if (onComplete)
+        txBatch.completions.push_back(std::move(onComplete));
+
+    if (txBatch.size >= (int)txBatchMaxSize)
+        flushBatch(failed);
+    return true;
 }
-SerialLink::SerialLink(const char *device)
+
+// pendingMtx must be held. Sends the current batch, completions that can't be
+// sent because the backlog is full are returned in failed.
+void SerialLink::flushBatch(std::vector<SerialLinkCompletion> &failed)
 {
-    this->comm = new SerialCommunication(device);
-    initialize();
+    requestTimers.cancel(TX_BATCH_TIMER_ID);
+    if (txBatch.count == 0)
+        return;
+
+    uchar single[SND_BUFFER_SIZE];
+    uchar *payload = txBatch.payload;
+    int size = txBatch.size;
+    if (txBatch.count == 1)
+    {
+        // a lone request goes out as a plain DATA frame
+        single[0] = 0;
+        single[1] = PROTOCOL_FRAME_TYPE_DATA;
+        single[2] = txBatch.payload[2];
+        for (int i = 4; i < txBatch.size; i++)
+            single[i - 1] = txBatch.payload[i];
+        payload = single;
+        size = txBatch.size - 1;
+    }
+
+    std::vector<SerialLinkCompletion> completions;
+    completions.swap(txBatch.completions);
+    txBatch.size = 0;
+    txBatch.count = 0;
+
+    SerialLinkCompletion onComplete = [completions](bool acked) {
+        for (auto &c : completions)
+            c(acked);
+    };
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(REQUEST_TIMEOUT_ms);
+    if (!enqueueRequest(payload, size, deadline, onComplete))
+        failed.insert(failed.end(), completions.begin(), completions.end());
 }
 
-SerialLink::~SerialLink()
+// returns the size of the SUBSCRIBE frame built in payload
+int SerialLink::buildSubscribe(uchar *payload, uchar deviceId, uint16_t period_ms)
+{
+    payload[0] = 0;
+    payload[1] = PROTOCOL_FRAME_TYPE_SUBSCRIBE;
+    payload[2] = deviceId;
+    return 3 + SubscribeRequest::encode(&payload[3], period_ms, SUBSCRIPTION_LEASE_ms);
+}
+
+// pendingMtx must be held. Sends the renewals that are due, like
+// asyncRequestWithAck() requests: a lost one is retransmitted, one that fails
+// altogether is simply retried at the next renewal. Then rearms the timer for
+// the earliest one to come.
+void SerialLink::renewSubscriptions()
 {
-    if (run)
+    auto now = std::chrono::steady_clock::now();
+    auto next = std::chrono::steady_clock::time_point::max();
+    uchar payload[3 + SubscribeRequest::size];
+    for (int i = 0; i < HANDLER_TABLE_SIZE; i++)
     {
-        run = false;
-        this->rcvThread->join();
+        Subscription &sub = subscriptions[i];
+        if (!sub.active)
+            continue;
+        if (sub.renewAt <= now)
+        {
+            SerialLinkCompletion none;
+            int size = buildSubscribe(payload, i, sub.period_ms);
+            enqueueRequest(payload, size, now + std::chrono::milliseconds(REQUEST_TIMEOUT_ms), none);
+            sub.renewAt = now + std::chrono::milliseconds(SUBSCRIPTION_RENEW_ms);
+        }
+        next = std::min(next, sub.renewAt);
     }
-    delete this->comm;
-    delete this->rcvThread;
 
-    delete this->handlers;
+    if (next == std::chrono::steady_clock::time_point::max())
+        return;
+    auto delay = std::chrono::duration_cast<std::chrono::milliseconds>(next - now).count();
+    scheduleTimer(SUBSCRIPTION_TIMER_ID, delay > 0 ? delay : 0);
 }
 
-void SerialLink::addHandler(uchar deviceId, uchar handlerId, std::function<void(ResponseData *)> &func)
+bool SerialLink::subscribe(uchar deviceId, unsigned int period_ms)
+{
+    if (period_ms == 0)
+        return unsubscribe(deviceId);
+    if (period_ms > 0xffff)
+        period_ms = 0xffff;
+
+    uchar payload[3 + SubscribeRequest::size];
+    int size = buildSubscribe(payload, deviceId, period_ms);
+    if (!syncRequest(size, payload))
+        return false;
+
+    std::lock_guard<std::mutex> guard(pendingMtx);
+    Subscription &sub = subscriptions[deviceId];
+    sub.active = true;
+    sub.period_ms = period_ms;
+    sub.renewAt = std::chrono::steady_clock::now() + std::chrono::milliseconds(SUBSCRIPTION_RENEW_ms);
+    if (!requestTimers.isArmed(SUBSCRIPTION_TIMER_ID))
+        scheduleTimer(SUBSCRIPTION_TIMER_ID, SUBSCRIPTION_RENEW_ms);
+    return true;
+}
+
+bool SerialLink::unsubscribe(uchar deviceId)
 {
-    if ((*this->handlers).find(deviceId) == (*this->handlers).end())
     {
-        (*this->handlers)[deviceId] = new std::vector<SerialLinkResponseCallback *>();
+        std::lock_guard<std::mutex> guard(pendingMtx);
+        subscriptions[deviceId].active = false;
     }
-    auto vector = ((*this->handlers)[deviceId]);
 
-    SerialLinkResponseCallback *rc = new SerialLinkResponseCallback();
-    rc->id = handlerId;
-    rc->callback = func;
-    vector->push_back(rc);
+    uchar payload[3 + SubscribeRequest::size];
+    int size = buildSubscribe(payload, deviceId, 0);
+    return syncRequest(size, payload);
 }
 
-void SerialLink::removeHandler(uchar deviceId, uchar handlerId)
+// a NACKed asyncRequestWithAck() frame is resent without waiting for its ACK
+// timeout. syncRequest() frames aren't pending requests, their waiter resends.
+void SerialLink::retransmitPendingRequest(uchar frameId)
 {
-    if ((*this->handlers).find(deviceId) == (*this->handlers).end())
+    std::lock_guard<std::mutex> guard(pendingMtx);
+    PendingRequest &p = pendingRequests[frameId];
+    // a copy still waiting to be sent will do
+    if (!p.active || !p.written)
         return;
 
-    std::vector<SerialLinkResponseCallback *> *vector = (*this->handlers)[deviceId];
+#ifdef DEBUG
+    printf("asyncRequestWithAck(): NACK for frameId %d, retransmitting\n", frameId);
+#endif
+    // Karn: no RTT sample from this frame anymore, but no backoff either
+    p.retries++;
+    p.written = false;
+    metrics.retransmits.add();
+    scheduleTimer(frameId, rtt.timeout_ms(rttDevice(p.payload), p.timeouts));
+    if (!postRequest(p.size, p.payload))
+        p.written = true;
+}
 
-    for (auto it = vector->begin(); it != vector->end(); it++)
+void SerialLink::submitRequest(int num_params, uchar *payload, SerialLinkCompletion onComplete)
+{
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(REQUEST_TIMEOUT_ms);
+    std::vector<SerialLinkCompletion> failed;
+    bool sent = false;
     {
-        if ((*it)->id == handlerId)
+        // frames are posted to the TX thread, a caller issuing requests faster
+        // than the link sends them waits here until the requests queued before
+        // are on their way
+        std::unique_lock<std::mutex> lk(pendingMtx);
+        backlogCv.wait_until(lk, deadline, [this] { return requestBacklog.empty() || !run; });
+        if (run)
         {
-            vector->erase(it);
-            delete *it;
+            if (txBatchWindow_ms > 0 && appendToBatch(num_params, payload, onComplete, failed))
+                sent = true;
+            else
+                sent = enqueueRequest(payload, num_params, deadline, onComplete);
+        }
+    }
+
+    if (!sent && onComplete)
+        onComplete(false);
+    for (auto &f : failed)
+        if (f)
+            f(false);
+}
+
+// pendingMtx must be held. A timer was armed or a request queued that comes
+// due at the given time: wakes whatever runs the timer wheel earlier if it
+// would sleep past it.
+void SerialLink::wakeTimer(std::chrono::steady_clock::time_point at)
+{
+    if (at >= timerWakeAt)
+        return;
+    if (reactor == nullptr)
+    {
+        // the thread computes its new deadline itself
+        timerWakeAt = at;
+        timerCv.notify_one();
+        return;
+    }
+    armTimerFd(at);
+}
+
+// pendingMtx must be held. When the earliest armed timer or the oldest queued
+// request comes due, time_point::max() when there is nothing to time.
+std::chrono::steady_clock::time_point SerialLink::nextTimerDeadline()
+{
+    auto next = std::chrono::steady_clock::time_point::max();
+    if (!requestTimers.empty())
+        next = startTime + std::chrono::milliseconds(requestTimers.nextExpiry() * TIMER_WHEEL_TICK_ms);
+    if (!requestBacklog.empty() && requestBacklog.front().deadline < next)
+        next = requestBacklog.front().deadline;
+    return next;
+}
+
+// pendingMtx must be held. Sets timerFd to fire once at the given time, or
+// disarms it for time_point::max(). steady_clock is CLOCK_MONOTONIC, the clock
+// of timerFd, so the deadline is passed as an absolute time.
+void SerialLink::armTimerFd(std::chrono::steady_clock::time_point at)
+{
+    if (timerFd < 0)
+        return;
+
+    struct itimerspec ts;
+    memset(&ts, 0, sizeof(ts));
+    if (at != std::chrono::steady_clock::time_point::max())
+    {
+        int64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(at.time_since_epoch()).count();
+        ts.it_value.tv_sec = ns / 1000000000;
+        ts.it_value.tv_nsec = ns % 1000000000;
+    }
+    if (timerfd_settime(timerFd, TFD_TIMER_ABSTIME, &ts, nullptr) == 0)
+        timerWakeAt = at;
+}
+
+// pendingMtx must be held. Fires the timers that came due, completions of the
+// requests that timed out are returned in failed.
+void SerialLink::expireTimers(std::vector<SerialLinkCompletion> &failed)
+{
+    auto now = std::chrono::steady_clock::now();
+    requestTimers.advance(timerTick(), [&](int id) {
+        if (id == TX_BATCH_TIMER_ID)
+        {
+            flushBatch(failed);
+            return;
+        }
+        if (id == SUBSCRIPTION_TIMER_ID)
+        {
+            renewSubscriptions();
+            return;
+        }
+
+        PendingRequest &p = pendingRequests[id];
+        if (!p.active)
+            return;
+
+        if (p.deadline <= now)
+        {
+#ifdef DEBUG
+            printf("asyncRequestWithAck(): request timeout for frameId %d\n", id);
+#endif
+            p.active = false;
+            metrics.requestTimeouts.add();
+            failed.push_back(std::move(p.onComplete));
+            releaseFrame(id, failed);
+            return;
+        }
+        // still queued behind other frames: not lost, wait for it to leave
+        if (!p.written)
+        {
+            scheduleTimer(id, rtt.timeout_ms(rttDevice(p.payload), p.timeouts));
             return;
         }
+#ifdef DEBUG
+        printf("asyncRequestWithAck(): ACK timeout for frameId %d, retransmitting\n", id);
+#endif
+        p.retries++;
+        p.timeouts++;
+        p.written = false;
+        metrics.ackTimeouts.add();
+        metrics.retransmits.add();
+        scheduleTimer(id, rtt.timeout_ms(rttDevice(p.payload), p.timeouts));
+        if (!postRequest(p.size, p.payload))
+            p.written = true;
+    });
+
+    // requests stuck in the backlog behind syncRequest() frames still time out
+    while (!requestBacklog.empty() && requestBacklog.front().deadline <= now)
+    {
+        metrics.requestTimeouts.add();
+        failed.push_back(std::move(requestBacklog.front().onComplete));
+        requestBacklog.pop();
     }
+    backlogCv.notify_all();
 }
 
-bool SerialLink::hasHandler(uchar deviceId, uchar handlerId)
+void SerialLink::timerThreadHandler()
 {
-    if ((*this->handlers).find(deviceId) == (*this->handlers).end())
-        return false;
+    std::vector<SerialLinkCompletion> failed;
+    std::unique_lock<std::mutex> lk(pendingMtx);
+
+    while (run)
+    {
+        // sleep until the earliest deadline rather than ticking, or until a
+        // request is submitted when nothing is timed. wakeTimer() notifies when
+        // a timer armed meanwhile comes due earlier.
+        timerWakeAt = nextTimerDeadline();
+        if (timerWakeAt == std::chrono::steady_clock::time_point::max())
+            timerCv.wait(lk);
+        else
+            timerCv.wait_until(lk, timerWakeAt);
+        expireTimers(failed);
+
+        if (!failed.empty())
+        {
+            lk.unlock();
+            for (auto &f : failed)
+                if (f)
+                    f(false);
+            failed.clear();
+            lk.lock();
+        }
+    }
+}
 
-    std::vector<SerialLinkResponseCallback *> *vector = (*this->handlers)[deviceId];
+// runs on the reactor thread when timerFd fires at the earliest deadline
+void SerialLink::reactorTimerHandler()
+{
+    uint64_t expirations;
+    if (::read(timerFd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+        fprintf(stderr, "unable to read the link timer: %s\n", strerror(errno));
 
-    for (auto it = vector->begin(); it != vector->end(); it++)
+    std::vector<SerialLinkCompletion> failed;
     {
-        if ((*it)->id == handlerId)
-            return true;
+        std::lock_guard<std::mutex> guard(pendingMtx);
+        expireTimers(failed);
+        // disarmed when nothing is left to time, until wakeTimer()
+        armTimerFd(nextTimerDeadline());
     }
 
-    return false;
+    for (auto &f : failed)
+        if (f)
+            f(false);
+}
+
+void SerialLink::setAckWindowSize(unsigned int size)
+{
+    requestAckWindow.setWindowSize(size);
+}
+
+void SerialLink::setDevicePriority(uchar deviceId, int txClass)
+{
+    if (txClass < TX_CLASS_CONTROL || txClass >= TX_CLASS_COUNT)
+        return;
+    deviceTxClass[deviceId] = txClass;
+}
+
+void SerialLink::setTxWeight(int txClass, unsigned int weight)
+{
+    txScheduler.setWeight(txClass, weight);
+}
+
+void SerialLink::setTxBatching(unsigned int window_ms, unsigned int maxFrameSize)
+{
+    std::vector<SerialLinkCompletion> failed;
+    {
+        std::lock_guard<std::mutex> guard(pendingMtx);
+        flushBatch(failed);
+        if (maxFrameSize > SND_BUFFER_SIZE)
+            maxFrameSize = SND_BUFFER_SIZE;
+        txBatchWindow_ms = window_ms;
+        txBatchMaxSize = maxFrameSize;
+    }
+    for (auto &f : failed)
+        if (f)
+            f(false);
+}
+
+RttStats SerialLink::getRttStats()
+{
+    return rtt.linkStats();
+}
+
+RttStats SerialLink::getRttStats(uchar deviceId)
+{
+    return rtt.deviceStats(deviceId);
 }
 
+DispatchStats SerialLink::getDispatchStats()
+{
+    if (dispatcher != nullptr)
+        return dispatcher->stats();
+
+    DispatchStats s;
+    memset(&s, 0, sizeof(s));
+    return s;
+}
 
-void SerialLink::clearHandlers()
+LinkMetricsSnapshot SerialLink::getMetrics()
+{
+    LinkMetricsSnapshot s;
+    metrics.snapshot(s);
+    return s;
+}
+
+std::string SerialLink::dumpMetrics(const char *prefix)
+{
+    return LinkMetrics::format(getMetrics(), prefix);
+}
+
+bool SerialLink::startRecording(const char *path, uint32_t capacity)
+{
+    return recorder.open(path, capacity);
+}
+
+void SerialLink::stopRecording()
+{
+    recorder.close();
+}
+
+SerialLink::SerialLink(ISerialCommunication *comm, bool eventDriven, unsigned int dispatchWorkers)
+{
+    this->comm = comm;
+    this->eventDriven = eventDriven;
+    this->dispatchWorkers = dispatchWorkers;
+    this->reactor = nullptr;
+    initialize();
+}
+SerialLink::SerialLink(const char *device, bool eventDriven, unsigned int dispatchWorkers)
 {
-    for (auto it = (*this->handlers).begin(); it != (*this->handlers).end(); it++)
+    this->comm = new SerialCommunication(device);
+    this->eventDriven = eventDriven;
+    this->dispatchWorkers = dispatchWorkers;
+    this->reactor = nullptr;
+    initialize();
+}
+SerialLink::SerialLink(ISerialCommunication *comm, SerialReactor *reactor)
+{
+    this->comm = comm;
+    this->eventDriven = true;
+    this->dispatchWorkers = DISPATCH_WORKERS_DEFAULT;
+    this->reactor = reactor;
+    initialize();
+}
+SerialLink::SerialLink(const char *device, SerialReactor *reactor)
+{
+    this->comm = new SerialCommunication(device);
+    this->eventDriven = true;
+    this->dispatchWorkers = DISPATCH_WORKERS_DEFAULT;
+    this->reactor = reactor;
+    initialize();
+}
+
+SerialLink::~SerialLink()
+{
+    if (run && reactor != nullptr)
+    {
+        run = false;
+        reactor->remove(comm->fileDescriptor());
+        reactor->remove(timerFd);
+
+        // a handler still running on a shared worker may submit a request and
+        // arm the timer, armTimerFd() leaves it alone once it is -1
+        int fd;
+        {
+            std::lock_guard<std::mutex> guard(pendingMtx);
+            fd = timerFd;
+            timerFd = -1;
+        }
+        close(fd);
+
+        // the shared dispatch workers may still be running our handlers, and
+        // the reactor still writes what they send
+        responsePool.waitIdle();
+        txScheduler.stop();
+        reactor->remove(txTimerFd);
+        close(txTimerFd);
+        drainTx();
+    }
+    else if (run)
     {
-        for (auto it2 = it->second->begin(); it2 != it->second->end(); it2++)
+        run = false;
+        if (shutdownFd >= 0)
         {
-            if (*it2 != nullptr)
-            {
-                delete *it2;
-            }
+            uint64_t v = 1;
+            if (::write(shutdownFd, &v, sizeof(v)) < 0)
+                fprintf(stderr, "unable to signal receive thread shutdown: %s\n", strerror(errno));
         }
-        delete it->second;
+        this->rcvThread->join();
+
+        // let the workers finish the frames already received
+        delete this->dispatcher;
+        this->dispatcher = nullptr;
+
+        {
+            std::lock_guard<std::mutex> guard(pendingMtx);
+            timerCv.notify_all();
+        }
+        this->timerThread->join();
     }
+    if (shutdownFd >= 0)
+        close(shutdownFd);
+    txScheduler.stop();
+
+    // whatever is still waiting for an ACK will never get one
+    std::vector<SerialLinkCompletion> failed;
+    for (int i = 0; i < FRAME_ID_COUNT; i++)
+    {
+        if (pendingRequests[i].active)
+        {
+            pendingRequests[i].active = false;
+            failed.push_back(std::move(pendingRequests[i].onComplete));
+        }
+    }
+    while (!requestBacklog.empty())
+    {
+        failed.push_back(std::move(requestBacklog.front().onComplete));
+        requestBacklog.pop();
+    }
+    for (auto &c : txBatch.completions)
+        failed.push_back(std::move(c));
+    txBatch.completions.clear();
+    for (auto &f : failed)
+        if (f)
+            f(false);
+    delete this->comm;
+    delete this->rcvThread;
+    delete this->timerThread;
+
+    handlers.clear();
 }
 
-bool SerialLink::syncRequest(uchar deviceId)
+void SerialLink::addHandler(uchar deviceId, uchar handlerId, std::function<void(ResponseData *)> &func)
 {
-    uchar *payload = allocBuffer(3);
-    payload[0] = 0;
-    payload[1] = PROTOCOL_FRAME_TYPE_DATA;
-    payload[2] = deviceId;
-    return syncRequest(3, payload);
+    handlers.add(deviceId, handlerId, func);
+}
+
+void SerialLink::removeHandler(uchar deviceId, uchar handlerId)
+{
+    handlers.remove(deviceId, handlerId);
+}
+
+bool SerialLink::hasHandler(uchar deviceId, uchar handlerId)
+{
+    return handlers.contains(deviceId, handlerId);
 }
 
+bool SerialLink::syncRequest(uchar deviceId)
+{
+    return syncRequest<MessageSchema<>>(deviceId);
+}
 bool SerialLink::syncRequest(uchar deviceId, uchar val1)
 {
-    uchar *payload = allocBuffer(4);
-    payload[0] = 0;
-    payload[1] = PROTOCOL_FRAME_TYPE_DATA;
-    payload[2] = deviceId;
-    payload[3] = val1;
-    return syncRequest(4, payload);
+    return syncRequest<MessageSchema<uint8_t>>(deviceId, val1);
 }
 bool SerialLink::syncRequest(int deviceId, uchar val1, uchar val2)
 {
-    uchar *payload = allocBuffer(5);
-    payload[0] = 0;
-    payload[1] = PROTOCOL_FRAME_TYPE_DATA;
-    payload[2] = deviceId;
-    payload[3] = val1;
-    payload[4] = val2;
-    return syncRequest(5, payload);
+    return syncRequest<MessageSchema<uint8_t, uint8_t>>(deviceId, val1, val2);
 }
 bool SerialLink::syncRequest(int deviceId, uchar val1, uint16_t val2)
 {
-    uchar *payload = allocBuffer(6);
-    payload[0] = 0;
-    payload[1] = PROTOCOL_FRAME_TYPE_DATA;
-    payload[2] = deviceId;
-    uint16p v;
-    v.val = val2;
-    payload[3] = val1;
-    payload[4] = v.bval[0];
-    payload[5] = v.bval[1];
-    return syncRequest(6, payload);
+    return syncRequest<MessageSchema<uint8_t, uint16_t>>(deviceId, val1, val2);
 }
-
 bool SerialLink::syncRequest(int deviceId, uchar val1, uchar val2, uchar val3)
 {
-    uchar *payload = allocBuffer(6);
-    payload[0] = 0;
-    payload[1] = PROTOCOL_FRAME_TYPE_DATA;
-    payload[2] = deviceId;
-    payload[3] = val1;
-    payload[4] = val2;
-    payload[5] = val3;
-    return syncRequest(6, payload);
+    return syncRequest<MessageSchema<uint8_t, uint8_t, uint8_t>>(deviceId, val1, val2, val3);
 }
 
 void SerialLink::asyncRequest(uchar deviceId)
 {
-    uchar *payload = allocBuffer(3);
-    payload[0] = 0;
-    payload[1] = PROTOCOL_FRAME_TYPE_DATA;
-    payload[2] = deviceId;
-    request(3, payload);
+    asyncRequest<MessageSchema<>>(deviceId);
 }
 void SerialLink::asyncRequest(uchar deviceId, uchar val1)
 {
-    uchar *payload = allocBuffer(4);
-    payload[0] = 0;
-    payload[1] = PROTOCOL_FRAME_TYPE_DATA;
-    payload[2] = deviceId;
-    payload[3] = val1;
-    request(4, payload);
+    asyncRequest<MessageSchema<uint8_t>>(deviceId, val1);
 }
 void SerialLink::asyncRequest(int deviceId, uchar val1, uchar val2)
 {
-    uchar *payload = allocBuffer(5);
-    payload[0] = 0;
-    payload[1] = PROTOCOL_FRAME_TYPE_DATA;
-    payload[2] = deviceId;
-    payload[3] = val1;
-    payload[4] = val2;
-    request(5, payload);
+    asyncRequest<MessageSchema<uint8_t, uint8_t>>(deviceId, val1, val2);
 }
 void SerialLink::asyncRequest(int deviceId, uchar val1, uchar val2, uchar val3)
 {
-    uchar *payload = allocBuffer(6);
+    asyncRequest<MessageSchema<uint8_t, uint8_t, uint8_t>>(deviceId, val1, val2, val3);
+}
+
+std::future<bool> SerialLink::asyncRequestWithAck(uchar deviceId, const uchar *params, int num_params)
+{
+    auto promise = std::make_shared<std::promise<bool>>();
+    std::future<bool> result = promise->get_future();
+    asyncRequestWithAck(deviceId, params, num_params, [promise](bool acked) { promise->set_value(acked); });
+    return result;
+}
+
+void SerialLink::asyncRequestWithAck(uchar deviceId, const uchar *params, int num_params, SerialLinkCompletion onComplete)
+{
+    // a frame the device can't take would only be retransmitted until it times out
+    if (num_params < 0 || num_params + 3 > SND_BUFFER_SIZE || num_params + 3 > DEVICE_FRAME_MAX_SIZE)
+    {
+        if (onComplete)
+            onComplete(false);
+        return;
+    }
+
+    uchar payload[SND_BUFFER_SIZE];
     payload[0] = 0;
     payload[1] = PROTOCOL_FRAME_TYPE_DATA;
     payload[2] = deviceId;
-    payload[3] = val1;
-    payload[4] = val2;
-    payload[5] = val3;
-    request(6, payload);
-}
+    for (int i = 0; i < num_params; i++)
+        payload[i + 3] = params[i];
+
+    submitRequest(num_params + 3, payload, onComplete);
+}
\ No newline at end of file
@@ -5,63 +5,318 @@
 #include "comm_types.h"
 #include <cstdarg>
 #include <thread>
-#include <queue>
 #include <condition_variable>
-#include <map>
 #include <vector>
 #include <functional>
 #include <tuple>
+#include <future>
+#include <memory>
+#include <atomic>
+
+#include "timer_wheel.h"
+#include "response_pool.h"
+#include "handler_registry.h"
+#include "dispatch_executor.h"
+#include "rtt_estimator.h"
+#include "serial_reactor.h"
+#include "link_metrics.h"
+#include "../arduino/message_schema.h"
+#include "fragment_reassembler.h"
+#include "tx_scheduler.h"
+#include "frame_capture.h"
+#include "../arduino/subscription.h"
 
-#define ACK_TIMEOUT_ms 100
 #define REQUEST_TIMEOUT_ms 1000
+#define REQUEST_BACKLOG_SIZE 1024 // must be a power of two
+
+// the Arduino side receives frames of at most 64 bytes, CRC included
+// (MAX_RCV_BUFFER_SIZE in arduino/async_comm.h)
+#define DEVICE_FRAME_MAX_SIZE (64 - FRAME_CRC_SIZE)
+// frameId, frame type and deviceId ahead of the params of a DATA frame
+#define REQUEST_HEADER_SIZE 3
+
+// outbound DATA_LIST batches fill at most one device frame
+#define TX_BATCH_MAX_SIZE DEVICE_FRAME_MAX_SIZE
+// timer wheel id of the batch flush, past the frameId timers
+#define TX_BATCH_TIMER_ID FRAME_ID_COUNT
+// timer wheel id of the subscription renewals
+#define SUBSCRIPTION_TIMER_ID (FRAME_ID_COUNT + 1)
+// subscriptions are renewed three times per lease, so a renewal may be lost
+// and retransmitted before the device lets it lapse
+#define SUBSCRIPTION_RENEW_ms (SUBSCRIPTION_LEASE_ms / 3)
 
 // #define DEBUG 1
 
-class AckWait
+// frameIds are 1..255, 0 is never handed out
+#define FRAME_ID_COUNT 256
+#define ACK_WINDOW_SIZE 8
+
+// Tracks the frames waiting for an ACK. Up to windowSize frames may be in flight
+// at the same time, each one keyed by its own frameId, so requests issued from
+// different threads don't have to wait for each other's round trip.
+class AckWindow
 {
 private:
-    uchar frameId;
-    bool frameAck;
+    typedef struct
+    {
+        bool inUse;
+        bool acked;
+        bool nacked;
+    } Slot;
 
-public:
-    AckWait()
+    Slot slots[FRAME_ID_COUNT];
+    uchar lastFrameId;
+    unsigned int inFlight;
+    unsigned int windowSize;
+    std::mutex mtx;
+    std::condition_variable ackCv;
+    std::condition_variable slotCv;
+
+    bool acquireLocked(uchar &frameId)
     {
-        frameId = 0;
-        frameAck = false;
+        if (inFlight >= windowSize)
+            return false;
+
+        frameId = nextFrameId();
+        slots[frameId].inUse = true;
+        slots[frameId].acked = false;
+        slots[frameId].nacked = false;
+        inFlight++;
+        return true;
+    }
+
+    uchar nextFrameId()
+    {
+        for (int i = 1; i < FRAME_ID_COUNT; i++)
+        {
+            if (lastFrameId == 255)
+                lastFrameId = 0;
+            ++lastFrameId;
+            if (!slots[lastFrameId].inUse)
+                return lastFrameId;
+        }
+        return 0;
     }
-    uchar getNextAckFrameId()
+
+public:
+    AckWindow()
     {
-        if (frameId == 255)
+        lastFrameId = 0;
+        inFlight = 0;
+        windowSize = ACK_WINDOW_SIZE;
+        for (int i = 0; i < FRAME_ID_COUNT; i++)
         {
-            frameId = 0;
+            slots[i].inUse = false;
+            slots[i].acked = false;
+            slots[i].nacked = false;
         }
-        return ++frameId;
     }
 
-    void checkAck(ResponseData *frame)
+    void setWindowSize(unsigned int size)
+    {
+        std::lock_guard<std::mutex> guard(mtx);
+        if (size < 1)
+            size = 1;
+        if (size > FRAME_ID_COUNT - 1)
+            size = FRAME_ID_COUNT - 1;
+        windowSize = size;
+        slotCv.notify_all();
+    }
+
+    unsigned int getWindowSize()
+    {
+        std::lock_guard<std::mutex> guard(mtx);
+        return windowSize;
+    }
+
+    // reserves a frameId that will be tracked until release(). Returns false when
+    // the window is full.
+    bool acquire(uchar &frameId)
+    {
+        std::lock_guard<std::mutex> guard(mtx);
+        return acquireLocked(frameId);
+    }
+
+    // same as acquire(), but waits for a slot to be released until deadline
+    bool acquire(uchar &frameId, std::chrono::steady_clock::time_point deadline)
+    {
+        std::unique_lock<std::mutex> lk(mtx);
+        if (!slotCv.wait_until(lk, deadline, [this] { return inFlight < windowSize; }))
+            return false;
+        return acquireLocked(frameId);
+    }
+
+    void release(uchar frameId)
+    {
+        std::lock_guard<std::mutex> guard(mtx);
+        if (!slots[frameId].inUse)
+            return;
+        slots[frameId].inUse = false;
+        slots[frameId].acked = false;
+        slots[frameId].nacked = false;
+        inFlight--;
+        slotCv.notify_one();
+    }
+
+    // frameId for a fire-and-forget frame: it is not tracked, but it is never one
+    // that an in-flight request is waiting on.
+    uchar untrackedFrameId()
+    {
+        std::lock_guard<std::mutex> guard(mtx);
+        return nextFrameId();
+    }
+
+    // returns true when frame acknowledges one of the in-flight frames
+    bool checkAck(ResponseData *frame)
     {
-        frameAck = this->frameId == frame->frameId && //
-                   frame->size > 2 &&                 //
-                   frame->data[2] == PROTOCOL_ACK;
+        if (frame->size <= 2 || frame->data[2] != PROTOCOL_ACK)
+            return false;
+
+        std::lock_guard<std::mutex> guard(mtx);
+        if (!slots[frame->frameId].inUse)
+            return false;
+
+        slots[frame->frameId].acked = true;
 #ifdef DEBUG
-        printf("check ack result: %d\n", frameAck);
+        printf("check ack result for frameId %d: %d\n", frame->frameId, slots[frame->frameId].acked);
 #endif
+        // several requesters may be waiting, each on its own frameId
+        ackCv.notify_all();
+        return true;
+    }
+
+    // returns true when frame is a NACK for one of the in-flight frames: the
+    // device got it damaged, it should be resent right away
+    bool checkNack(ResponseData *frame)
+    {
+        if (frame->size <= 2 || frame->data[2] != PROTOCOL_NACK)
+            return false;
+
+        std::lock_guard<std::mutex> guard(mtx);
+        if (!slots[frame->frameId].inUse || slots[frame->frameId].acked)
+            return false;
+
+        slots[frame->frameId].nacked = true;
+        ackCv.notify_all();
+        return true;
     }
 
     bool isAck(uchar frameId)
     {
-#ifdef DEBUG
-        // printf("isAck?: %d\n", frameAck && this->frameId == frameId);
-#endif
-        return frameAck && this->frameId == frameId;
+        std::lock_guard<std::mutex> guard(mtx);
+        return slots[frameId].inUse && slots[frameId].acked;
+    }
+
+    // blocks until frameId is acked or nacked, or deadline passes. Returns whether
+    // it was acked.
+    bool waitAck(uchar frameId, std::chrono::steady_clock::time_point deadline)
+    {
+        std::unique_lock<std::mutex> lk(mtx);
+        Slot &s = slots[frameId];
+        ackCv.wait_until(lk, deadline, [&s] { return s.inUse && (s.acked || s.nacked); });
+        s.nacked = false;
+        return s.inUse && s.acked;
+    }
+};
+
+// called with true once the request is acked, or false when it timed out
+typedef std::function<void(bool)> SerialLinkCompletion;
+
+// a request sent with asyncRequestWithAck() that is waiting for its ACK. The
+// timer wheel retransmits it after the link's retransmission timeout, backing
+// off on every retry, until the deadline.
+typedef struct PendingRequest
+{
+    bool active;
+    uchar payload[SND_BUFFER_SIZE];
+    int size;
+    std::chrono::steady_clock::time_point deadline;
+    std::chrono::steady_clock::time_point sentAt;
+    unsigned int retries;  // resends for any reason, the ACK is then no RTT sample
+    unsigned int timeouts; // resends after the timer expired, each doubles the timeout
+    bool written;          // the TX thread sent the last copy posted, its timer runs
+    SerialLinkCompletion onComplete;
+} PendingRequest;
+
+// a request that arrived while the ack window was full
+typedef struct QueuedRequest
+{
+    uchar payload[SND_BUFFER_SIZE];
+    int size;
+    std::chrono::steady_clock::time_point deadline;
+    SerialLinkCompletion onComplete;
+} QueuedRequest;
+
+// the queued requests, oldest first, in a ring of REQUEST_BACKLOG_SIZE slots so
+// queueing one doesn't allocate. head/tail are free running counters, the slot
+// index is (counter & (REQUEST_BACKLOG_SIZE - 1)). Guarded by pendingMtx.
+class RequestBacklog
+{
+private:
+    QueuedRequest items[REQUEST_BACKLOG_SIZE];
+    unsigned int head;
+    unsigned int tail;
+
+public:
+    RequestBacklog()
+    {
+        head = 0;
+        tail = 0;
+    }
+
+    bool empty()
+    {
+        return head == tail;
+    }
+
+    bool full()
+    {
+        return head - tail == REQUEST_BACKLOG_SIZE;
+    }
+
+    QueuedRequest &front()
+    {
+        return items[tail & (REQUEST_BACKLOG_SIZE - 1)];
+    }
+
+    // the free slot push() adds, filled in first. There must be room.
+    QueuedRequest &back()
+    {
+        return items[head & (REQUEST_BACKLOG_SIZE - 1)];
+    }
+
+    void push()
+    {
+        head++;
+    }
+
+    // drops front() along with whatever its completion holds
+    void pop()
+    {
+        front().onComplete = nullptr;
+        tail++;
     }
 };
 
-typedef struct SerialLinkResponseCallback
+// a deviceId streaming its samples (arduino/subscription.h), renewed on the
+// timer wheel until unsubscribe()
+typedef struct Subscription
+{
+    bool active;
+    uint16_t period_ms;
+    std::chrono::steady_clock::time_point renewAt;
+} Subscription;
+
+// requests collected into one DATA_LIST frame: [frameId, DATA_LIST, entries...],
+// each entry being [deviceId, 1 + num_params, params...]. The whole batch is
+// acked once, completions holds the callbacks of the requests that wait for it.
+typedef struct TxBatch
 {
-    uchar id;
-    std::function<void(ResponseData *)> callback;
-} SerialLinkResponseCallback;
+    uchar payload[SND_BUFFER_SIZE];
+    int size;
+    int count;
+    std::vector<SerialLinkCompletion> completions;
+} TxBatch;
 
 class SerialLink : public ISerialLink
 {
@@ -69,38 +324,174 @@ private:
     ISerialCommunication *comm;
     std::thread *rcvThread;
     std::mutex commMtx;
-    AckWait requestAckWaitCheck;
+    TxScheduler txScheduler;
+    std::atomic<uchar> deviceTxClass[HANDLER_TABLE_SIZE];
+    AckWindow requestAckWindow;
+    RttEstimator rtt;
+    ResponseDataPool responsePool;
+    LinkMetrics metrics;
+    FrameRecorder recorder;
+    FragmentReassembler reassembler;
+    std::atomic<uchar> nextMessageId;
 
+    std::thread *timerThread;
+    std::mutex pendingMtx;
+    std::condition_variable timerCv;
+    std::condition_variable backlogCv; // the backlog emptied
+    TimerWheel requestTimers;
+    PendingRequest pendingRequests[FRAME_ID_COUNT];
+    RequestBacklog requestBacklog;
+    std::chrono::steady_clock::time_point startTime;
 
-    std::queue<ResponseData *> rcvFramesQueue;
+    TxBatch txBatch;
+    Subscription subscriptions[HANDLER_TABLE_SIZE];
+    unsigned int txBatchWindow_ms;
+    unsigned int txBatchMaxSize;
 
-    bool run;
+    DispatchExecutor *dispatcher;
+    unsigned int dispatchWorkers;
+
+    // set when the link is served by a shared reactor instead of its own threads.
+    // timerFd then drives the timer wheel, a one-shot timer set to the earliest
+    // deadline and disarmed while nothing is timed. txTimerFd has the reactor
+    // write the frames the TxScheduler queues, spaced SERIAL_WAIT_DELAY_ms
+    // apart, txWriting is the one the port has part of.
+    SerialReactor *reactor;
+    int timerFd;
+    // when the timer thread or timerFd wakes up next, time_point::max() while
+    // nothing is timed. Guarded by pendingMtx.
+    std::chrono::steady_clock::time_point timerWakeAt;
+    int txTimerFd;
+    TxFrame *txWriting;
+
+    std::atomic<bool> run;
+    bool eventDriven;
+    int shutdownFd;
 
     void initialize();
     void lock();
     void unlock();
     int wait();
     void rcvThreadHandlerValid();
+    void rcvThreadHandlerUnpooled();
     void rcvThreadHandler();
-    void executeCallbackForMessageData(ResponseData *rcvMsg);
+    void rcvThreadHandlerPoll();
+    void rcvThreadHandlerEvent();
+    void receivePendingFrames();
+    void executeCallbackForMessageData(ResponseData *rcvMsg, PooledResponseData *frame);
     void printRawData(const char *sensorName, ResponseData *p);
-    void processListData(ResponseData *rcvMsg);
-    uchar *allocBuffer(int size);
+    void processListData(ResponseData *rcvMsg, PooledResponseData *frame);
+    void processData(ResponseData *rcvMsg, PooledResponseData *frame);
+    void processAck(ResponseData *rcvMsg);
+    void processFragment(ResponseData *rcvMsg);
     void request(int num_params, uchar *payload);
+    bool postRequest(int num_params, uchar *payload);
+    bool startFrame(TxFrame *f, bool wait);
+    void frameWritten(TxFrame *f);
+    void writeFrame(TxFrame *f);
+    int txClassOf(const uchar *payload);
+    void untrackedRequest(int num_params, uchar *payload);
     bool syncRequest(int num_params, uchar *payload);
-    void clearHandlers();
+    uint64_t timerTick();
+    void timerThreadHandler();
+    void expireTimers(std::vector<SerialLinkCompletion> &failed);
+    void wakeTimer(std::chrono::steady_clock::time_point at);
+    std::chrono::steady_clock::time_point nextTimerDeadline();
+    void armTimerFd(std::chrono::steady_clock::time_point at);
+    bool attachToReactor();
+    void reactorTimerHandler();
+    void reactorTxHandler();
+    void armTxTimer(unsigned int delay_ms);
+    void drainTx();
+    void startPendingRequest(uchar frameId, uchar *payload, int size, std::chrono::steady_clock::time_point deadline, SerialLinkCompletion &onComplete);
+    void releaseFrame(uchar frameId, std::vector<SerialLinkCompletion> &failed);
+    void completePendingRequest(uchar frameId, bool acked);
+    void retransmitPendingRequest(uchar frameId);
+    void submitRequest(int num_params, uchar *payload, SerialLinkCompletion onComplete);
+    void scheduleTimer(int id, unsigned int delay_ms);
+    static int rttDevice(const uchar *payload);
+    template <typename Schema, typename... Args>
+    static void buildRequest(uchar *payload, uchar deviceId, Args... values)
+    {
+        static_assert(REQUEST_HEADER_SIZE + Schema::size <= SND_BUFFER_SIZE, "message larger than the send buffer");
+        static_assert(REQUEST_HEADER_SIZE + Schema::size <= DEVICE_FRAME_MAX_SIZE, "message larger than the device receives");
+        payload[0] = 0;
+        payload[1] = PROTOCOL_FRAME_TYPE_DATA;
+        payload[2] = deviceId;
+        Schema::encode(payload + REQUEST_HEADER_SIZE, values...);
+    }
+    bool enqueueRequest(uchar *payload, int size, std::chrono::steady_clock::time_point deadline, SerialLinkCompletion &onComplete);
+    bool appendToBatch(int num_params, uchar *payload, SerialLinkCompletion &onComplete, std::vector<SerialLinkCompletion> &failed);
+    void flushBatch(std::vector<SerialLinkCompletion> &failed);
+    static int buildSubscribe(uchar *payload, uchar deviceId, uint16_t period_ms);
+    void renewSubscriptions();
     
 protected:
-    std::map<uchar, std::vector<SerialLinkResponseCallback *> *> *handlers;
+    HandlerRegistry handlers;
+
+    // dispatches rcvMsg to the handlers. rcvMsg is only borrowed for the duration
+    // of the call, as are the ResponseData passed to the handlers.
     void processData(ResponseData *rcvMsg);
 
 public:
-    SerialLink(ISerialCommunication *comm);
-    SerialLink(const char *device);
+    // dispatchWorkers threads run the handlers, frames of the same deviceId are
+    // handled in order. With 0 the handlers run on the receive thread.
+    SerialLink(ISerialCommunication *comm, bool eventDriven = true, unsigned int dispatchWorkers = DISPATCH_WORKERS_DEFAULT);
+    SerialLink(const char *device, bool eventDriven = true, unsigned int dispatchWorkers = DISPATCH_WORKERS_DEFAULT);
+
+    // served by reactor: no thread of its own, the reactor receives, writes the
+    // frames and runs the timers, handlers run on its dispatch workers. The
+    // reactor must outlive the link. A comm without a file descriptor can't be watched,
+    // the link then falls back to its own threads.
+    SerialLink(ISerialCommunication *comm, SerialReactor *reactor);
+    SerialLink(const char *device, SerialReactor *reactor);
 
     ~SerialLink();
+
+    // maximum number of syncRequest() frames waiting for their ACK at the same time.
+    // A size of 1 gives plain stop-and-wait.
+    void setAckWindowSize(unsigned int size);
+
+    // Nagle-style batching of outbound requests. Requests are held for up to
+    // window_ms and sent together as one DATA_LIST frame with a single ACK, the
+    // batch goes out earlier once it reaches maxFrameSize bytes. syncRequest()
+    // waits for the ACK of its batch, asyncRequest() is acked and retransmitted
+    // with the rest of the batch. A window of 0 turns batching off.
+    void setTxBatching(unsigned int window_ms, unsigned int maxFrameSize = TX_BATCH_MAX_SIZE);
+
+    // Transmit class of the requests to deviceId (TX_CLASS_NORMAL by default).
+    // TX_CLASS_CONTROL frames, e.g. for the motors, go out before anything else
+    // queued and are never held in a TX batch. ACKs are control frames too,
+    // fragments of sendMessage() are TX_CLASS_BULK. See TxScheduler.
+    void setDevicePriority(uchar deviceId, int txClass);
+    // frames per round of TX_CLASS_NORMAL and TX_CLASS_BULK when both are busy
+    void setTxWeight(int txClass, unsigned int weight);
+
+    // round-trip estimates driving the retransmission timeout, for the whole
+    // link or for the frames sent to one deviceId
+    RttStats getRttStats();
+    RttStats getRttStats(uchar deviceId);
+
+    // queue depth, drops and handler latency of the dispatch workers. All zero
+    // when the handlers run on the receive thread.
+    DispatchStats getDispatchStats();
+
+    // frame, error and retransmission counters of the link and its serial port,
+    // with ack round-trip, dispatch wait and handler time histograms. Counting is
+    // always on, reading takes a consistent-enough copy without stopping the link.
+    LinkMetricsSnapshot getMetrics();
+    // the same as plain text, one "<prefix>_<metric> value" line per metric
+    std::string dumpMetrics(const char *prefix = "serial_link");
+
+    // Records every frame sent and received, with its time and direction, into
+    // a capture file at path (frame_capture.h) until stopRecording() or until
+    // capacity bytes are used. Replay it with ReplayCommunication.
+    bool startRecording(const char *path, uint32_t capacity = FRAME_CAPTURE_DEFAULT_SIZE);
+    void stopRecording();
+
     void addHandler(uchar deviceId, uchar handlerId, std::function<void(ResponseData *)> &func) override;
     void removeHandler(uchar deviceId, uchar handlerId) override;
+    bool hasHandler(uchar deviceId, uchar handlerId) override;
     
 
     bool syncRequest(uchar deviceId) override;
@@ -112,6 +503,62 @@ public:
     void asyncRequest(uchar deviceId, uchar val1) override;
     void asyncRequest(int deviceId, uchar val1, uchar val2) override;
     void asyncRequest(int deviceId, uchar val1, uchar val2, uchar val3) override;
+
+    // Non-blocking requests that still get acked and retransmitted like syncRequest().
+    // Completion runs on the receive thread (ack) or on the timer thread (timeout),
+    // so callbacks should be short. A caller outpacing the link waits while the
+    // ack window is full and requests are already queued behind it.
+    std::future<bool> asyncRequestWithAck(uchar deviceId, const uchar *params, int num_params);
+    void asyncRequestWithAck(uchar deviceId, const uchar *params, int num_params, SerialLinkCompletion onComplete);
+
+    // Sends size bytes (up to FRAGMENT_MAX_MESSAGE_SIZE) to deviceId as one
+    // message of FRAGMENT frames (arduino/fragment.h), which the device acks as a
+    // whole. Resent until acked or REQUEST_TIMEOUT_ms after the first
+    // transmission was out. Returns whether it was acked.
+    //
+    // Messages the device sends this way are reassembled and handed to the
+    // handlers of their deviceId as a single ResponseData of frameType
+    // PROTOCOL_FRAME_TYPE_FRAGMENT, data being the message itself. They run on
+    // the receive thread and must not keep data after returning.
+    bool sendMessage(uchar deviceId, const uchar *data, unsigned int size);
+
+    // Asks the device to push the samples of deviceId every period_ms (at least
+    // SUBSCRIPTION_MIN_PERIOD_ms) instead of being polled for them. The samples
+    // reach the handlers of deviceId as DATA_LIST entries, see processListData().
+    // The subscription is renewed in the background, the device drops it on its
+    // own when that stops. Returns whether the device acked it.
+    bool subscribe(uchar deviceId, unsigned int period_ms);
+    bool unsubscribe(uchar deviceId);
+
+    // Typed requests: the params are laid out by Schema (arduino/message_schema.h),
+    // which the device decodes with the same schema, e.g.
+    //     link.syncRequest<MessageSchema<uint8_t, int16_t>>(deviceId, mode, speed);
+    // A message too large for a frame doesn't compile.
+    template <typename Schema, typename... Args>
+    bool syncRequest(uchar deviceId, Args... values)
+    {
+        uchar payload[REQUEST_HEADER_SIZE + Schema::size];
+        buildRequest<Schema>(payload, deviceId, values...);
+        return syncRequest((int)sizeof(payload), payload);
+    }
+
+    template <typename Schema, typename... Args>
+    void asyncRequest(uchar deviceId, Args... values)
+    {
+        uchar payload[REQUEST_HEADER_SIZE + Schema::size];
+        buildRequest<Schema>(payload, deviceId, values...);
+        untrackedRequest((int)sizeof(payload), payload);
+    }
+
+    template <typename Schema, typename... Args>
+    std::future<bool> asyncRequestWithAck(uchar deviceId, Args... values)
+    {
+        static_assert(REQUEST_HEADER_SIZE + Schema::size <= SND_BUFFER_SIZE, "message larger than the send buffer");
+        static_assert(REQUEST_HEADER_SIZE + Schema::size <= DEVICE_FRAME_MAX_SIZE, "message larger than the device receives");
+        uchar params[Schema::size > 0 ? Schema::size : 1];
+        Schema::encode(params, values...);
+        return asyncRequestWithAck(deviceId, params, (int)Schema::size);
+    }
 };
 
 #endif
\ No newline at end of file
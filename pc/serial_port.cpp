@@ -0,0 +1,116 @@
+#include "serial_port.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <termios.h>
+#include <sys/ioctl.h>
+#include <linux/serial.h>
+
+static speed_t baudToSpeed(unsigned int baud)
+{
+    switch (baud)
+    {
+    case 9600:
+        return B9600;
+    case 19200:
+        return B19200;
+    case 38400:
+        return B38400;
+    case 57600:
+        return B57600;
+    case 115200:
+        return B115200;
+    case 230400:
+        return B230400;
+    case 460800:
+        return B460800;
+    case 500000:
+        return B500000;
+    case 576000:
+        return B576000;
+    case 921600:
+        return B921600;
+    case 1000000:
+        return B1000000;
+    case 1152000:
+        return B1152000;
+    case 1500000:
+        return B1500000;
+    case 2000000:
+        return B2000000;
+    default:
+        return B0;
+    }
+}
+
+SerialPortConfig serialPortDefaultConfig(unsigned int baud)
+{
+    SerialPortConfig config;
+    config.baud = baud;
+    config.vmin = 0;
+    config.vtime = 0;
+    config.lowLatency = true;
+    config.nonBlocking = true;
+    return config;
+}
+
+int serialPortOpen(const char *device, const SerialPortConfig &config)
+{
+    speed_t speed = baudToSpeed(config.baud);
+    if (speed == B0)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    int flags = O_RDWR | O_NOCTTY | O_CLOEXEC;
+    if (config.nonBlocking)
+        flags |= O_NONBLOCK;
+
+    int fd = open(device, flags);
+    if (fd < 0)
+        return -1;
+
+    struct termios tio;
+    if (tcgetattr(fd, &tio) < 0)
+    {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+
+    cfmakeraw(&tio);
+    tio.c_cflag |= CLOCAL | CREAD;
+    tio.c_cflag &= ~(CSTOPB | CRTSCTS);
+    tio.c_cc[VMIN] = config.vmin;
+    tio.c_cc[VTIME] = config.vtime;
+    cfsetispeed(&tio, speed);
+    cfsetospeed(&tio, speed);
+
+    if (tcsetattr(fd, TCSANOW, &tio) < 0)
+    {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+
+    if (config.lowLatency)
+    {
+        // only real serial drivers support this, ptys and some USB adapters don't
+        struct serial_struct ss;
+        if (ioctl(fd, TIOCGSERIAL, &ss) == 0)
+        {
+            ss.flags |= ASYNC_LOW_LATENCY;
+            if (ioctl(fd, TIOCSSERIAL, &ss) < 0)
+                fprintf(stderr, "unable to set %s low latency: %s\n", device, strerror(errno));
+        }
+    }
+
+    tcflush(fd, TCIOFLUSH);
+    return fd;
+}
@@ -0,0 +1,23 @@
+#ifndef _SERIAL_PORT_H
+#define _SERIAL_PORT_H
+
+#define SERIAL_PORT_DEFAULT_BAUD 115200
+
+// how serialPortOpen() sets up the tty
+typedef struct SerialPortConfig
+{
+    unsigned int baud;      // up to 2000000, the standard Linux rates only
+    unsigned char vmin;     // termios VMIN/VTIME, only used by blocking reads
+    unsigned char vtime;    // in tenths of a second
+    bool lowLatency;        // ASYNC_LOW_LATENCY: no extra buffering in the driver
+    bool nonBlocking;       // O_NONBLOCK, what SerialCommunication expects
+} SerialPortConfig;
+
+SerialPortConfig serialPortDefaultConfig(unsigned int baud = SERIAL_PORT_DEFAULT_BAUD);
+
+// opens device (a tty or a pty) in raw 8N1 mode without flow control and flushes
+// whatever is pending. Returns the fd, or -1 with errno set. A device that
+// doesn't know ASYNC_LOW_LATENCY (e.g. a pty) is opened anyway.
+int serialPortOpen(const char *device, const SerialPortConfig &config);
+
+#endif
@@ -0,0 +1,138 @@
+#include "serial_reactor.h"
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+SerialReactor::SerialReactor(unsigned int dispatchWorkers)
+{
+    run = true;
+    executor = nullptr;
+    loopThread = nullptr;
+    epollFd = epoll_create1(EPOLL_CLOEXEC);
+    shutdownFd = eventfd(0, EFD_CLOEXEC);
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = shutdownFd;
+    if (epollFd < 0 || shutdownFd < 0 || epoll_ctl(epollFd, EPOLL_CTL_ADD, shutdownFd, &ev) < 0)
+    {
+        // add() then fails, links fall back to threads of their own
+        fprintf(stderr, "unable to initialize the serial reactor: %s\n", strerror(errno));
+        return;
+    }
+
+    if (dispatchWorkers > 0)
+        executor = new DispatchExecutor(dispatchWorkers);
+    loopThread = new std::thread(&SerialReactor::loop, this);
+}
+
+SerialReactor::~SerialReactor()
+{
+    run = false;
+    if (loopThread != nullptr)
+    {
+        uint64_t v = 1;
+        if (::write(shutdownFd, &v, sizeof(v)) < 0)
+            fprintf(stderr, "unable to signal reactor shutdown: %s\n", strerror(errno));
+        loopThread->join();
+        delete loopThread;
+    }
+
+    delete executor;
+    if (shutdownFd >= 0)
+        close(shutdownFd);
+    if (epollFd >= 0)
+        close(epollFd);
+}
+
+bool SerialReactor::isOpen()
+{
+    return loopThread != nullptr;
+}
+
+void SerialReactor::loop()
+{
+    struct epoll_event events[REACTOR_MAX_EVENTS];
+
+    while (run)
+    {
+        // handlers may run on this thread, it holds no handler list while it waits
+        ReaderEpochs::idle();
+        int n = epoll_wait(epollFd, events, REACTOR_MAX_EVENTS, -1);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "serial reactor: epoll_wait failed: %s\n", strerror(errno));
+            return;
+        }
+
+        std::lock_guard<std::recursive_mutex> guard(callbacksMtx);
+        for (int i = 0; i < n; i++)
+        {
+            int fd = events[i].data.fd;
+            if (fd == shutdownFd)
+                return;
+
+            // a callback earlier in this batch may have removed fd
+            auto it = callbacks.find(fd);
+            if (it == callbacks.end())
+                continue;
+
+            if (!(events[i].events & EPOLLIN) && (events[i].events & (EPOLLERR | EPOLLHUP)))
+            {
+                // the peer went away: stop watching instead of spinning on it
+                fprintf(stderr, "serial reactor: fd %d hung up, no longer watched\n", fd);
+                epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, nullptr);
+                callbacks.erase(it);
+                continue;
+            }
+
+            // the callback may remove itself, keep it alive while it runs
+            std::function<void()> onReadable = it->second;
+            onReadable();
+        }
+    }
+}
+
+bool SerialReactor::add(int fd, std::function<void()> onReadable)
+{
+    if (!isOpen())
+        return false;
+
+    std::lock_guard<std::recursive_mutex> guard(callbacksMtx);
+    callbacks[fd] = onReadable;
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &ev) < 0)
+    {
+        fprintf(stderr, "serial reactor: unable to watch fd %d: %s\n", fd, strerror(errno));
+        callbacks.erase(fd);
+        return false;
+    }
+    return true;
+}
+
+void SerialReactor::remove(int fd)
+{
+    std::lock_guard<std::recursive_mutex> guard(callbacksMtx);
+    epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, nullptr);
+    callbacks.erase(fd);
+}
+
+bool SerialReactor::onLoopThread()
+{
+    return loopThread != nullptr && std::this_thread::get_id() == loopThread->get_id();
+}
+
+DispatchExecutor *SerialReactor::dispatcher()
+{
+    return executor;
+}
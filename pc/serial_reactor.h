@@ -0,0 +1,63 @@
+#ifndef _SERIAL_REACTOR_H
+#define _SERIAL_REACTOR_H
+
+#include <stdio.h>
+#include <thread>
+#include <mutex>
+#include <map>
+#include <functional>
+#include <atomic>
+
+#include "dispatch_executor.h"
+
+#define REACTOR_MAX_EVENTS 32
+
+// One epoll loop serving the descriptors of many SerialLinks: their serial
+// ports, their retransmission timers and the timers pacing their writes. Links
+// created with a reactor don't start threads of their own and hand their
+// frames to the reactor's shared DispatchExecutor, so the number of threads
+// stays the same however many boards are connected. Callbacks never wait on a
+// port: one busy link doesn't hold up the others.
+class SerialReactor
+{
+private:
+    int epollFd;
+    int shutdownFd;
+    std::thread *loopThread;
+    std::atomic<bool> run;
+
+    // held by the loop while it runs callbacks, so remove() can wait for them
+    std::recursive_mutex callbacksMtx;
+    std::map<int, std::function<void()>> callbacks;
+
+    DispatchExecutor *executor;
+
+    void loop();
+
+public:
+    // dispatchWorkers threads run the handlers of every link. With 0 the
+    // handlers run on the reactor thread.
+    SerialReactor(unsigned int dispatchWorkers = DISPATCH_WORKERS_DEFAULT);
+    ~SerialReactor();
+
+    // false when the epoll loop couldn't be set up: links given this reactor
+    // then run threads of their own
+    bool isOpen();
+
+    // calls onReadable on the reactor thread whenever fd is readable (level
+    // triggered: it must drain the fd or it is called again right away).
+    // Returns false when fd can't be watched, or the reactor isn't open.
+    bool add(int fd, std::function<void()> onReadable);
+
+    // once remove() returns the callback of fd isn't running and won't run again.
+    // May be called from inside a callback.
+    void remove(int fd);
+
+    // true when called from a callback or a handler on the reactor thread
+    bool onLoopThread();
+
+    // nullptr when the handlers run on the reactor thread
+    DispatchExecutor *dispatcher();
+};
+
+#endif
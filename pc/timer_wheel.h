@@ -0,0 +1,146 @@
+#ifndef _TIMER_WHEEL_H
+#define _TIMER_WHEEL_H
+
+#include <stdint.h>
+
+#define TIMER_WHEEL_SLOTS 256 // must be a power of two
+#define TIMER_WHEEL_TICK_ms 1
+#define TIMER_WHEEL_MAX_TIMERS 512
+
+// Hashed timer wheel for a fixed set of timer ids (0 .. TIMER_WHEEL_MAX_TIMERS-1).
+// Each id has at most one pending expiry. Scheduling and cancelling are O(1),
+// advance() only looks at the slots of the ticks that went by. Timers further
+// away than one turn of the wheel simply stay in their slot for more rounds.
+// Not thread safe: the owner serialises access.
+class TimerWheel
+{
+private:
+    int slotHead[TIMER_WHEEL_SLOTS];
+    int next[TIMER_WHEEL_MAX_TIMERS];
+    int prev[TIMER_WHEEL_MAX_TIMERS];
+    uint64_t expiry[TIMER_WHEEL_MAX_TIMERS];
+    bool armed[TIMER_WHEEL_MAX_TIMERS];
+    uint64_t currentTick;
+    unsigned int count;
+
+    void unlink(int id)
+    {
+        int slot = expiry[id] & (TIMER_WHEEL_SLOTS - 1);
+        if (prev[id] >= 0)
+            next[prev[id]] = next[id];
+        else
+            slotHead[slot] = next[id];
+        if (next[id] >= 0)
+            prev[next[id]] = prev[id];
+        armed[id] = false;
+        count--;
+    }
+
+public:
+    TimerWheel()
+    {
+        currentTick = 0;
+        count = 0;
+        for (int i = 0; i < TIMER_WHEEL_SLOTS; i++)
+            slotHead[i] = -1;
+        for (int i = 0; i < TIMER_WHEEL_MAX_TIMERS; i++)
+            armed[i] = false;
+    }
+
+    // (re)arms timer id to fire delay_ticks after the current tick, returns the
+    // tick it expires at
+    uint64_t schedule(int id, uint64_t delay_ticks)
+    {
+        if (armed[id])
+            unlink(id);
+
+        if (delay_ticks == 0)
+            delay_ticks = 1;
+
+        expiry[id] = currentTick + delay_ticks;
+        int slot = expiry[id] & (TIMER_WHEEL_SLOTS - 1);
+        prev[id] = -1;
+        next[id] = slotHead[slot];
+        if (slotHead[slot] >= 0)
+            prev[slotHead[slot]] = id;
+        slotHead[slot] = id;
+        armed[id] = true;
+        count++;
+        return expiry[id];
+    }
+
+    void cancel(int id)
+    {
+        if (armed[id])
+            unlink(id);
+    }
+
+    bool isArmed(int id)
+    {
+        return armed[id];
+    }
+
+    bool empty()
+    {
+        return count == 0;
+    }
+
+    uint64_t tick()
+    {
+        return currentTick;
+    }
+
+    // the tick the earliest armed timer expires at, the wheel must not be empty.
+    // Walks the slots of the next turn first, a timer in the slot of tick t
+    // with its expiry at t is the earliest one. Only when none is due within
+    // the turn does it look at every timer.
+    uint64_t nextExpiry()
+    {
+        for (uint64_t t = currentTick + 1; t <= currentTick + TIMER_WHEEL_SLOTS; t++)
+        {
+            for (int id = slotHead[t & (TIMER_WHEEL_SLOTS - 1)]; id >= 0; id = next[id])
+            {
+                if (expiry[id] == t)
+                    return t;
+            }
+        }
+        uint64_t earliest = UINT64_MAX;
+        for (int id = 0; id < TIMER_WHEEL_MAX_TIMERS; id++)
+        {
+            if (armed[id] && expiry[id] < earliest)
+                earliest = expiry[id];
+        }
+        return earliest;
+    }
+
+    // moves the wheel up to nowTick and calls onExpire(id) for every timer that
+    // came due. onExpire may schedule() the expired id again or any timer that
+    // isn't armed.
+    template <typename F>
+    void advance(uint64_t nowTick, F onExpire)
+    {
+        while (currentTick < nowTick)
+        {
+            currentTick++;
+            int slot = currentTick & (TIMER_WHEEL_SLOTS - 1);
+            int id = slotHead[slot];
+            while (id >= 0)
+            {
+                int n = next[id];
+                if (expiry[id] <= currentTick)
+                {
+                    unlink(id);
+                    onExpire(id);
+                }
+                id = n;
+            }
+            if (count == 0)
+            {
+                currentTick = nowTick;
+                return;
+            }
+        }
+    }
+};
+
+#endif
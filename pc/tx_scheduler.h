@@ -0,0 +1,290 @@
+#ifndef _TX_SCHEDULER_H
+#define _TX_SCHEDULER_H
+
+#include <string.h>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <thread>
+#include <functional>
+
+#include "comm_types.h"
+#include "serial_comm_pi.h"
+
+// transmit classes, from the most to the least urgent
+#define TX_CLASS_CONTROL 0 // strict priority: stop and motor commands, ACKs
+#define TX_CLASS_NORMAL 1
+#define TX_CLASS_BULK 2    // fragments of large messages, telemetry bursts
+#define TX_CLASS_COUNT 3
+
+// frames send() queues per class, a sender finding its class full waits for room
+#define TX_QUEUE_SIZE 32
+// copies post() may have queued at once, across all classes
+#define TX_POST_FRAMES 64
+// frames a weighted class may send per round
+#define TX_WEIGHT_NORMAL 4
+#define TX_WEIGHT_BULK 1
+
+// a frame handed to TxScheduler::send(), living on the stack of the thread
+// waiting for it to be sent, or a copy made by TxScheduler::post()
+typedef struct TxFrame
+{
+    const uchar *payload;
+    int size;
+    int txClass;
+    bool sent;
+    bool posted;
+    std::chrono::steady_clock::time_point queuedAt;
+    uchar copy[SND_BUFFER_SIZE];
+    TxFrame *next; // in its class queue, or in the free list of the copies
+} TxFrame;
+
+// the frames of a class waiting to be written, linked through TxFrame::next so
+// queueing never allocates
+typedef struct TxQueue
+{
+    TxFrame *head;
+    TxFrame *tail;
+    unsigned int size;
+} TxQueue;
+
+// Orders the frames the threads of a link send, written one at a time by the
+// scheduler's own thread, or without a thread by whoever serves the link (see
+// startDriven()). Control frames always go first, the other classes share
+// what is left by weighted round robin, in frames rather than bytes: after
+// every frame the port waits the same SERIAL_WAIT_DELAY_ms whatever its size.
+// A control frame thus never waits for more than the frame being written when
+// it arrives.
+class TxScheduler
+{
+private:
+    std::mutex mtx;
+    std::condition_variable queuedCv; // a frame was queued, or stop()
+    std::condition_variable sentCv;   // a frame was sent, its queue has room
+    TxQueue queues[TX_CLASS_COUNT];
+    unsigned int weights[TX_CLASS_COUNT];
+    int current;          // weighted class served by the round robin
+    unsigned int credit;  // frames it may still send this round
+    unsigned int queued;
+    // driven mode: called when a frame is queued while the writer is idle
+    std::function<void()> wake;
+    bool idle;
+    // the copies post() makes, recycled through a free list
+    TxFrame postFrames[TX_POST_FRAMES];
+    TxFrame *freeFrames;
+    bool run;
+    std::thread *thread;
+    std::function<void(TxFrame *)> write;
+
+    // mtx must be held, some frame must be queued
+    TxFrame *next()
+    {
+        int c = TX_CLASS_CONTROL;
+        if (queues[TX_CLASS_CONTROL].size == 0)
+        {
+            while (queues[current].size == 0 || credit == 0)
+            {
+                current = current == TX_CLASS_COUNT - 1 ? TX_CLASS_CONTROL + 1 : current + 1;
+                credit = weights[current];
+            }
+            credit--;
+            c = current;
+        }
+
+        TxQueue &queue = queues[c];
+        TxFrame *frame = queue.head;
+        queue.head = frame->next;
+        if (queue.head == nullptr)
+            queue.tail = nullptr;
+        queue.size--;
+        queued--;
+        return frame;
+    }
+
+    // mtx must be held
+    void enqueue(TxFrame *frame)
+    {
+        TxQueue &queue = queues[frame->txClass];
+        frame->sent = false;
+        frame->queuedAt = std::chrono::steady_clock::now();
+        frame->next = nullptr;
+        if (queue.tail != nullptr)
+            queue.tail->next = frame;
+        else
+            queue.head = frame;
+        queue.tail = frame;
+        queue.size++;
+        queued++;
+        queuedCv.notify_one();
+        if (wake && idle)
+        {
+            idle = false;
+            wake();
+        }
+    }
+
+    // mtx must be held, frame was written
+    void finish(TxFrame *frame)
+    {
+        if (frame->posted)
+        {
+            frame->next = freeFrames;
+            freeFrames = frame;
+        }
+        else
+            frame->sent = true;
+        sentCv.notify_all();
+    }
+
+    // sends until stop(), and then whatever is still queued
+    void threadHandler()
+    {
+        std::unique_lock<std::mutex> lk(mtx);
+        while (true)
+        {
+            queuedCv.wait(lk, [this] { return queued > 0 || !run; });
+            if (queued == 0)
+                return;
+
+            TxFrame *f = next();
+            lk.unlock();
+            write(f);
+            lk.lock();
+            finish(f);
+        }
+    }
+
+public:
+    TxScheduler()
+    {
+        weights[TX_CLASS_CONTROL] = 0;
+        weights[TX_CLASS_NORMAL] = TX_WEIGHT_NORMAL;
+        weights[TX_CLASS_BULK] = TX_WEIGHT_BULK;
+        current = TX_CLASS_NORMAL;
+        credit = TX_WEIGHT_NORMAL;
+        for (int c = 0; c < TX_CLASS_COUNT; c++)
+        {
+            queues[c].head = queues[c].tail = nullptr;
+            queues[c].size = 0;
+        }
+        queued = 0;
+        idle = true;
+        freeFrames = nullptr;
+        for (int i = TX_POST_FRAMES - 1; i >= 0; i--)
+        {
+            postFrames[i].next = freeFrames;
+            freeFrames = &postFrames[i];
+        }
+        run = false;
+        thread = nullptr;
+    }
+
+    ~TxScheduler()
+    {
+        stop();
+    }
+
+    // starts the thread writing the frames with write(TxFrame *)
+    void start(std::function<void(TxFrame *)> write)
+    {
+        this->write = write;
+        run = true;
+        thread = new std::thread(&TxScheduler::threadHandler, this);
+    }
+
+    // no thread: the frames are written by calling take() and done() until
+    // take() has none left. wake() is called, with the scheduler's lock held,
+    // whenever a frame is queued after that: it must only arrange for take() to
+    // be called, e.g. from an event loop.
+    void startDriven(std::function<void()> wake)
+    {
+        std::lock_guard<std::mutex> guard(mtx);
+        this->wake = wake;
+        idle = queued == 0;
+        if (!idle)
+            wake();
+    }
+
+    // driven mode: the next frame to write, nullptr when there is none left
+    TxFrame *take()
+    {
+        std::lock_guard<std::mutex> guard(mtx);
+        if (queued == 0)
+        {
+            idle = true;
+            return nullptr;
+        }
+        return next();
+    }
+
+    // driven mode: frame, returned by take(), was written
+    void done(TxFrame *frame)
+    {
+        std::lock_guard<std::mutex> guard(mtx);
+        finish(frame);
+    }
+
+    // returns once every frame queued is sent. A driven scheduler stops calling
+    // wake(), its owner writes what is still queued with take().
+    void stop()
+    {
+        {
+            std::lock_guard<std::mutex> guard(mtx);
+            wake = nullptr;
+        }
+        if (thread == nullptr)
+            return;
+        {
+            std::lock_guard<std::mutex> guard(mtx);
+            run = false;
+            queuedCv.notify_one();
+        }
+        thread->join();
+        delete thread;
+        thread = nullptr;
+    }
+
+    // frames per round of a weighted class, at least 1. The control class has no weight.
+    void setWeight(int txClass, unsigned int weight)
+    {
+        std::lock_guard<std::mutex> guard(mtx);
+        if (txClass <= TX_CLASS_CONTROL || txClass >= TX_CLASS_COUNT)
+            return;
+        weights[txClass] = weight < 1 ? 1 : weight;
+    }
+
+    // queues frame and returns once it is sent
+    void send(TxFrame *frame)
+    {
+        std::unique_lock<std::mutex> lk(mtx);
+        TxQueue &queue = queues[frame->txClass];
+        sentCv.wait(lk, [&queue] { return queue.size < TX_QUEUE_SIZE; });
+        frame->posted = false;
+        enqueue(frame);
+        sentCv.wait(lk, [frame] { return frame->sent; });
+    }
+
+    // queues a copy of payload and returns without waiting. For the receive and
+    // timer threads, which must not wait behind the frames of other threads, nor
+    // for the TX thread, which takes their locks. Nothing is allocated: the copy
+    // is one of TX_POST_FRAMES, when they are all queued the frame is dropped
+    // and false returned.
+    bool post(const uchar *payload, int size, int txClass)
+    {
+        std::lock_guard<std::mutex> guard(mtx);
+        TxFrame *frame = freeFrames;
+        if (frame == nullptr)
+            return false;
+        freeFrames = frame->next;
+
+        memcpy(frame->copy, payload, size);
+        frame->payload = frame->copy;
+        frame->size = size;
+        frame->txClass = txClass;
+        frame->posted = true;
+        enqueue(frame);
+        return true;
+    }
+};
+
+#endif